@@ -0,0 +1,556 @@
+/*
+    benchmark
+
+    Measures the speed of the parser. This reads in packet-capture
+    files (such as those in the `data` directory), extracts the DNS
+    payloads from UDP packets and reassembled TCP streams, and then
+    parses them over and over again, printing the packets/second
+    for each way of parsing them.
+
+    It first runs a microbenchmark on a built-in referral response
+    with 50 records. It also measures reading the files themselves,
+    comparing the stdio and memory-mapped readers.
+
+    usage:
+        benchmark [<filename1> <filename2> ...]
+ */
+#include "util-pcapfile.h"  /* reads packet capture files */
+#include "util-ipdecode.h"  /* decode TCP/IP packets */
+#include "util-tcpreasm.h"  /* reassembles TCP streams */
+#include "dns-parse.h"      /* decodes DNS payloads */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+    /* The minimum number of times we'll run through all the packets */
+    MIN_ITERATIONS = 100,
+
+    /* The approximate number of nanoseconds each benchmark runs */
+    BENCHMARK_NANOSECONDS = 1000000000,
+};
+
+/**
+ * The collection of DNS payloads extracted from the files, which
+ * we'll parse repeatedly.
+ */
+struct corpus {
+    unsigned char **packets;
+    size_t *lengths;
+    size_t count;
+    size_t max;
+    size_t total_bytes;
+};
+
+/**
+ * On TCP, DNS request/responses are prefixed by a two-byte length field
+ */
+struct dnstcp
+{
+    int state;
+    unsigned short pdu_length;
+};
+
+/**
+ * Get a monotonic timestamp in nanoseconds.
+ */
+static unsigned long long
+_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Add a copy of a DNS payload to our corpus.
+ */
+static void
+_corpus_add(struct corpus *corpus, const unsigned char *buf, size_t length)
+{
+    if (corpus->count >= corpus->max) {
+        corpus->max = corpus->max * 2 + 64;
+        corpus->packets = realloc(corpus->packets, corpus->max * sizeof(corpus->packets[0]));
+        corpus->lengths = realloc(corpus->lengths, corpus->max * sizeof(corpus->lengths[0]));
+        if (corpus->packets == NULL || corpus->lengths == NULL)
+            abort();
+    }
+    corpus->packets[corpus->count] = malloc(length + 1);
+    if (corpus->packets[corpus->count] == NULL)
+        abort();
+    memcpy(corpus->packets[corpus->count], buf, length);
+    corpus->lengths[corpus->count] = length;
+    corpus->count++;
+    corpus->total_bytes += length;
+}
+
+/**
+ * Read in the packet-capture file and add all the DNS payloads we find
+ * to the corpus. This follows the same logic as `digpcap`.
+ */
+static void
+_corpus_load(struct corpus *corpus, const char *filename)
+{
+    struct pcapfile_ctx_t *ctx;
+    int linktype = 0;
+    struct tcpreasm_ctx_t *tcpreasm;
+    time_t secs;
+    long usecs;
+
+    ctx = pcapfile_openread(filename, &linktype, &secs, &usecs);
+    if (ctx == NULL) {
+        fprintf(stderr, "[-] error: %s\n", filename);
+        return;
+    }
+    tcpreasm = tcpreasm_create(sizeof(struct dnstcp), 0, secs, 60);
+
+    for (;;) {
+        time_t time_secs;
+        long time_usecs;
+        size_t original_length;
+        size_t captured_length;
+        const unsigned char *buf;
+        int err;
+        struct packetdecode_t decode;
+
+        err = pcapfile_readframe(ctx, &time_secs, &time_usecs, &original_length, &captured_length, &buf);
+        if (err)
+            break;
+
+        err = util_ipdecode(buf, captured_length, (int)pcapfile_get_datalink(ctx), &decode);
+        if (err)
+            continue;
+        if (decode.port_src != 53)
+            continue;
+
+        if (decode.ip_protocol == 17) {
+            _corpus_add(corpus, buf + decode.app_offset, decode.app_length);
+        } else if (decode.ip_protocol == 6) {
+            struct tcpreasm_tuple_t ins;
+
+            ins = tcpreasm_packet(tcpreasm, buf + decode.ip_offset, decode.ip_length, time_secs, time_usecs * 1000);
+            if (ins.available) {
+                struct dnstcp *d = (struct dnstcp *)ins.userdata;
+                if (d->state == 0 && ins.available >= 2) {
+                    unsigned char foo[2];
+                    d->state = 1;
+                    ins.available -= tcpreasm_read(&ins, foo, 2);
+                    d->pdu_length = foo[0]<<8 | foo[1];
+                }
+                if (d->state == 1 && d->pdu_length <= ins.available) {
+                    unsigned char tmp[65536];
+                    size_t count;
+                    count = tcpreasm_read(&ins, tmp, d->pdu_length);
+                    _corpus_add(corpus, tmp, count);
+                    d->state = 0;
+                }
+            }
+            tcpreasm_timeouts(tcpreasm, time_secs, time_usecs * 1000);
+        }
+    }
+
+    pcapfile_close(ctx);
+}
+
+/**
+ * Parse all the packets in the corpus over and over, printing the
+ * resulting packets/second.
+ */
+static void
+_bench_parse(const struct corpus *corpus, const char *description, unsigned options)
+{
+    struct dns_t *dns = NULL;
+    unsigned long long start;
+    unsigned long long elapsed;
+    size_t iterations = 0;
+    size_t errors = 0;
+    double packets;
+
+    start = _now();
+    do {
+        size_t n;
+        for (n = 0; n < MIN_ITERATIONS; n++) {
+            size_t i;
+            for (i = 0; i < corpus->count; i++) {
+                dns = dns_parse(corpus->packets[i], corpus->lengths[i], options, dns);
+                if (dns == NULL || dns->error_code)
+                    errors++;
+            }
+        }
+        iterations += MIN_ITERATIONS;
+        elapsed = _now() - start;
+    } while (elapsed < BENCHMARK_NANOSECONDS);
+    dns_parse_free(dns);
+
+    packets = (double)iterations * corpus->count;
+    printf("%-24s %12.0f packets/sec %10.1f MB/sec %8.1f ns/packet%s\n",
+           description,
+           packets * 1000000000.0 / elapsed,
+           (double)iterations * corpus->total_bytes * 1000.0 / elapsed,
+           elapsed / packets,
+           errors ? " (errors)" : "");
+}
+
+/**
+ * Like `_bench_parse()`, but creating zero-copy views of the packets,
+ * decompressing only the name in the question, as a filter might.
+ */
+static void
+_bench_view(const struct corpus *corpus, const char *description)
+{
+    struct dnsview_t *view = NULL;
+    unsigned long long start;
+    unsigned long long elapsed;
+    size_t iterations = 0;
+    size_t errors = 0;
+    double packets;
+
+    start = _now();
+    do {
+        size_t n;
+        for (n = 0; n < MIN_ITERATIONS; n++) {
+            size_t i;
+            for (i = 0; i < corpus->count; i++) {
+                char name[256];
+                view = dns_view(corpus->packets[i], corpus->lengths[i], view);
+                if (view == NULL || view->error_code)
+                    errors++;
+                else if (view->query_count)
+                    dns_view_name(view, view->queries[0].name_offset, name, sizeof(name));
+            }
+        }
+        iterations += MIN_ITERATIONS;
+        elapsed = _now() - start;
+    } while (elapsed < BENCHMARK_NANOSECONDS);
+    dns_view_free(view);
+
+    packets = (double)iterations * corpus->count;
+    printf("%-24s %12.0f packets/sec %10.1f MB/sec %8.1f ns/packet%s\n",
+           description,
+           packets * 1000000000.0 / elapsed,
+           (double)iterations * corpus->total_bytes * 1000.0 / elapsed,
+           elapsed / packets,
+           errors ? " (errors)" : "");
+}
+
+/**
+ * Like `_bench_parse()`, but decoding the records one at a time with
+ * the iterator, which allocates no memory.
+ */
+static void
+_bench_iter(const struct corpus *corpus, const char *description)
+{
+    unsigned char scratch[DNS_ITER_SCRATCH];
+    unsigned long long start;
+    unsigned long long elapsed;
+    size_t iterations = 0;
+    size_t errors = 0;
+    double packets;
+
+    start = _now();
+    do {
+        size_t n;
+        for (n = 0; n < MIN_ITERATIONS; n++) {
+            size_t i;
+            for (i = 0; i < corpus->count; i++) {
+                struct dnsiter_t iter;
+                dns_iter_begin(&iter, corpus->packets[i], corpus->lengths[i], scratch, sizeof(scratch));
+                while (dns_iter_next(&iter))
+                    ;
+                if (iter.error_code)
+                    errors++;
+            }
+        }
+        iterations += MIN_ITERATIONS;
+        elapsed = _now() - start;
+    } while (elapsed < BENCHMARK_NANOSECONDS);
+
+    packets = (double)iterations * corpus->count;
+    printf("%-24s %12.0f packets/sec %10.1f MB/sec %8.1f ns/packet%s\n",
+           description,
+           packets * 1000000000.0 / elapsed,
+           (double)iterations * corpus->total_bytes * 1000.0 / elapsed,
+           elapsed / packets,
+           errors ? " (errors)" : "");
+}
+
+/**
+ * Like `_bench_parse()`, but only parsing the header and first query
+ * the way a triage pipeline would.
+ */
+static void
+_bench_header(const struct corpus *corpus, const char *description)
+{
+    unsigned long long start;
+    unsigned long long elapsed;
+    size_t iterations = 0;
+    size_t errors = 0;
+    double packets;
+
+    start = _now();
+    do {
+        size_t n;
+        for (n = 0; n < MIN_ITERATIONS; n++) {
+            size_t i;
+            for (i = 0; i < corpus->count; i++) {
+                struct dnsheader_t hdr;
+                if (dns_parse_header(corpus->packets[i], corpus->lengths[i], &hdr))
+                    errors++;
+            }
+        }
+        iterations += MIN_ITERATIONS;
+        elapsed = _now() - start;
+    } while (elapsed < BENCHMARK_NANOSECONDS);
+
+    packets = (double)iterations * corpus->count;
+    printf("%-24s %12.0f packets/sec %10.1f MB/sec %8.1f ns/packet%s\n",
+           description,
+           packets * 1000000000.0 / elapsed,
+           (double)iterations * corpus->total_bytes * 1000.0 / elapsed,
+           elapsed / packets,
+           errors ? " (errors)" : "");
+}
+
+/**
+ * Measures how fast frames can be read from the capture files, using
+ * either the stdio reader or the memory-mapped one, and one frame or
+ * a batch of frames per call. Each frame's first byte is touched, as a
+ * decoder would, so that the mapped pages really are read in.
+ */
+static void
+_bench_pcapfile(int argc, char *argv[], const char *description,
+                struct pcapfile_ctx_t *(*openread)(const char *, int *, time_t *, long *),
+                size_t batch_size)
+{
+    unsigned long long start;
+    unsigned long long elapsed;
+    unsigned long long frames = 0;
+    unsigned long long bytes = 0;
+    unsigned checksum = 0;
+    size_t iterations = 0;
+
+    start = _now();
+    do {
+        int i;
+        for (i = 1; i < argc; i++) {
+            struct pcapfile_ctx_t *ctx;
+            int linktype;
+            time_t secs;
+            long usecs;
+
+            ctx = openread(argv[i], &linktype, &secs, &usecs);
+            if (ctx == NULL)
+                continue;
+            for (;;) {
+                struct pcapframe_t batch[256];
+                size_t count;
+                size_t j;
+
+                if (batch_size == 0) {
+                    if (pcapfile_readframe(ctx, &batch[0].secs, &batch[0].usecs,
+                            &batch[0].original_length, &batch[0].captured_length, &batch[0].buf))
+                        break;
+                    count = 1;
+                } else {
+                    count = pcapfile_readframes(ctx, batch, batch_size);
+                    if (count == 0)
+                        break;
+                }
+                for (j = 0; j < count; j++) {
+                    if (batch[j].captured_length)
+                        checksum += batch[j].buf[0];
+                    bytes += batch[j].captured_length + 16;
+                }
+                frames += count;
+            }
+            pcapfile_close(ctx);
+        }
+        iterations++;
+        elapsed = _now() - start;
+    } while (elapsed < BENCHMARK_NANOSECONDS && frames);
+
+    if (frames == 0)
+        return;
+    printf("%-24s %12.0f frames/sec  %10.1f MB/sec %8.1f ns/frame (%u)\n",
+           description,
+           (double)frames * 1000000000.0 / elapsed,
+           (double)bytes * 1000.0 / elapsed,
+           (double)elapsed / frames,
+           checksum & 0xFF);
+}
+
+/**
+ * Append a name to the packet being built, as a sequence of labels,
+ * optionally ending in a compression pointer rather than the root.
+ */
+static size_t
+_append_labels(unsigned char *buf, size_t offset, const char *labels, unsigned pointer)
+{
+    while (*labels) {
+        size_t len = strcspn(labels, ".");
+        buf[offset++] = (unsigned char)len;
+        memcpy(buf + offset, labels, len);
+        offset += len;
+        labels += len;
+        if (*labels == '.')
+            labels++;
+    }
+    if (pointer) {
+        buf[offset++] = 0xC0 | (unsigned char)(pointer >> 8);
+        buf[offset++] = (unsigned char)pointer;
+    } else
+        buf[offset++] = 0;
+    return offset;
+}
+
+/**
+ * Build a typical referral response from a TLD server, like those seen
+ * by recursive resolvers: a query, then REFERRAL_COUNT nameservers in the
+ * authority section, and a glue A record for each in the additional
+ * section. The names are compressed the way real servers do it.
+ */
+static size_t
+_build_referral(unsigned char *buf, size_t sizeof_buf)
+{
+    enum {REFERRAL_COUNT = 25};
+    size_t offset = 0;
+    size_t ns_offsets[REFERRAL_COUNT];
+    unsigned servers_offset = 0;
+    size_t i;
+
+    if (sizeof_buf < 4096)
+        return 0;
+
+    /* header: response, 1 query, 0 answers, 25 NS, 25 glue */
+    memcpy(buf, "\x12\x34\x81\x00\x00\x01\x00\x00", 8);
+    buf[8] = 0; buf[9] = REFERRAL_COUNT;
+    buf[10] = 0; buf[11] = REFERRAL_COUNT;
+    offset = 12;
+
+    /* query: www.example.com IN A, where "com" is at offset 24 */
+    offset = _append_labels(buf, offset, "www.example.com", 0);
+    memcpy(buf + offset, "\x00\x01\x00\x01", 4);
+    offset += 4;
+
+    /* authority: com. IN NS x.gtld-servers.net. */
+    for (i = 0; i < REFERRAL_COUNT; i++) {
+        char label[2] = {(char)('a' + i), 0};
+        size_t rdlength_offset;
+
+        offset = _append_labels(buf, offset, "", 24);
+        memcpy(buf + offset, "\x00\x02\x00\x01\x00\x02\xa3\x00", 8);
+        offset += 8;
+        rdlength_offset = offset;
+        offset += 2;
+        ns_offsets[i] = offset;
+        if (servers_offset == 0) {
+            servers_offset = (unsigned)offset + 2;
+            offset = _append_labels(buf, offset, "a.gtld-servers.net", 0);
+        } else
+            offset = _append_labels(buf, offset, label, servers_offset);
+        buf[rdlength_offset] = (unsigned char)((offset - rdlength_offset - 2) >> 8);
+        buf[rdlength_offset + 1] = (unsigned char)(offset - rdlength_offset - 2);
+    }
+
+    /* additional: x.gtld-servers.net. IN A 192.5.6.x */
+    for (i = 0; i < REFERRAL_COUNT; i++) {
+        offset = _append_labels(buf, offset, "", (unsigned)ns_offsets[i]);
+        memcpy(buf + offset, "\x00\x01\x00\x01\x00\x02\xa3\x00\x00\x04\xc0\x05\x06", 13);
+        offset += 13;
+        buf[offset++] = (unsigned char)(30 + i);
+    }
+
+    return offset;
+}
+
+/**
+ * Like `_bench_parse()`, but parsing all the packets in the corpus as
+ * a single batch.
+ */
+static void
+_bench_batch(const struct corpus *corpus, const char *description, unsigned options)
+{
+    struct dnsbatch_t *batch = NULL;
+    unsigned long long start;
+    unsigned long long elapsed;
+    size_t iterations = 0;
+    size_t errors = 0;
+    double packets;
+
+    start = _now();
+    do {
+        size_t n;
+        for (n = 0; n < MIN_ITERATIONS; n++) {
+            size_t i;
+            batch = dns_parse_batch((const unsigned char *const *)corpus->packets, corpus->lengths, corpus->count, options, batch);
+            if (batch == NULL) {
+                errors++;
+                continue;
+            }
+            for (i = 0; i < batch->count; i++) {
+                if (batch->results[i]->error_code)
+                    errors++;
+            }
+        }
+        iterations += MIN_ITERATIONS;
+        elapsed = _now() - start;
+    } while (elapsed < BENCHMARK_NANOSECONDS);
+    dns_parse_batch_free(batch);
+
+    packets = (double)iterations * corpus->count;
+    printf("%-24s %12.0f packets/sec %10.1f MB/sec %8.1f ns/packet%s\n",
+           description,
+           packets * 1000000000.0 / elapsed,
+           (double)iterations * corpus->total_bytes * 1000.0 / elapsed,
+           elapsed / packets,
+           errors ? " (errors)" : "");
+}
+
+int main(int argc, char *argv[])
+{
+    struct corpus corpus = {0};
+    struct corpus referral = {0};
+    unsigned char buf[4096];
+    int i;
+
+    if (argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "-?") == 0)) {
+        fprintf(stderr, "usage:\n benchmark [<filename1> <filename2> ...]\n");
+        return 1;
+    }
+
+    /* Microbenchmark on a typical 50-record referral */
+    _corpus_add(&referral, buf, _build_referral(buf, sizeof(buf)));
+    fprintf(stderr, "[+] referral, %u bytes\n", (unsigned)referral.total_bytes);
+    _bench_parse(&referral, "dns_parse(two-pass)", 0);
+    _bench_parse(&referral, "dns_parse(single-pass)", DNS_F_SINGLEPASS);
+    _bench_view(&referral, "dns_view");
+    _bench_iter(&referral, "dns_iter");
+    _bench_header(&referral, "dns_parse_header");
+
+    /* Benchmark on the packets in the files */
+    for (i = 1; i < argc; i++)
+        _corpus_load(&corpus, argv[i]);
+    if (argc > 1 && corpus.count == 0) {
+        fprintf(stderr, "[-] no DNS packets found\n");
+        return 1;
+    }
+    if (corpus.count == 0)
+        return 0;
+    fprintf(stderr, "[+] %u DNS packets, %u bytes\n", (unsigned)corpus.count, (unsigned)corpus.total_bytes);
+
+    _bench_pcapfile(argc, argv, "pcapfile(stdio)", pcapfile_openread, 0);
+    _bench_pcapfile(argc, argv, "pcapfile(mmap)", pcapfile_openread_mmap, 0);
+    _bench_pcapfile(argc, argv, "pcapfile(stdio,batch)", pcapfile_openread, 256);
+    _bench_pcapfile(argc, argv, "pcapfile(mmap,batch)", pcapfile_openread_mmap, 256);
+
+    _bench_parse(&corpus, "dns_parse(two-pass)", 0);
+    _bench_parse(&corpus, "dns_parse(single-pass)", DNS_F_SINGLEPASS);
+    _bench_view(&corpus, "dns_view");
+    _bench_iter(&corpus, "dns_iter");
+    _bench_header(&corpus, "dns_parse_header");
+    _bench_batch(&corpus, "dns_parse_batch", 0);
+    _bench_batch(&corpus, "dns_parse_batch(single)", DNS_F_SINGLEPASS);
+
+    return 0;
+}
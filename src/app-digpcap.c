@@ -1,6 +1,7 @@
 #include "util-pcapfile.h"  /* reads packet capture files */
 #include "util-ipdecode.h"  /* decode TCP/IP packets */
 #include "util-tcpreasm.h"  /* reassembles TCP streams */
+#include "util-spscring.h"  /* passes packets between threads */
 #include "dns-parse.h"      /* decodes DNS payloads */
 #include "dns-format.h"     /* prints DNS results */
 #include <assert.h>
@@ -8,27 +9,137 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * When processing a large file in shards, each shard first reads this
+ * much of the file before its start, looking for TCP connections that
+ * were opened before the shard but that carry DNS responses within it.
+ */
+#define WARMUP_BYTES (1024 * 1024)
+
+/**
+ * In pipeline mode, the size of the ring of packets to each worker, and
+ * how much output a worker buffers before printing it
+ */
+#define PIPELINE_RING_SIZE (4 * 1024 * 1024)
+#define PIPELINE_OUTPUT_SIZE (64 * 1024)
+
+/**
+ * A unit of work for the worker threads, which is either a whole file,
+ * or a shard of a large file that's been split at frame boundaries.
+ */
+struct digpcap_unit
+{
+    const char *filename;
+
+    /* For shards, frames are processed from [start] up to [end], after
+     * first reading from [warmup] only to reassemble TCP. The first
+     * shard of a file, or a whole file, has a [shard_index] of 0. */
+    unsigned is_shard:1;
+    unsigned shard_index;
+    uint64_t warmup;
+    uint64_t start;
+    uint64_t end;
+
+    /* Where the output goes, which is either stdout directly, or when
+     * [is_buffered], a memory buffer printed once the unit is done */
+    unsigned is_buffered:1;
+    FILE *out;
+    char *output;
+    size_t output_length;
+
+    /* The number of frames in this unit, and which of them had DNS
+     * errors. Those are only reported once we know how many frames
+     * came before this unit in the same file. */
+    uint64_t frame_count;
+    uint64_t *errors;
+    size_t error_count;
+    size_t error_max;
+
+    /* The result of parsing the previous packet, whose memory is
+     * reused for the next one */
+    struct dns_t *recycle;
+
+    unsigned is_done:1;
+    unsigned is_printed:1;
+};
+
+/**
+ * The work queue shared by the worker threads
+ */
+struct digpcap_t
+{
+    int rrtype;
+    unsigned is_unordered:1;
+    struct digpcap_unit *units;
+    size_t unit_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* The next unit to start, and the next to print in order */
+    size_t next_unit;
+    size_t next_flush;
+
+    /* How far ahead of the printing threads may start, which bounds how
+     * much buffered output waits for a slow unit */
+    size_t max_ahead;
+
+    /* The number of frames in earlier units of the current file */
+    uint64_t frames_before;
+};
+
+/**
+ * Report a DNS error, which is printed immediately when unbuffered,
+ * otherwise remembered until we know the frame's real number.
+ */
+static void
+_report_error(struct digpcap_unit *unit, uint64_t frame_number)
+{
+    if (!unit->is_buffered) {
+        fprintf(stderr, "%s:%llu: error parsing DNS\n", unit->filename, (unsigned long long)frame_number);
+        return;
+    }
+    if (unit->error_count >= unit->error_max) {
+        size_t new_max = unit->error_max * 2 + 16;
+        uint64_t *new_errors = realloc(unit->errors, new_max * sizeof(*new_errors));
+        if (new_errors == NULL)
+            return;
+        unit->errors = new_errors;
+        unit->error_max = new_max;
+    }
+    unit->errors[unit->error_count++] = frame_number;
+}
 
 
 /**
  * Handle a DNS packet, either a UDP packet read from the stream, or a 
- * reassembled TCP payload.
+ * reassembled TCP payload. This uses single-pass parsing, recycling the
+ * memory from the previous packet.
  */
-static struct dns_t *
-_process_dns(const unsigned char *buf, size_t length, struct dns_t *dns, const char *filename, uint64_t frame_number, int rrtype)
+static void
+_process_dns(const unsigned char *buf, size_t length, struct digpcap_unit *unit, uint64_t frame_number, int rrtype)
 {
+    struct dns_t *dns;
     size_t i;
     int err;
     
     /* Decode DNS */
     dns = dns_parse(buf,
                     length,
-                    0,
-                    dns);
+                    DNS_F_SINGLEPASS,
+                    unit->recycle);
     if (dns == NULL || dns->error_code) {
-        fprintf(stderr, "%s:%llu: error parsing DNS\n", filename, frame_number);
-        return dns;
+        _report_error(unit, frame_number);
+        if (dns)
+            unit->recycle = dns;
+        return;
     }
+    unit->recycle = dns;
     
     /* Process all the records in the DNS packet */
     for (i=0; i<dns->answer_count + dns->nameserver_count + dns->additional_count; i++) {
@@ -48,14 +159,12 @@ _process_dns(const unsigned char *buf, size_t length, struct dns_t *dns, const c
             continue;
 
         /* Print in DIG format (i.e. zonefile format) */
-        printf("%s%-23s %-7u IN\t%-7s %s\n",
+        fprintf(unit->out, "%s%-23s %-7u IN\t%-7s %s\n",
             (rr->section == 0) ? ";" : "",
              rr->name,
              rr->ttl,
              dns_name_from_rrtype(rr->rtype), output);
     }
-    
-    return dns;
 }
 
 /**
@@ -68,149 +177,740 @@ struct dnstcp
 };
 
 /**
- * Read in the packet-capture file and process all the records.
+ * Reassemble a TCP packet, then decode any DNS packet that it completes.
+ * During a shard's warmup, the DNS packet is only reassembled, not
+ * printed.
+ */
+static void
+_process_tcp(struct digpcap_unit *unit, struct tcpreasm_ctx_t **tcpreasm,
+    const unsigned char *buf, size_t length, time_t secs, long usecs,
+    uint64_t frame_number, unsigned is_warmup, int rrtype)
+{
+    struct tcpreasm_tuple_t ins;
+
+    /* Create a subsystem for reassembling TCP streams, starting
+     * at the time of the first TCP packet we see */
+    if (*tcpreasm == NULL)
+        *tcpreasm = tcpreasm_create(sizeof(struct dnstcp), 0, secs, 60);
+
+    ins = tcpreasm_packet(*tcpreasm, /* reassembler */
+                                 buf, /* IP+TCP+payload */
+                                 length,
+                                 secs,           /* timestamp */
+                                 usecs * 1000);
+    if (ins.available) {
+        struct dnstcp *d = (struct dnstcp *)ins.userdata;
+        if (d->state == 0) {
+            if (ins.available >= 2) {
+                /* First, read the 2-byte header at the start of TCP
+                 * to know how long the remaining chunk is going to be */
+                const unsigned char *foo;
+                size_t count;
+                d->state = 1;
+                count = tcpreasm_peek(&ins, 2, &foo);
+                assert(count == 2);
+                d->pdu_length = foo[0]<<8 | foo[1];
+                ins.available -= tcpreasm_consume(&ins, count);
+            }
+        }
+        if (d->state == 1) {
+            if (d->pdu_length <= ins.available) {
+                /* Once we have enough bytes available to reassemble
+                 * the DNS packet, decode it in place within the
+                 * reassembly buffer, then remove it */
+                const unsigned char *pdu;
+                size_t count;
+                count = tcpreasm_peek(&ins, d->pdu_length, &pdu);
+                assert(count == d->pdu_length);
+                if (!is_warmup)
+                    _process_dns(pdu, count, unit, frame_number, rrtype);
+                tcpreasm_consume(&ins, count);
+                d->state = 0;
+            }
+        }
+
+    }
+
+    /* Process any needed timeouts */
+    tcpreasm_timeouts(*tcpreasm, secs, usecs * 1000);
+}
+
+/**
+ * Process all the frames up to the end of the file or of the range set
+ * with pcapfile_set_range(). During a shard's warmup, only TCP is
+ * reassembled, because frames before the shard belong to the previous
+ * shard, which prints any DNS records within them.
+ */
+static void
+_process_frames(struct pcapfile_ctx_t *ctx, struct digpcap_unit *unit,
+    struct tcpreasm_ctx_t **tcpreasm, unsigned is_warmup, int rrtype)
+{
+    /*
+     * Process all the packets read from the file, a batch at a time
+     */
+    for (;;) {
+        struct pcapframe_t frames[256];
+        struct packetdecode_t decodes[256];
+        size_t frame_count;
+        size_t i;
+
+        /* Read the next batch of packets */
+        frame_count = pcapfile_readframes(ctx, frames, sizeof(frames)/sizeof(frames[0]));
+        if (frame_count == 0)
+            break;
+
+        /* Decode the packet headers of the entire batch, which is
+         * where most packets will be rejected */
+        for (i=0; i<frame_count; i++) {
+            if (util_ipdecode(frames[i].buf, frames[i].captured_length, frames[i].linktype, &decodes[i]))
+                decodes[i].port_src = 0;
+        }
+
+        for (i=0; i<frame_count; i++) {
+            const struct pcapframe_t *frame = &frames[i];
+            const unsigned char *buf = frame->buf;
+            struct packetdecode_t decode = decodes[i];
+            uint64_t frame_number = unit->frame_count;
+
+            if (!is_warmup)
+                frame_number = ++unit->frame_count;
+
+            /* If not DNS, then ignore this packet */
+            if (decode.port_src != 53)
+                continue;
+
+            if (decode.ip_protocol == 17) {
+                /* If UDP, then decode this payload*/
+                if (!is_warmup)
+                    _process_dns(buf + decode.app_offset, decode.app_length, unit, frame_number, rrtype);
+            } else if (decode.ip_protocol == 6) {
+                /* If TCP, then reassemble the stream into a packet, then
+                 * decode the reassembled packet if available */
+                _process_tcp(unit, tcpreasm, buf + decode.ip_offset, decode.ip_length,
+                    frame->secs, frame->usecs, frame_number, is_warmup, rrtype);
+            }
+        }
+    }
+}
+
+/**
+ * Read in the packet-capture file, or one shard of it, and process all
+ * the records.
  */
 static void
-_process_file(const char *filename, int rrtype)
+_process_unit(struct digpcap_unit *unit, int rrtype)
 {
     struct pcapfile_ctx_t *ctx;
     int linktype = 0;
-    struct dns_t *recycle = NULL;
-    size_t frame_number = 0;
     struct tcpreasm_ctx_t *tcpreasm = 0;
     time_t secs;
     long usecs;
     
     
     /* Open the packet capture file  */
-    ctx = pcapfile_openread(filename, &linktype, &secs, &usecs);
+    ctx = pcapfile_openread_mmap(unit->filename, &linktype, &secs, &usecs);
     if (ctx == NULL) {
-        fprintf(stderr, "[-] error: %s\n", filename);
+        fprintf(stderr, "[-] error: %s\n", unit->filename);
         return;
-    } else {
+    } else if (unit->shard_index == 0) {
         time_t now = secs;
-        struct tm *tm = gmtime(&now);
+        struct tm tm;
         char timestamp[64];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm);
-        fprintf(stderr, "[+] %s (%s) %s \n", filename, pcapfile_datalink_name(linktype), timestamp);
+        gmtime_r(&now, &tm);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(stderr, "[+] %s (%s) %s \n", unit->filename, pcapfile_datalink_name(linktype), timestamp);
     }
+
+    if (unit->is_shard) {
+        if (pcapfile_set_range(ctx, unit->warmup, unit->start) == 0)
+            _process_frames(ctx, unit, &tcpreasm, 1, rrtype);
+        pcapfile_set_range(ctx, unit->start, unit->end);
+    }
+    _process_frames(ctx, unit, &tcpreasm, 0, rrtype);
     
-    /* Create a subsystem for reassembling TCP streams */
-    tcpreasm = tcpreasm_create(sizeof(struct dnstcp), 0, secs, 60);
-    
-    /*
-     * Process all the packets read from the file
-     */
+    /* cleanup allocated memory and exit the function */
+    dns_parse_free(unit->recycle);
+    unit->recycle = NULL;
+    tcpreasm_destroy(tcpreasm);
+    pcapfile_close(ctx);
+}
+
+/**
+ * Print the output of all the units that are done, up to the first
+ * that isn't, so that output is in the same order as the files and
+ * shards. Called with the lock held.
+ */
+static void
+_flush_units(struct digpcap_t *dig)
+{
+    while (dig->next_flush < dig->unit_count && dig->units[dig->next_flush].is_done) {
+        struct digpcap_unit *unit = &dig->units[dig->next_flush++];
+        size_t i;
+
+        if (!unit->is_printed)
+            fwrite(unit->output, 1, unit->output_length, stdout);
+        free(unit->output);
+        unit->output = NULL;
+
+        /* Now that we know how many frames came before, report errors */
+        if (unit->shard_index == 0)
+            dig->frames_before = 0;
+        for (i=0; i<unit->error_count; i++) {
+            fprintf(stderr, "%s:%llu: error parsing DNS\n", unit->filename,
+                (unsigned long long)(dig->frames_before + unit->errors[i]));
+        }
+        dig->frames_before += unit->frame_count;
+        free(unit->errors);
+        unit->errors = NULL;
+    }
+}
+
+/**
+ * A worker thread, which takes the next unit from the queue until there
+ * are none left
+ */
+static void *
+_worker_thread(void *v)
+{
+    struct digpcap_t *dig = (struct digpcap_t *)v;
+
     for (;;) {
-        time_t time_secs;
-        long time_usecs;
-        size_t original_length;
-        size_t captured_length;
+        struct digpcap_unit *unit;
+
+        pthread_mutex_lock(&dig->lock);
+        while (dig->next_unit < dig->unit_count
+                && dig->next_unit - dig->next_flush >= dig->max_ahead)
+            pthread_cond_wait(&dig->cond, &dig->lock);
+        if (dig->next_unit >= dig->unit_count) {
+            pthread_mutex_unlock(&dig->lock);
+            break;
+        }
+        unit = &dig->units[dig->next_unit++];
+        pthread_mutex_unlock(&dig->lock);
+
+        /* Process the unit into a memory buffer */
+        unit->out = open_memstream(&unit->output, &unit->output_length);
+        if (unit->out == NULL) {
+            perror("open_memstream");
+        } else {
+            _process_unit(unit, dig->rrtype);
+            fclose(unit->out);
+            unit->out = NULL;
+        }
+
+        /* Print whatever output is now ready */
+        pthread_mutex_lock(&dig->lock);
+        unit->is_done = 1;
+        if (dig->is_unordered) {
+            fwrite(unit->output, 1, unit->output_length, stdout);
+            unit->is_printed = 1;
+        }
+        _flush_units(dig);
+        pthread_cond_broadcast(&dig->cond);
+        pthread_mutex_unlock(&dig->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Append a new, empty unit to the list
+ */
+static struct digpcap_unit *
+_new_unit(struct digpcap_t *dig, const char *filename)
+{
+    struct digpcap_unit *unit;
+
+    dig->units = realloc(dig->units, (dig->unit_count + 1) * sizeof(dig->units[0]));
+    if (dig->units == NULL) {
+        fprintf(stderr, "[-] out of memory\n");
+        exit(1);
+    }
+    unit = &dig->units[dig->unit_count++];
+    memset(unit, 0, sizeof(*unit));
+    unit->filename = filename;
+    return unit;
+}
+
+/**
+ * Add the file to the list of units, split into shards if it's a large
+ * file that we can split.
+ */
+static void
+_add_units(struct digpcap_t *dig, const char *filename, unsigned thread_count, uint64_t shard_size)
+{
+    struct stat s;
+    struct pcapfile_ctx_t *ctx;
+    uint64_t file_size;
+    uint64_t start;
+    uint64_t end;
+    unsigned shard_index = 0;
+    int linktype;
+
+    /* Small files aren't worth splitting */
+    if (thread_count <= 1 || stat(filename, &s) != 0 || !S_ISREG(s.st_mode)) {
+        _new_unit(dig, filename);
+        return;
+    }
+    file_size = (uint64_t)s.st_size;
+    if (shard_size == 0) {
+        /* By default, make enough shards to keep all the threads busy,
+         * but not so many that the warmup before each one adds up */
+        shard_size = file_size / (thread_count * 4);
+        if (shard_size < 4 * 1024 * 1024)
+            shard_size = 4 * 1024 * 1024;
+        if (shard_size > 64 * 1024 * 1024)
+            shard_size = 64 * 1024 * 1024;
+    }
+    if (file_size < 2 * shard_size) {
+        _new_unit(dig, filename);
+        return;
+    }
+
+    /* Only uncompressed classic pcap files can be split */
+    ctx = pcapfile_openread_mmap(filename, &linktype, 0, 0);
+    if (ctx == NULL) {
+        _new_unit(dig, filename);
+        return;
+    }
+    start = pcapfile_find_frame(ctx, 0);
+    if (start == 0) {
+        pcapfile_close(ctx);
+        _new_unit(dig, filename);
+        return;
+    }
+
+    /* Split the file at the first frame after every [shard_size] bytes,
+     * skipping any shard that has no frames of its own */
+    while (start < file_size) {
+        struct digpcap_unit *unit;
+        uint64_t warmup;
+
+        end = pcapfile_find_frame(ctx, (start / shard_size + 1) * shard_size);
+
+        warmup = pcapfile_find_frame(ctx, (start > WARMUP_BYTES) ? (start - WARMUP_BYTES) : 0);
+        if (warmup > start)
+            warmup = start;
+
+        unit = _new_unit(dig, filename);
+        unit->is_shard = 1;
+        unit->shard_index = shard_index++;
+        unit->warmup = warmup;
+        unit->start = start;
+        unit->end = end;
+
+        start = end;
+    }
+    pcapfile_close(ctx);
+}
+
+/**
+ * A packet passed from the reader thread to a pipeline worker, followed
+ * by the DNS payload for UDP, or the IP packet for TCP. A packet with
+ * no protocol marks the end of a file, and one with no filename marks
+ * the end of all the files.
+ */
+struct pipeline_packet
+{
+    const char *filename;
+    uint64_t frame_number;
+    int64_t secs;
+    long usecs;
+    unsigned ip_protocol;
+    unsigned length;
+};
+
+/**
+ * A pipeline worker, which owns all the TCP connections that hash to it
+ */
+struct pipeline_worker
+{
+    struct spscring_t *ring;
+    pthread_t thread;
+    int rrtype;
+    pthread_mutex_t *output_lock;
+};
+
+/**
+ * Back off while the other side of a ring catches up, first by yielding
+ * the CPU, then, once it's clear the ring is idle, by sleeping.
+ */
+static void
+_pipeline_wait(unsigned *spins)
+{
+    if (++*spins < 1000)
+        sched_yield();
+    else {
+        struct timespec ts = {0, 100 * 1000};
+        nanosleep(&ts, 0);
+    }
+}
+
+/**
+ * Print the worker's buffered output, then start a new buffer
+ */
+static void
+_pipeline_flush(struct pipeline_worker *worker, struct digpcap_unit *unit)
+{
+    fclose(unit->out);
+    pthread_mutex_lock(worker->output_lock);
+    fwrite(unit->output, 1, unit->output_length, stdout);
+    pthread_mutex_unlock(worker->output_lock);
+    free(unit->output);
+    unit->output = NULL;
+    unit->output_length = 0;
+    unit->out = open_memstream(&unit->output, &unit->output_length);
+}
+
+/**
+ * A pipeline worker thread, which decodes the packets sent to it by
+ * the reader, until it gets the marker for the end of all the files.
+ */
+static void *
+_pipeline_thread(void *v)
+{
+    struct pipeline_worker *worker = (struct pipeline_worker *)v;
+    struct digpcap_unit unit;
+    struct tcpreasm_ctx_t *tcpreasm = 0;
+    unsigned spins = 0;
+
+    memset(&unit, 0, sizeof(unit));
+    unit.out = open_memstream(&unit.output, &unit.output_length);
+    if (unit.out == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+
+    for (;;) {
+        const struct pipeline_packet *packet;
         const unsigned char *buf;
-        int err;
+        size_t length;
+        unsigned ip_protocol;
+
+        packet = spscring_peek(worker->ring, &length);
+        if (packet == NULL) {
+            _pipeline_wait(&spins);
+            continue;
+        }
+        spins = 0;
+        if (packet->filename == NULL) {
+            spscring_release(worker->ring);
+            break;
+        }
+
+        unit.filename = packet->filename;
+        buf = (const unsigned char *)(packet + 1);
+        ip_protocol = packet->ip_protocol;
+        if (ip_protocol == 17)
+            _process_dns(buf, packet->length, &unit, packet->frame_number, worker->rrtype);
+        else if (ip_protocol == 6)
+            _process_tcp(&unit, &tcpreasm, buf, packet->length, (time_t)packet->secs,
+                packet->usecs, packet->frame_number, 0, worker->rrtype);
+        else {
+            /* TCP connections don't continue into the next file */
+            tcpreasm_destroy(tcpreasm);
+            tcpreasm = NULL;
+        }
+        spscring_release(worker->ring);
+
+        if (ip_protocol == 0 || ftell(unit.out) >= PIPELINE_OUTPUT_SIZE)
+            _pipeline_flush(worker, &unit);
+    }
+
+    _pipeline_flush(worker, &unit);
+    fclose(unit.out);
+    free(unit.output);
+    dns_parse_free(unit.recycle);
+    tcpreasm_destroy(tcpreasm);
+    return NULL;
+}
+
+/**
+ * Send a packet to a worker, waiting until its ring has room
+ */
+static void
+_pipeline_send(struct pipeline_worker *worker, const struct pipeline_packet *packet,
+    const unsigned char *buf)
+{
+    unsigned char *p;
+    unsigned spins = 0;
+
+    while ((p = spscring_reserve(worker->ring, sizeof(*packet) + packet->length)) == NULL)
+        _pipeline_wait(&spins);
+    memcpy(p, packet, sizeof(*packet));
+    if (packet->length)
+        memcpy(p + sizeof(*packet), buf, packet->length);
+    spscring_commit(worker->ring, sizeof(*packet) + packet->length);
+}
+
+/**
+ * Hash one end of a connection
+ */
+static uint64_t
+_endpoint_hash(const unsigned char *addr, size_t addr_length, unsigned port)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i=0; i<addr_length; i++)
+        hash = (hash ^ addr[i]) * 0x100000001b3ULL;
+    hash = (hash ^ port) * 0x100000001b3ULL;
+
+    /* Mix the bits, the finalizer from MurmurHash3 */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Hash the 5-tuple so that both directions of a connection get the
+ * same value, which is why the two ends are combined by addition.
+ */
+static uint64_t
+_flow_hash(const struct packetdecode_t *decode)
+{
+    size_t addr_length = (decode->ip_version == 6) ? 16 : 4;
+
+    return _endpoint_hash(decode->ip_src, addr_length, decode->port_src)
+        + _endpoint_hash(decode->ip_dst, addr_length, decode->port_dst)
+        + decode->ip_protocol;
+}
+
+/**
+ * Read the file on this thread, sending each DNS packet to the worker
+ * chosen by its flow hash, so that all the packets of a TCP connection
+ * are reassembled by the same worker.
+ */
+static void
+_pipeline_file(const char *filename, struct pipeline_worker *workers, unsigned worker_count)
+{
+    struct pcapfile_ctx_t *ctx;
+    int linktype = 0;
+    uint64_t frame_number = 0;
+    struct pipeline_packet packet;
+    time_t secs;
+    long usecs;
+    unsigned i;
+
+    ctx = pcapfile_openread_mmap(filename, &linktype, &secs, &usecs);
+    if (ctx == NULL) {
+        fprintf(stderr, "[-] error: %s\n", filename);
+        return;
+    } else {
+        struct tm tm;
+        char timestamp[64];
+        gmtime_r(&secs, &tm);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(stderr, "[+] %s (%s) %s \n", filename, pcapfile_datalink_name(linktype), timestamp);
+    }
+
+    memset(&packet, 0, sizeof(packet));
+    packet.filename = filename;
+
+    for (;;) {
+        struct pcapframe_t frames[256];
         struct packetdecode_t decode;
-        
-        /* Read the next packet */
-        err = pcapfile_readframe(ctx, &time_secs, &time_usecs, &original_length, &captured_length, &buf);
-        if (err)
+        size_t frame_count;
+        size_t j;
+
+        frame_count = pcapfile_readframes(ctx, frames, sizeof(frames)/sizeof(frames[0]));
+        if (frame_count == 0)
             break;
-        frame_number++;
-        
-        /* Decode the packet headers */
-        err = util_ipdecode(buf, captured_length, linktype, &decode);
-        if (err)
-            continue;
-        
-        /* If not DNS, then ignore this packet */
-        if (decode.port_src != 53)
-            continue;
-        
-        if (decode.ip_protocol == 17) {
-            /* If UDP, then decode this payload*/
-            recycle = _process_dns(buf + decode.app_offset, decode.app_length, recycle, filename, frame_number, rrtype);
-        } else if (decode.ip_protocol == 6) {
-            /* If TCP, then reassemble the stream into a packet, then
-             * decode the reassembled packet if available */
-            struct tcpreasm_tuple_t ins;
-            
-            ins = tcpreasm_packet(tcpreasm, /* reassembler */
-                                         buf + decode.ip_offset, /* IP+TCP+payload */
-                                         decode.ip_length,
-                                         time_secs,             /* timestamp */
-                                         time_usecs * 1000);
-            if (ins.available) {
-                struct dnstcp *d = (struct dnstcp *)ins.userdata;
-                if (d->state == 0) {
-                    if (ins.available >= 2) {
-                        /* First, read the 2-byte header at the start of TCP
-                         * to know how long the remaining chunk is going to be */
-                        unsigned char foo[2];
-                        size_t count;
-                        d->state = 1;
-                        count = tcpreasm_read(&ins, foo, 2);
-                        d->pdu_length = foo[0]<<8 | foo[1];
-                        ins.available -= count;
-                    }
-                }
-                if (d->state == 1) {
-                    if (d->pdu_length <= ins.available) {
-                        /* Once we have enough bytes available to reassemble
-                         * the DNS packet, reassemble it and decode it */
-                        unsigned char tmp[65536];
-                        size_t count;
-                        count = tcpreasm_read(&ins, tmp, d->pdu_length);
-                        assert(count == d->pdu_length);
-                        recycle = _process_dns(tmp, count, recycle, filename, frame_number, rrtype);
-                        d->state = 0;
-                    }
-                }
 
-            }
+        for (j=0; j<frame_count; j++) {
+            const struct pcapframe_t *frame = &frames[j];
+            struct pipeline_worker *worker;
 
-            /* Process any needed timeouts */
-            tcpreasm_timeouts(tcpreasm, time_secs, time_usecs * 1000);
-            
+            frame_number++;
+            if (util_ipdecode(frame->buf, frame->captured_length, frame->linktype, &decode))
+                continue;
+            if (decode.port_src != 53)
+                continue;
+
+            packet.frame_number = frame_number;
+            packet.secs = frame->secs;
+            packet.usecs = frame->usecs;
+            packet.ip_protocol = decode.ip_protocol;
+            worker = &workers[_flow_hash(&decode) % worker_count];
+            if (decode.ip_protocol == 17) {
+                packet.length = decode.app_length;
+                _pipeline_send(worker, &packet, frame->buf + decode.app_offset);
+            } else if (decode.ip_protocol == 6) {
+                packet.length = decode.ip_length;
+                _pipeline_send(worker, &packet, frame->buf + decode.ip_offset);
+            }
         }
     }
-    
-    /* cleanup allocated memory and exit the function */
-    dns_parse_free(recycle);
     pcapfile_close(ctx);
+
+    /* Tell every worker that the file has ended */
+    packet.ip_protocol = 0;
+    packet.length = 0;
+    for (i=0; i<worker_count; i++)
+        _pipeline_send(&workers[i], &packet, 0);
 }
 
+/**
+ * Process the files with a pipeline: this thread reads the files and
+ * decodes the packet headers, and the workers reassemble and decode DNS.
+ * Records are printed in order for each connection, but the output of
+ * different workers is interleaved.
+ */
+static void
+_pipeline_run(const char **filenames, int filename_count, unsigned worker_count, int rrtype)
+{
+    struct pipeline_worker *workers;
+    struct pipeline_packet packet;
+    pthread_mutex_t output_lock;
+    unsigned i;
+    int j;
+
+    pthread_mutex_init(&output_lock, 0);
+    workers = calloc(worker_count, sizeof(workers[0]));
+    for (i=0; i<worker_count; i++) {
+        workers[i].ring = spscring_create(PIPELINE_RING_SIZE);
+        workers[i].rrtype = rrtype;
+        workers[i].output_lock = &output_lock;
+        if (workers[i].ring == NULL
+                || pthread_create(&workers[i].thread, 0, _pipeline_thread, &workers[i]) != 0) {
+            fprintf(stderr, "[-] failed to start pipeline worker\n");
+            exit(1);
+        }
+    }
+
+    for (j=0; j<filename_count; j++)
+        _pipeline_file(filenames[j], workers, worker_count);
+
+    /* Tell the workers there are no more files, then wait for them */
+    memset(&packet, 0, sizeof(packet));
+    for (i=0; i<worker_count; i++)
+        _pipeline_send(&workers[i], &packet, 0);
+    for (i=0; i<worker_count; i++) {
+        pthread_join(workers[i].thread, 0);
+        spscring_destroy(workers[i].ring);
+    }
+    free(workers);
+    pthread_mutex_destroy(&output_lock);
+}
 
 int main(int argc, char *argv[])
 {
     int i;
-    int rrtype = 0;
+    struct digpcap_t dig[1];
+    unsigned thread_count = 1;
+    unsigned pipeline_count = 0;
+    uint64_t shard_size = 0;
+    const char **filenames;
+    int filename_count = 0;
     
     if (argc <= 1) {
         fprintf(stderr, "[-] no files specified\n");
         return 1;
     }
+    memset(dig, 0, sizeof(dig[0]));
+    filenames = calloc(argc, sizeof(filenames[0]));
     
-    /* Look for any RRtypes that might be specified */
+    /* Look for any options or RRtypes that might be specified, and treat
+     * everything else as a filename */
     for (i=1; i<argc; i++) {
         if (strcmp(argv[i], "-?") == 0 || strcmp(argv[i], "-h") == 0) {
             fprintf(stderr, "-- digpcap - extracts DNS records from network packets --\n");
-            fprintf(stderr, "usage\n digpcap [rrtype] <filename1> <filename2> ...\n");
+            fprintf(stderr, "usage\n digpcap [options] [rrtype] <filename1> <filename2> ...\n");
             fprintf(stderr, "where:\n rrtype = (optional) A, AAAA, SOA, CNAME, MX, etc.\n filename = pcap/tcpdump file full of packets\n");
+            fprintf(stderr, "options:\n -j <n> = process files with <n> threads, or 0 for one per CPU\n");
+            fprintf(stderr, " -p <n> = read files on one thread, and decode DNS with <n> worker threads,\n");
+            fprintf(stderr, "   or 0 for one per CPU, each owning the TCP connections that hash to it\n");
+            fprintf(stderr, " -u = print each file (or shard) as soon as it's done, rather than in order\n");
+            fprintf(stderr, " --shard-size <megabytes> = with multiple threads, split large files into\n");
+            fprintf(stderr, "   shards of this size, processed in parallel (default: automatic)\n");
             fprintf(stderr, "output:\n same DNS zonefile-compatible output as 'dig'\n");
             exit(0);
         }
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            thread_count = (unsigned)strtoul(argv[++i], 0, 0);
+            if (thread_count == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                thread_count = (cpus > 0) ? (unsigned)cpus : 1;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            pipeline_count = (unsigned)strtoul(argv[++i], 0, 0);
+            if (pipeline_count == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                pipeline_count = (cpus > 0) ? (unsigned)cpus : 1;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "-u") == 0) {
+            dig->is_unordered = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--shard-size") == 0 && i + 1 < argc) {
+            shard_size = strtoull(argv[++i], 0, 0) * 1024 * 1024;
+            continue;
+        }
         if (dns_rrtype_from_name(argv[i]) > 0) {
-            if (rrtype) {
+            if (dig->rrtype) {
                 fprintf(stderr, "[-] fail: only one rrtype can be specified\n");
                 exit(1);
             } else
-                rrtype = dns_rrtype_from_name(argv[i]);
+                dig->rrtype = dns_rrtype_from_name(argv[i]);
+            continue;
         }
+        filenames[filename_count++] = argv[i];
     }
 
-    /* Process all files listed on the command-line */
-    for (i=1; i<argc; i++) {
-        _process_file(argv[i], rrtype);
+    /* The first call initializes the global hashmap key, which
+     * isn't thread-safe, so do it before starting any threads */
+    tcpreasm_destroy(tcpreasm_create(sizeof(struct dnstcp), 0, 0, 60));
+
+    if (pipeline_count) {
+        _pipeline_run(filenames, filename_count, pipeline_count, dig->rrtype);
+        free(filenames);
+        return 0;
+    }
+
+    /* Options can come after filenames, so only now do we know whether
+     * to split files into shards */
+    for (i=0; i<filename_count; i++)
+        _add_units(dig, filenames[i], thread_count, shard_size);
+    free(filenames);
+
+    if (thread_count <= 1) {
+        /* Process all files listed on the command-line, one at a time */
+        size_t j;
+        for (j=0; j<dig->unit_count; j++) {
+            dig->units[j].out = stdout;
+            _process_unit(&dig->units[j], dig->rrtype);
+        }
+    } else {
+        /* Process files, or shards of files, in parallel, buffering the
+         * output of each until it can be printed */
+        pthread_t *threads;
+        size_t j;
+
+        for (j=0; j<dig->unit_count; j++)
+            dig->units[j].is_buffered = 1;
+        dig->max_ahead = dig->is_unordered ? dig->unit_count : thread_count * 4;
+        pthread_mutex_init(&dig->lock, 0);
+        pthread_cond_init(&dig->cond, 0);
+
+        threads = calloc(thread_count, sizeof(threads[0]));
+        for (j=0; j<thread_count; j++) {
+            if (pthread_create(&threads[j], 0, _worker_thread, dig) != 0) {
+                fprintf(stderr, "[-] pthread_create() failed\n");
+                exit(1);
+            }
+        }
+        for (j=0; j<thread_count; j++)
+            pthread_join(threads[j], 0);
+        free(threads);
+
+        pthread_cond_destroy(&dig->cond);
+        pthread_mutex_destroy(&dig->lock);
     }
+    free(dig->units);
     
     return 0;
 }
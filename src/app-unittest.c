@@ -1,5 +1,8 @@
 #include "dns-parse.h"
 #include "dns-format.h"
+#include "util-pcapfile.h"
+#include "util-spscring.h"
+#include "util-tcpreasm.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -16,6 +19,8 @@ int g_line_number;
 unsigned g_section;
 size_t g_index;
 size_t g_count;
+unsigned g_options;
+struct dnsintern_t *g_intern;
 
 
 /**
@@ -198,6 +203,136 @@ _process_record(struct dnsrrdata_t *rr, const char *expected_name, int expected_
     return result;
 }
 
+/**
+ * Makes sure the zero-copy view of the packet finds the same records
+ * as the full parse did.
+ */
+static int
+_test_view(const unsigned char *buf, size_t length, const struct dns_t *dns, int line_number)
+{
+    struct dnsview_t *view;
+    size_t total;
+    size_t i;
+    int err = 0;
+
+    view = dns_view(buf, length, 0);
+    if (view == NULL || view->error_code != 0) {
+        dns_view_free(view);
+        fprintf(stderr, "[-] %d: view failure: %s\n", line_number, g_name);
+        return 1;
+    }
+    if (view->query_count != dns->query_count
+        || view->answer_count != dns->answer_count
+        || view->nameserver_count != dns->nameserver_count
+        || view->additional_count != dns->additional_count
+        || memcmp(&view->flags, &dns->flags, sizeof(dns->flags)) != 0) {
+        dns_view_free(view);
+        fprintf(stderr, "[-] %d: view header mismatch: %s\n", line_number, g_name);
+        return 1;
+    }
+
+    total = dns->query_count + dns->answer_count + dns->nameserver_count + dns->additional_count;
+    for (i=0; i<total; i++) {
+        const dnsrrview_t *rv = &view->queries[i];
+        const dnsrrdata_t *rr = &dns->queries[i];
+        char name[256];
+
+        dns_view_name(view, rv->name_offset, name, sizeof(name));
+        if (rv->rtype != rr->rtype
+            || rv->section != rr->section
+            || (rv->rtype != 41 && rv->ttl != rr->ttl)
+            || strcmp(name, (const char *)rr->name) != 0) {
+            fprintf(stderr, "[-] %d: view record mismatch: %s: %s != %s\n", line_number, g_name, name, rr->name);
+            err = 1;
+            break;
+        }
+    }
+
+    dns_view_free(view);
+    return err;
+}
+
+/**
+ * Makes sure iterating the records one at a time decodes the same
+ * contents as the full parse did.
+ */
+static int
+_test_iter(const unsigned char *buf, size_t length, const struct dns_t *dns, int line_number)
+{
+    struct dnsiter_t iter;
+    unsigned char scratch[DNS_ITER_SCRATCH];
+    const struct dnsrrdata_t *rr;
+    size_t i = 0;
+
+    dns_iter_begin(&iter, buf, length, scratch, sizeof(scratch));
+    if (iter.answer_count != dns->answer_count) {
+        fprintf(stderr, "[-] %d: iter header mismatch: %s\n", line_number, g_name);
+        return 1;
+    }
+
+    while ((rr = dns_iter_next(&iter)) != NULL) {
+        const struct dnsrrdata_t *rr0 = &dns->queries[i++];
+        char output[65536];
+        char output0[65536];
+        int err;
+        int err0;
+
+        if (rr->rtype != rr0->rtype || rr->section != rr0->section || rr->ttl != rr0->ttl
+            || strcmp((const char *)rr->name, (const char *)rr0->name) != 0) {
+            fprintf(stderr, "[-] %d: iter record mismatch: %s: %s\n", line_number, g_name, rr->name);
+            return 1;
+        }
+        if (rr->section == 0 || rr->rtype == 41)
+            continue;
+        err = dns_format_rdata(rr, output, sizeof(output));
+        err0 = dns_format_rdata(rr0, output0, sizeof(output0));
+        if (err != err0 || (err == 0 && strcmp(output, output0) != 0)) {
+            fprintf(stderr, "[-] %d: iter rdata mismatch: %s: %s != %s\n", line_number, g_name, output, output0);
+            return 1;
+        }
+    }
+
+    if (iter.error_code || i != dns->query_count + dns->answer_count + dns->nameserver_count + dns->additional_count) {
+        fprintf(stderr, "[-] %d: iter failure: %s: error=%d\n", line_number, g_name, iter.error_code);
+        return 1;
+    }
+
+    /* The EDNS0 fields are only known once we've reached the OPT record */
+    if (memcmp(&iter.flags, &dns->flags, sizeof(dns->flags)) != 0) {
+        fprintf(stderr, "[-] %d: iter flags mismatch: %s\n", line_number, g_name);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Makes sure the triage header parse agrees with the full parse.
+ */
+static int
+_test_header(const unsigned char *buf, size_t length, const struct dns_t *dns, int line_number)
+{
+    struct dnsheader_t hdr;
+
+    if (dns_parse_header(buf, length, &hdr) != 0
+        || hdr.query_count != dns->query_count
+        || hdr.answer_count != dns->answer_count
+        || hdr.nameserver_count != dns->nameserver_count
+        || hdr.additional_count != dns->additional_count
+        || memcmp(&hdr.flags, &dns->flags, sizeof(dns->flags)) != 0) {
+        fprintf(stderr, "[-] %d: triage header mismatch: %s\n", line_number, g_name);
+        return 1;
+    }
+    if (dns->query_count
+        && (hdr.qtype != dns->queries[0].rtype
+            || hdr.qclass != dns->queries[0].rclass
+            || hdr.qname_length != strlen((const char *)dns->queries[0].name)
+            || strcmp(hdr.qname, (const char *)dns->queries[0].name) != 0)) {
+        fprintf(stderr, "[-] %d: triage query mismatch: %s: %s\n", line_number, g_name, hdr.qname);
+        return 1;
+    }
+    return 0;
+}
+
 /**
  * Parses the DNS response, testing first to make sure it has no parsing errors,
  * and second that it contains the desired record.
@@ -208,7 +343,7 @@ _test_string(int is_debug, const unsigned char *buf, size_t length, const char *
     struct dns_t *dns = NULL;
     size_t i;
     int found = Found_Nothing;
-    unsigned options = 0;
+    unsigned options = g_options;
     
     /* We save these global variables in our test-harnass so that we can get
      * access back to them later when printing error messages */
@@ -224,6 +359,7 @@ _test_string(int is_debug, const unsigned char *buf, size_t length, const char *
             fprintf(stderr, "[-] %d: memory failure: %s\n", line_number, expected_name);
                 return 1;
     }
+    dns_parse_intern(dns, g_intern);
     
     /*
      * Parse the packet
@@ -236,6 +372,31 @@ _test_string(int is_debug, const unsigned char *buf, size_t length, const char *
         return 1;
     }
 
+    /* When testing another parsing mode, the header and EDNS0 fields must
+     * be the same as with the default mode */
+    if (options) {
+        struct dns_t *dns0 = dns_parse(buf, length, 0, 0);
+        if (dns0 == NULL
+            || memcmp(&dns0->flags, &dns->flags, sizeof(dns->flags)) != 0
+            || dns0->answer_count != dns->answer_count
+            || dns0->additional_count != dns->additional_count) {
+            dns_parse_free(dns0);
+            dns_parse_free(dns);
+            fprintf(stderr, "[-] %d: header mismatch: %s\n", line_number, expected_name);
+            return 1;
+        }
+        dns_parse_free(dns0);
+    }
+
+    /* The zero-copy view, the iterator, and the triage header must
+     * agree with the full parse */
+    if (_test_view(buf, length, dns, line_number)
+        || _test_iter(buf, length, dns, line_number)
+        || _test_header(buf, length, dns, line_number)) {
+        dns_parse_free(dns);
+        return 1;
+    }
+
     /* Decode answers */
     g_section = 1;
     g_count = dns->answer_count;
@@ -1026,33 +1187,83 @@ _crash_handler(int sig)
  */
 #define REALWORLD(packet, name, rtype, expected) _test_string(0, packet, sizeof(packet)-1, name, DNS_T_##rtype, expected, __LINE__ )
 
-int main(void)
+/**
+ * Parses a batch of packets, including a truncated one, and makes sure
+ * the results are the same as parsing them one at a time. This is done
+ * with and without DNS_F_SINGLEPASS, starting with a smaller batch so
+ * that the recycled memory has to grow.
+ */
+static int
+_test_batch(void)
 {
-    
-    /* The reason this variable exists is to simplify writing the code,
-     * so that we can write simply "err_count += test(...)", without
-     * checking the success/failure of tests until the very end. In
-     * other words, it's really binary, 0=success, and anything else
-     * failure, but we just want to simplify writing the code by
-     * adding failures together. In other words, you could replace
-     * all the += with |= and the logic would still work. */
-    int err_count = 0;
+    const unsigned char *bufs[] = {any_mozilla, ptr_one, packet00, ptr_comcast, packet01, packet07};
+    size_t lengths[] = {sizeof(any_mozilla)-1, sizeof(ptr_one)-1, 20, sizeof(ptr_comcast)-1, sizeof(packet01)-1, sizeof(packet07)-1};
+    size_t count = sizeof(bufs)/sizeof(bufs[0]);
+    struct dnsbatch_t *batch = NULL;
+    int pass;
+    size_t i;
 
-    /* On Linux/macOS, we install a signal handler that will tell us on
-     * which line of code the unitest fails, so that we can diagnose problems
-     * in the field without having to run the debugger. */
-#ifndef WIN32
-    signal(SIGSEGV, _crash_handler);
-#endif
-    
-    /* Some simple internal tests. This will try to force some errors of
-     * internal functions that we can't conveniently reach from outside
-     * the module, for code coverage. */
-    if (dns_quicktest() != 0) {
-        fprintf(stderr, "[-] %d: quick test failed\n", __LINE__);
-        err_count++;
+    /* Do it three times for each mode, recycling the one before */
+    for (pass=0; pass<6; pass++) {
+        unsigned flags = (pass < 3) ? 0 : DNS_F_SINGLEPASS;
+        size_t n = (pass % 3 == 0) ? 2 : count;
+
+        if (pass == 3) {
+            dns_parse_batch_free(batch);
+            batch = NULL;
+        }
+        batch = dns_parse_batch(bufs, lengths, n, flags, batch);
+        if (batch == NULL || batch->count != n) {
+            fprintf(stderr, "[-] %d: batch failure\n", __LINE__);
+            dns_parse_batch_free(batch);
+            return 1;
+        }
+
+        for (i=0; i<n; i++) {
+            const struct dns_t *dns = batch->results[i];
+            struct dns_t *dns0 = dns_parse(bufs[i], lengths[i], 0, 0);
+            size_t j;
+            int err = 0;
+
+            if (dns0 == NULL || (dns0->error_code != 0) != (dns->error_code != 0))
+                err = 1;
+            else if (dns0->error_code == 0) {
+                if (dns0->answer_count != dns->answer_count
+                    || dns0->additional_count != dns->additional_count
+                    || memcmp(&dns0->flags, &dns->flags, sizeof(dns->flags)) != 0)
+                    err = 1;
+                for (j=0; !err && j<dns->answer_count + dns->nameserver_count; j++) {
+                    char output[65536];
+                    char output0[65536];
+                    dns_format_rdata(&dns->answers[j], output, sizeof(output));
+                    dns_format_rdata(&dns0->answers[j], output0, sizeof(output0));
+                    if (strcmp((const char *)dns->answers[j].name, (const char *)dns0->answers[j].name) != 0
+                        || strcmp(output, output0) != 0)
+                        err = 1;
+                }
+            }
+            dns_parse_free(dns0);
+            if (err) {
+                fprintf(stderr, "[-] %d: batch mismatch: packet #%u\n", __LINE__, (unsigned)i);
+                dns_parse_batch_free(batch);
+                return 1;
+            }
+        }
     }
 
+    dns_parse_batch_free(batch);
+    return 0;
+}
+
+/**
+ * Runs all the tests for records and packets. This is called once for
+ * each parsing mode, which must all produce the same results.
+ */
+static int
+_test_all(void)
+{
+    int err_count = 0;
+
     /* Test some bad packets. This runs through all sizes of an existing
      * packet, except for the correct one. In other words, all these tests
      * should generate a failure for our selftest to succeed. */
@@ -1096,6 +1307,16 @@ int main(void)
      * of a name, it needs to be escaped.
      * TODO: maybe this is wrong and the code should reject non-hostnames */
     err_count += RR(NS, "\x02" "ns" "\x07" "e.ample" "\x03" "com" "\x00", "ns.e\\.ample.com.");
+
+    /* Long labels are checked for characters needing escapes many bytes at a
+     * time, so test special characters on either side of 16 and 32 byte
+     * boundaries, as well as a maximum length label without any. */
+    err_count += RR(NS, "\x3f" "abcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabc" "\x00",
+                        "abcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabc.");
+    err_count += RR(NS, "\x28" "0123456789abcde\"0123456789abcde.0123456\xff" "\x00",
+                        "0123456789abcde\\\"0123456789abcde\\.0123456\\\xff.");
+    err_count += RR(NS, "\x21" "\\123456789abcdef0123456789abcdef\x01" "\x03" "com" "\x00",
+                        "\\\\123456789abcdef0123456789abcdef\\\x01.com.");
     
     /* Error on name compression, where the RDATA has one byte, but not the second
      * byte, of the compression pointer. */
@@ -1227,6 +1448,92 @@ int main(void)
     err_count += REALWORLD(bad_uri, "kientrucnhaviet.net.", URI, "2664 29812 \"p://www\\015kientrucnhaviet\\003net\\000\"");
     err_count += REALWORLD(bad_uri, "kientrucnhaviet.net.", NSEC3PARAM, "1 0 1 AB");
 
+    return err_count;
+}
+
+int main(void)
+{
+    
+    /* The reason this variable exists is to simplify writing the code,
+     * so that we can write simply "err_count += test(...)", without
+     * checking the success/failure of tests until the very end. In
+     * other words, it's really binary, 0=success, and anything else
+     * failure, but we just want to simplify writing the code by
+     * adding failures together. In other words, you could replace
+     * all the += with |= and the logic would still work. */
+    int err_count = 0;
+
+    /* On Linux/macOS, we install a signal handler that will tell us on
+     * which line of code the unitest fails, so that we can diagnose problems
+     * in the field without having to run the debugger. */
+#ifndef WIN32
+    signal(SIGSEGV, _crash_handler);
+#endif
+    
+    /* Some simple internal tests. This will try to force some errors of
+     * internal functions that we can't conveniently reach from outside
+     * the module, for code coverage. */
+    if (dns_quicktest() != 0) {
+        fprintf(stderr, "[-] %d: quick test failed\n", __LINE__);
+        err_count++;
+    }
+
+    /* Run all the tests, first with the default two-pass parser, then
+     * with the single-pass parser. */
+    g_options = 0;
+    err_count += _test_all();
+    g_options = DNS_F_SINGLEPASS;
+    if (_test_all()) {
+        fprintf(stderr, "[-] %d: single-pass tests failed\n", __LINE__);
+        err_count++;
+    }
+
+    /* Run them again, storing names in an intern pool, one small enough
+     * that it fills up so that we test both ways of storing names. */
+    g_intern = dns_intern_create(1024);
+    g_options = 0;
+    if (_test_all()) {
+        fprintf(stderr, "[-] %d: intern tests failed\n", __LINE__);
+        err_count++;
+    }
+    g_options = DNS_F_SINGLEPASS;
+    if (_test_all()) {
+        fprintf(stderr, "[-] %d: intern single-pass tests failed\n", __LINE__);
+        err_count++;
+    }
+    dns_intern_destroy(g_intern);
+    g_intern = NULL;
+    g_options = 0;
+
+    /* Names from the same pool must be the same pointers, even across
+     * different packets */
+    {
+        struct dnsintern_t *pool = dns_intern_create(0);
+        struct dns_t *dns1;
+        struct dns_t *dns2;
+
+        dns1 = dns_parse_allocator(0, 0, 0);
+        dns_parse_intern(dns1, pool);
+        dns1 = dns_parse(any_mozilla, sizeof(any_mozilla)-1, 0, dns1);
+        dns2 = dns_parse_allocator(0, 0, 0);
+        dns_parse_intern(dns2, pool);
+        dns2 = dns_parse(any_mozilla, sizeof(any_mozilla)-1, DNS_F_SINGLEPASS, dns2);
+        if (dns1 == NULL || dns2 == NULL || dns1->error_code || dns2->error_code
+            || dns1->answer_count == 0
+            || dns1->answers[0].name != dns2->answers[0].name
+            || dns1->answers[0].name != dns_intern(pool, "mozilla.org.")
+            || dns1->queries[0].name != dns1->answers[0].name) {
+            fprintf(stderr, "[-] %d: intern test failed\n", __LINE__);
+            err_count++;
+        }
+        dns_parse_free(dns1);
+        dns_parse_free(dns2);
+        dns_intern_destroy(pool);
+    }
+
+    /* Test parsing many packets at once */
+    err_count += _test_batch();
+
     /* Test for memory allocation failures */
     {
         size_t count = 1;
@@ -1240,6 +1547,32 @@ int main(void)
             err_count++;
         }
     }
+    {
+        size_t count = 1;
+        struct dns_t *dns;
+        
+        /* Same as above, but single-pass mode only allocates once */
+        dns = dns_parse_allocator(_oom_allocator, &count, 0);
+        dns = dns_parse(any_mozilla, sizeof(any_mozilla)-1, DNS_F_SINGLEPASS, dns);
+        if (dns != NULL) {
+            fprintf(stderr, "[-] Out-of-Memory test failed (single-pass)\n");
+            err_count++;
+        }
+    }
+
+    /* Test the utility modules the tools are built from */
+    if (pcapfile_selftest() != 0) {
+        fprintf(stderr, "[-] %d: pcapfile test failed\n", __LINE__);
+        err_count++;
+    }
+    if (spscring_selftest() != 0) {
+        fprintf(stderr, "[-] %d: spscring test failed\n", __LINE__);
+        err_count++;
+    }
+    if (tcpreasm_selftest() != 0) {
+        fprintf(stderr, "[-] %d: tcpreasm test failed\n", __LINE__);
+        err_count++;
+    }
     
     if (err_count == 0) {
         fprintf(stderr, "[+] dns-parse: success\n");
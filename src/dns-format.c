@@ -118,6 +118,7 @@ _append_decimaltime(stream_t *out, unsigned long long n)
 {
     static const unsigned rough_y2k = 30 * 365 * 24 * 60 * 60;
     time_t t;
+    struct tm tmbuf;
     struct tm *tm;
 
     /* Y2038 bug (epocalypse): The RRSIG spec defines this as a 32-bit
@@ -130,7 +131,13 @@ _append_decimaltime(stream_t *out, unsigned long long n)
         n += (1ULL << 32ULL);
     t = (time_t)n;
 
-    tm = gmtime(&t);
+    /* This may be called from many threads at once, so we can't use
+     * gmtime(), which returns a static buffer */
+#if defined(_WIN32)
+    tm = (gmtime_s(&tmbuf, &t) == 0) ? &tmbuf : NULL;
+#else
+    tm = gmtime_r(&t, &tmbuf);
+#endif
 
     if (tm == NULL)
         _append_decimal(out, n);
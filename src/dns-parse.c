@@ -12,6 +12,14 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <math.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 enum {DNS_query, DNS_answer, DNS_nameserver, DNS_additional};
 
@@ -77,9 +85,17 @@ _calloc(struct dns_t **dns, size_t count, size_t size)
      * segment. */
     if ((*dns)->_current_size + total > (*dns)->_max_size) {
         
-        /* This should never happen in phase 2, only in phase 1 */
-        assert((*dns)->mem.is_postalloc == 0);
-        
+        /* This should never happen in phase 2 (or in single-pass mode,
+         * where the memory was sized for the worst case), only in phase 1.
+         * The exception is the scratch memory of `dns_iter_next()`, which
+         * starts over when a record doesn't fit. Either way, fail the
+         * allocation rather than write past the end */
+        assert((*dns)->mem.is_postalloc == 0 || (*dns)->mem.is_scratch);
+        if ((*dns)->mem.is_postalloc) {
+            (*dns)->error_code = DNS_out_of_memory;
+            return NULL;
+        }
+
         (*dns)->_max_size = (*dns)->_current_size + total;
     }
     
@@ -179,18 +195,56 @@ _next_uint8(struct streamr_t *s)
 }
 
 
-static unsigned short
-_next_uint16_peek(struct streamr_t *s, int *is_exists)
+/**
+ * Decodes big-endian numbers from memory that's already been bounds-checked.
+ * These are unaligned loads, which compilers turn into a single instruction
+ * (plus a byte-swap) on most CPUs.
+ */
+static inline unsigned short
+_load_be16(const unsigned char *p)
 {
-    if (s->offset + 1 < s->length) {
-        *is_exists = 1;
-        return s->buf[s->offset]<<8 | s->buf[s->offset+1];
-    } else {
-        *is_exists = 0;
-        return 0;
-    }
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint16_t x;
+    memcpy(&x, p, sizeof(x));
+    return __builtin_bswap16(x);
+#else
+    return (unsigned short)(p[0]<<8 | p[1]);
+#endif
+}
+
+static inline unsigned
+_load_be32(const unsigned char *p)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return __builtin_bswap32(x);
+#else
+    return (unsigned)p[0]<<24 | (unsigned)p[1]<<16 | (unsigned)p[2]<<8 | p[3];
+#endif
 }
 
+/**
+ * Checks that there are `count` bytes in the stream for a fixed-size
+ * structure, moves the offset forward past them, and returns a pointer
+ * to them so that the fields can be decoded with `_load_be16()` and
+ * `_load_be32()`. If there aren't enough bytes, this returns NULL
+ * and sets the error.
+ */
+static inline const unsigned char *
+_next_fixed(struct streamr_t *s, size_t count)
+{
+    const unsigned char *result;
+
+    if (count > s->length - s->offset || s->offset > s->length) {
+        s->offset = s->length;
+        s->is_error = DNS_input_overflow;
+        return NULL;
+    }
+    result = s->buf + s->offset;
+    s->offset += count;
+    return result;
+}
 
 /**
  * Reads next 16-bit big-endian number and moves offset forward
@@ -198,12 +252,8 @@ _next_uint16_peek(struct streamr_t *s, int *is_exists)
 static unsigned short 
 _next_uint16(struct streamr_t *s)
 {
-    unsigned short result;
-    
-    result = _next_uint8(s) << 8;
-    result |= _next_uint8(s);
-    
-    return result;
+    const unsigned char *p = _next_fixed(s, 2);
+    return p ? _load_be16(p) : 0;
 }
 
 
@@ -214,12 +264,8 @@ _next_uint16(struct streamr_t *s)
 static unsigned
 _next_uint32(struct streamr_t *s)
 {
-    unsigned result;
-    
-    result = _next_uint16(s) << 16;
-    result |= _next_uint16(s);
-    
-    return result;
+    const unsigned char *p = _next_fixed(s, 4);
+    return p ? _load_be32(p) : 0;
 }
 
 
@@ -297,6 +343,118 @@ _next_charstring(struct streamr_t *src, const unsigned char **dst, size_t *dst_l
     return src->is_error;
 }
 
+/**
+ * While [hostnames] have restrictions to just alphanumeric and
+ * dot/dash, [domainnames] themselves can contain any binary data.
+ * Therefore, we escape any binary data. We also escape things
+ * that would affect parsing of the names, like the dot when it
+ * appears within a label, or the escape character itself.
+ */
+static inline int
+_is_escaped(unsigned char c)
+{
+    return c == '.' || c == '\\' || c == '\"' || c < 32 || 126 < c;
+}
+
+static inline unsigned
+_ctz(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/**
+ * Returns the number of bytes at the start of a label that don't need
+ * to be escaped. Since most names have nothing that needs escaping,
+ * this checks many bytes at once where the CPU allows it.
+ */
+static size_t
+_label_safe_prefix(const unsigned char *label, size_t length)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    {
+        const __m256i space = _mm256_set1_epi8(31);
+        const __m256i del = _mm256_set1_epi8(127);
+        const __m256i dot = _mm256_set1_epi8('.');
+        const __m256i backslash = _mm256_set1_epi8('\\');
+        const __m256i quote = _mm256_set1_epi8('\"');
+
+        for (; i + 32 <= length; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(label + i));
+            /* Signed compares, so bytes above 127 are negative */
+            __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, space), _mm256_cmpgt_epi8(del, v));
+            __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi8(v, dot),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, backslash), _mm256_cmpeq_epi8(v, quote)));
+            unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_andnot_si256(bad, ok));
+            if (mask)
+                return i + _ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    {
+        const __m128i space = _mm_set1_epi8(31);
+        const __m128i del = _mm_set1_epi8(127);
+        const __m128i dot = _mm_set1_epi8('.');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i quote = _mm_set1_epi8('\"');
+
+        for (; i + 16 <= length; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(label + i));
+            /* Signed compares, so bytes above 127 are negative */
+            __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, space), _mm_cmplt_epi8(v, del));
+            __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(v, dot),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, backslash), _mm_cmpeq_epi8(v, quote)));
+            unsigned mask = ~(unsigned)_mm_movemask_epi8(_mm_andnot_si128(bad, ok)) & 0xFFFF;
+            if (mask)
+                return i + _ctz(mask);
+        }
+    }
+#endif
+
+    /* The remaining bytes, or all of them without SIMD */
+    for (; i < length; i++) {
+        if (_is_escaped(label[i]))
+            break;
+    }
+    return i;
+}
+
+/**
+ * Appends the bytes of a label to the name, escaping those that need it.
+ * Runs of bytes that don't need escaping are copied all at once.
+ */
+static void
+_append_label(struct streamw_t *name, const unsigned char *label, size_t length)
+{
+    while (length) {
+        size_t n = _label_safe_prefix(label, length);
+
+        if (name->offset + n > name->length) {
+            name->is_error = DNS_programming_error;
+            return;
+        }
+        memcpy(name->buf + name->offset, label, n);
+        name->offset += n;
+        label += n;
+        length -= n;
+
+        if (length) {
+            _append_byte(name, '\\');
+            _append_byte(name, *label);
+            label++;
+            length--;
+        }
+    }
+}
+
 /**
  * Used internally to skip a 'name', either before the RDATA, or within the RDATA.
  * This walks the series of labels in a name, ending either with the label 0x00,
@@ -408,7 +566,6 @@ _next_domainname(struct streamr_t *rdata, struct streamr_t packet, unsigned char
             break;
         } else if (len <= 0x3F) {
             /* this is a [label length] field */
-            size_t i;
             
             /* Put a dot '.' between labels after the first */
             if (count)
@@ -418,27 +575,14 @@ _next_domainname(struct streamr_t *rdata, struct streamr_t packet, unsigned char
             if (count + 1 > 255)
                 goto fail_input;
 
-            /* Copy over the bytes one byte one. Binary/special bytes need
+            /* Copy over the label. Binary/special bytes need
              * to be escaped. */
-            for (i=0; i<len; i++) {
-                unsigned char c;
-                
-                c = _next_uint8(&src);
-                if (src.is_error)
-                    goto fail;
-                
-                
-                /* While [hostnames] have restrictions to just alphanumeric and
-                 * dot/dash, [domainnames] themselves can contain any binary data.
-                 * Therefore, here we escape any binary data. We also escape things
-                 * that would affect parsing of the names, like the dot when it
-                 * appears within a label, or the escape character itself. */
-                if (c == '.' || c == '\\' || c == '\"' || c < 32 || 126 < c)
-                    _append_byte(&name, '\\');
-                
-                /* append this byte to the name */
-                _append_byte(&name, c);
+            if (src.offset + len > src.length) {
+                src.is_error = DNS_input_overflow;
+                goto fail;
             }
+            _append_label(&name, src.buf + src.offset, len);
+            src.offset += len;
             
         } else if ((len & 0xC0) == 0xC0) {
             /* This is name [compression]. Instead of a 1-byte length, it's a
@@ -509,98 +653,265 @@ _next_domainname(struct streamr_t *rdata, struct streamr_t packet, unsigned char
         
 }
 
-#define NAMECACHE_MAX 4
-struct domainname_cache
+/**
+ * A pool of names shared across many parsed packets. The strings are
+ * stored in large blocks that never move, and indexed by a hash table
+ * that grows as needed.
+ */
+struct dnsintern_block
+{
+    struct dnsintern_block *next;
+    size_t used;
+    size_t size;
+    unsigned char buf[1];
+};
+struct dnsintern_slot
 {
+    const unsigned char *name;
+    unsigned hash;
+    unsigned length;
+};
+struct dnsintern_t
+{
+    struct dnsintern_slot *slots;
+    size_t slot_count;
     size_t count;
-    unsigned short offsets[NAMECACHE_MAX];
-    const unsigned char *names[NAMECACHE_MAX];
+    size_t bytes;
+    size_t max_bytes;
+    struct dnsintern_block *blocks;
 };
 
-static void inline
-_cache_init(struct domainname_cache *namecache)
+#define INTERN_BLOCK_SIZE 65536
+
+static unsigned
+_fnv1a(const unsigned char *name, size_t length)
 {
-    memset(namecache->offsets, 0, sizeof(namecache->offsets));
-    namecache->count = 0;
+    unsigned hash = 2166136261U;
+    size_t i;
+
+    /* FNV-1a */
+    for (i=0; i<length; i++) {
+        hash ^= name[i];
+        hash *= 16777619U;
+    }
+    return hash;
 }
 
-static void inline
-_cache_add(struct domainname_cache *namecache, unsigned short offset, const unsigned char **name, int is_postalloc)
+/**
+ * Doubles the size of the hash table, re-inserting everything.
+ */
+static int
+_intern_grow(struct dnsintern_t *pool)
 {
+    size_t new_count = pool->slot_count * 2;
+    struct dnsintern_slot *new_slots;
     size_t i;
-    
-    /* Use of namecache is optional, if NULL, then nothing to do. */
-    if (namecache == NULL)
-        return;
-    
-    /* Ignore duplicates */
-    for (i=0; i<namecache->count; i++) {
-        if (namecache->offsets[i] == offset)
-            return;
+
+    new_slots = calloc(new_count, sizeof(new_slots[0]));
+    if (new_slots == NULL)
+        return DNS_out_of_memory;
+
+    for (i=0; i<pool->slot_count; i++) {
+        size_t j;
+        if (pool->slots[i].name == NULL)
+            continue;
+        for (j = pool->slots[i].hash & (new_count - 1); new_slots[j].name; j = (j + 1) & (new_count - 1))
+            ;
+        new_slots[j] = pool->slots[i];
     }
-    
-    /* If space in our cache, add it */
-    if (namecache->count < NAMECACHE_MAX) {
-        namecache->offsets[namecache->count] = offset;
-        if (is_postalloc) {
-            namecache->names[namecache->count] = *name;
-        } else {
-            /* Don't reference the pointer in first pass, when it doesn't
-             * actually exist */
-            namecache->names[namecache->count] = (const unsigned char*)"fail";
-        }
-        namecache->count++;
+    free(pool->slots);
+    pool->slots = new_slots;
+    pool->slot_count = new_count;
+    return 0;
+}
+
+/**
+ * Finds the name in the pool, adding it if it's not already there.
+ * @return
+ *      The pool's nul-terminated copy of the name, or NULL if it's full.
+ */
+static const unsigned char *
+_intern(struct dnsintern_t *pool, const unsigned char *name, size_t length)
+{
+    unsigned hash = _fnv1a(name, length);
+    struct dnsintern_block *block;
+    unsigned char *result;
+    size_t i;
+
+    for (i = hash & (pool->slot_count - 1); pool->slots[i].name; i = (i + 1) & (pool->slot_count - 1)) {
+        const struct dnsintern_slot *slot = &pool->slots[i];
+        if (slot->hash == hash && slot->length == length && memcmp(slot->name, name, length) == 0)
+            return slot->name;
+    }
+
+    /* Not found, so add it, unless we've reached the limit */
+    if (pool->max_bytes && pool->bytes + length + 1 > pool->max_bytes)
+        return NULL;
+    block = pool->blocks;
+    if (block == NULL || block->used + length + 1 > block->size) {
+        block = malloc(sizeof(*block) + INTERN_BLOCK_SIZE);
+        if (block == NULL)
+            return NULL;
+        block->used = 0;
+        block->size = INTERN_BLOCK_SIZE;
+        block->next = pool->blocks;
+        pool->blocks = block;
     }
+    result = block->buf + block->used;
+    memcpy(result, name, length);
+    result[length] = '\0';
+    block->used += length + 1;
+    pool->bytes += length + 1;
+
+    pool->slots[i].name = result;
+    pool->slots[i].hash = hash;
+    pool->slots[i].length = (unsigned)length;
+    pool->count++;
+
+    /* Keep the table no more than half full. If we can't grow it, that's
+     * fine, it just gets slower */
+    if (pool->count * 2 > pool->slot_count)
+        _intern_grow(pool);
+
+    return result;
 }
 
-static int
-_cache_bypass(struct streamr_t *src, const unsigned char **dst, struct domainname_cache *namecache, int is_postalloc)
+struct dnsintern_t *
+dns_intern_create(size_t max_bytes)
+{
+    struct dnsintern_t *pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->slot_count = 1024;
+    pool->slots = calloc(pool->slot_count, sizeof(pool->slots[0]));
+    if (pool->slots == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->max_bytes = max_bytes;
+    return pool;
+}
+
+void
+dns_intern_destroy(struct dnsintern_t *pool)
+{
+    if (pool == NULL)
+        return;
+    while (pool->blocks) {
+        struct dnsintern_block *next = pool->blocks->next;
+        free(pool->blocks);
+        pool->blocks = next;
+    }
+    free(pool->slots);
+    free(pool);
+}
+
+const unsigned char *
+dns_intern(struct dnsintern_t *pool, const char *name)
+{
+    if (pool == NULL || name == NULL)
+        return NULL;
+    return _intern(pool, (const unsigned char *)name, strlen(name));
+}
+
+void
+dns_intern_stats(const struct dnsintern_t *pool, size_t *count, size_t *bytes)
+{
+    if (count)
+        *count = pool ? pool->count : 0;
+    if (bytes)
+        *bytes = pool ? pool->bytes : 0;
+}
+
+/**
+ * A table of every name (and suffix of a name) decoded so far in the packet,
+ * indexed by the offset of its first label. Compression pointers can only
+ * point at labels we've already seen, so when we hit one, we find the
+ * rest of the name here instead of walking the packet again. When a name
+ * is nothing but a pointer to a known name, the decoded string is shared
+ * rather than copied.
+ */
+#define NAMETABLE_MAX 256
+struct nametable_entry
 {
-    int is_exists = 0;
+    /* The nul-terminated decoded name starting at this label, pointing
+     * into the middle of a previously decoded name */
+    const unsigned char *name;
+
+    /* The offset of the label in the packet, 0 if this entry is empty */
     unsigned short offset;
+
+    /* The length of the [name] string */
+    unsigned short name_length;
+
+    /* The number of bytes of labels, which count against the 255 byte
+     * limit of names, and the number of compression pointers that pointed
+     * to other pointers, which count against the recursion limit */
+    unsigned char wire_length;
+    unsigned char recursion_count;
+};
+struct nametable
+{
+    size_t count;
+    struct nametable_entry entries[NAMETABLE_MAX];
+};
+
+static inline void
+_nametable_init(struct nametable *table)
+{
+    memset(table->entries, 0, sizeof(table->entries));
+    table->count = 0;
+}
+
+static inline size_t
+_nametable_hash(size_t offset)
+{
+    return (offset * 2654435761U >> 8) & (NAMETABLE_MAX - 1);
+}
+
+static inline const struct nametable_entry *
+_nametable_lookup(const struct nametable *table, size_t offset)
+{
     size_t i;
-    
-    /* Sometimes this function is called without using a cache, in which
-     * case return as if nothing was found in the cache */
-    if (namecache == NULL)
-        return 0;
-    
-    /* Peek at the parsed domain name looking for a compression pointer. We
-     * only support compressed names, not uncompressed names */
-    offset = _next_uint16_peek(src, &is_exists);
-    if (!is_exists)
-        return 0;
-    if ((offset & 0xC000) != 0xC000)
-        return 0;
-    else
-        offset &= 0x3FFF;
-    
-    /* Lookup the offset in our short list of offsets */
-    for (i=0; i<namecache->count; i++) {
-        if (namecache->offsets[i] == offset) {
-            
-            /* Point this to the existing name */
-            if (is_postalloc) {
-                *dst = namecache->names[i];
-            }
-            
-            /* Skip this name */
-            _skip_name(src);
-            
-            /* Return a flag indicating success */
-            return 1;
-        }
+
+    if (table == NULL || table->count == 0)
+        return NULL;
+
+    for (i = _nametable_hash(offset); table->entries[i].offset; i = (i + 1) & (NAMETABLE_MAX - 1)) {
+        if (table->entries[i].offset == offset)
+            return &table->entries[i];
     }
-    
-    /* not found */
-    return 0;
+    return NULL;
+}
+
+static inline void
+_nametable_add(struct nametable *table, const struct nametable_entry *entry)
+{
+    size_t i;
+
+    /* Use of the table is optional, and we don't let it get more than
+     * 3/4 full, so that lookups stay fast */
+    if (table == NULL || table->count >= NAMETABLE_MAX * 3 / 4)
+        return;
+
+    for (i = _nametable_hash(entry->offset); table->entries[i].offset; i = (i + 1) & (NAMETABLE_MAX - 1)) {
+        if (table->entries[i].offset == entry->offset)
+            return;
+    }
+    table->entries[i] = *entry;
+    table->count++;
 }
 
 /**
  * Extracts a (compressed) DNS name from the packet, converting to a
  * nul-temrinated string, and allocating bytes to contain it. Because of name
  * compression, processing can jump from outside the current source stream
- * to somewhere else i nthe packet.
+ * to somewhere else i nthe packet. This does the same thing and the
+ * same validation as _next_domainname(), but it stops when it reaches
+ * a label that's in the table of names, copying the rest of the name
+ * from there.
  * @param src
  *      The stream where we are reading sequential fields. This is
  *      either the domain-name in front fo the resource-record, or
@@ -615,67 +926,223 @@ _cache_bypass(struct streamr_t *src, const unsigned char **dst, struct domainnam
  *      An out parameter that receives the domain-name as a nul-terminates string.
  * @param dns
  *      This represents the allocator from which we are getting memory.
+ * @param table
+ *      The names previously decoded from this packet, to which the labels
+ *      of this name are added. May be NULL.
  */
 static int
-_copy_domainname(struct streamr_t *src, struct streamr_t packet, const unsigned char **dst, struct dns_t **dns, struct domainname_cache *namecache)
+_copy_domainname(struct streamr_t *src, struct streamr_t packet, const unsigned char **dst, struct dns_t **dns, struct nametable *table)
 {
     unsigned char tmpname[256];
+    struct streamw_t name = {tmpname, 0, sizeof(tmpname), 0};
+    struct streamr_t s = *src;
+    struct {
+        unsigned short offset;
+        unsigned short name_offset;
+        unsigned char count;
+        unsigned char recursion_count;
+    } labels[128];
+    size_t label_count = 0;
+    const struct nametable_entry *suffix = NULL;
+    size_t recursion_count = 0;
+    size_t count = 0;
     size_t name_length;
     unsigned char *newname;
-    unsigned name_offset;
-    
-    /* If the name is in our cache, then bypass parsing it from the packet */
-    if (_cache_bypass(src, dst, namecache, (*dns)->mem.is_postalloc))
-        return 0;
-    name_offset = (unsigned)src->offset;
-    
+    unsigned is_postalloc = (*dns)->mem.is_postalloc;
+    struct dnsintern_t *pool = (*dns)->mem.intern;
+    unsigned is_interned = 0;
+    size_t i;
+    int err;
+
     /* Force the name to be NULL in case of parsing errors later */
-    if ((*dns)->mem.is_postalloc)
+    if (is_postalloc)
         *dst = NULL;
-    
-    /* First, copy the name into a temporary buffer */
-    name_length = _next_domainname(src, packet, tmpname, sizeof(tmpname));
-    if (name_length == 0) {
-        if (src->is_error == 0)
-            src->is_error = DNS_programming_error;
-        return src->is_error;
+
+    /* We work from a copy of the stream, but for output, we skip the name
+     * here in the stream, which may be only the two bytes of compression */
+    err = _skip_name(src);
+    if (err)
+        return err;
+
+    /* For each label... */
+    for (;;) {
+        size_t offset = (size_t)(s.buf - packet.buf) + s.offset;
+        size_t len;
+
+        /* get the tag/length field */
+        len = _next_uint8(&s);
+        if (s.is_error)
+            goto fail;
+
+        if (len == 0) {
+            /* This is the last [label] in the [domainame]. A [FQDN] fully
+             * qualified domain name always ends in a dot. */
+            _append_byte(&name, '.');
+            break;
+        } else if (len <= 0x3F) {
+            /* If we've seen this label before, the rest of the name is
+             * already decoded */
+            suffix = _nametable_lookup(table, offset);
+            if (suffix) {
+                if (count + suffix->wire_length + 1 > 255)
+                    goto fail_input;
+                if (recursion_count + suffix->recursion_count > 4)
+                    goto fail_input;
+                if (count)
+                    _append_byte(&name, '.');
+                if (name.offset + suffix->name_length + 1 > name.length)
+                    goto fail_programming;
+                if (is_postalloc || pool)
+                    memcpy(name.buf + name.offset, suffix->name, suffix->name_length);
+                name.offset += suffix->name_length;
+                count += suffix->wire_length;
+                recursion_count += suffix->recursion_count;
+                break;
+            }
+
+            /* Put a dot '.' between labels after the first */
+            if (count)
+                _append_byte(&name, '.');
+
+            /* Remember where this label was, so we can add it to the table */
+            labels[label_count].offset = (unsigned short)offset;
+            labels[label_count].name_offset = (unsigned short)name.offset;
+            labels[label_count].count = (unsigned char)count;
+            labels[label_count].recursion_count = (unsigned char)recursion_count;
+            label_count++;
+
+            count += 1 + len;
+            if (count + 1 > 255)
+                goto fail_input;
+
+            /* Copy over the label. Binary/special bytes need
+             * to be escaped. */
+            if (s.offset + len > s.length) {
+                s.is_error = DNS_input_overflow;
+                goto fail;
+            }
+            _append_label(&name, s.buf + s.offset, len);
+            s.offset += len;
+        } else if ((len & 0xC0) == 0xC0) {
+            /* This is name [compression], a jump to somewhere else in
+             * the packet */
+            unsigned char len2;
+
+            len2 = _next_uint8(&s);
+            if (s.is_error)
+                goto fail;
+
+            s.buf = packet.buf;
+            s.length = packet.length;
+            s.offset = (len & 0x3F) << 8 | len2;
+
+            /* Peek ahead looking for recursion */
+            if (s.offset + 1 > s.length)
+                goto fail_input_overflow;
+            if ((s.buf[s.offset] & 0xC0) == 0xC0) {
+                if (++recursion_count > 4) {
+                    goto fail_input;
+                }
+            }
+        } else {
+            /* Bad [tag] */
+            goto fail_input;
+        }
     }
-        
-    /* Now allocate a new buffer for the name and copy it over */
-    newname = _calloc(dns, 1, name_length + 1);
-    if (newname == NULL || *dns == NULL)
-        return DNS_out_of_memory;
-    
-    /* Now assign the field */
-    if ((*dns)->mem.is_postalloc) {
-        _memcpy_s(newname, name_length + 1, tmpname, name_length + 1);
+
+    /* Test whether there was an internal buffer overflow. This is
+     * due to a programming mistake, not bad input. */
+    name_length = name.offset;
+    _append_byte(&name, '\0');
+    if (name.is_error)
+        goto fail_programming;
+
+    /* If the entire name is one we've already seen, then share it. With
+     * a pool, it must be the pool's copy so that names can be compared by
+     * pointer, not the tail end of some other name */
+    if (label_count == 0 && suffix && pool == NULL) {
+        if (is_postalloc)
+            *dst = suffix->name;
+        return 0;
+    }
+
+    /* If there's a pool, the name goes there. This happens in the
+     * prealloc pass as well, so we don't reserve memory for it. If the pool
+     * is full, it'll still be full on the next pass. */
+    newname = NULL;
+    if (pool) {
+        newname = (unsigned char *)_intern(pool, tmpname, name_length);
+        is_interned = (newname != NULL);
+    }
+
+    /* Otherwise allocate a new buffer for the name and copy it over */
+    if (!is_interned) {
+        newname = _calloc(dns, 1, name_length + 1);
+        if (newname == NULL || *dns == NULL)
+            return DNS_out_of_memory;
+        if (is_postalloc)
+            _memcpy_s(newname, name_length + 1, tmpname, name_length + 1);
+    }
+    if (is_postalloc)
         *dst = newname;
+
+    /* In the prealloc pass, names not in the pool don't really exist yet,
+     * so with a pool, where we copy from the table in this pass, we can't
+     * add them */
+    if (pool && !is_interned && !is_postalloc)
+        return 0;
+
+    /* Add the labels to the table. Compression pointers can only reach
+     * the first 16k of the packet, so the rest aren't needed */
+    for (i=0; i<label_count; i++) {
+        struct nametable_entry entry;
+
+        if (labels[i].offset > 0x3FFF)
+            continue;
+        entry.offset = labels[i].offset;
+        entry.name = newname + labels[i].name_offset;
+        entry.name_length = (unsigned short)(name_length - labels[i].name_offset);
+        entry.wire_length = (unsigned char)(count - labels[i].count);
+        entry.recursion_count = (unsigned char)(recursion_count - labels[i].recursion_count);
+        _nametable_add(table, &entry);
     }
-    
-    /* Add the name to our cache */
-    _cache_add(namecache, name_offset, dst, (*dns)->mem.is_postalloc);
-    
+
     /* success */
     return 0;
+
+fail:
+    src->is_error = s.is_error;
+    return src->is_error;
+fail_input_overflow:
+    src->is_error = DNS_input_overflow;
+    return src->is_error;
+fail_input:
+    src->is_error = DNS_input_bad;
+    return src->is_error;
+fail_programming:
+    src->is_error = DNS_programming_error;
+    return src->is_error;
 }
 
 
 
-static int
-_parse_flags(struct dns_t *dns, const unsigned char *buf, size_t length)
+/**
+ * Parses the fixed-length 12-byte header at the start of the packet,
+ * the xid, flags, and the count of records in each section.
+ */
+static void
+_parse_header(struct streamr_t *packet, struct dnsflags_t *flags,
+              size_t *query_count, size_t *answer_count,
+              size_t *nameserver_count, size_t *additional_count)
 {
-    struct streamr_t packet = {buf, 0, length, 0};
-    struct dnsflags_t *flags = &dns->flags;
-    size_t additional_index;
     unsigned xx;
-    size_t i;
 
     memset(flags, 0, sizeof(*flags));
 
     /* Parse the fixed-length header */
-    flags->xid = _next_uint16(&packet); /* XID */
-    xx = _next_uint16(&packet);
-    
+    flags->xid = _next_uint16(packet); /* XID */
+    xx = _next_uint16(packet);
+
     /*
      15 14 13 12 11 10  9  8  7  6  5  4  3  2  1  0
     +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
@@ -692,12 +1159,69 @@ _parse_flags(struct dns_t *dns, const unsigned char *buf, size_t length)
     flags->is_Z = (xx >> 6) & 1;
     flags->is_authentic = (xx >> 5) & 1;
     flags->is_checking_disabled = (xx >> 4) & 1;
+    flags->rcode = xx & 0x0f;
+
+    *query_count = _next_uint16(packet);
+    *answer_count = _next_uint16(packet);
+    *nameserver_count = _next_uint16(packet);
+    *additional_count = _next_uint16(packet);
+}
+
+/**
+ * Parses the contents of the EDNS0 (OPT) record. This is called with
+ * the stream positioned after the [type] and [class] fields, where the [class]
+ * field has been reinterpretted as the UDP payload size. The [ttl] field
+ * is reinterpretted as the extended rcode, version, and flags. This
+ * consumes the rest of the record, including the [rdata].
+ */
+static void
+_parse_edns0(struct dnsflags_t *flags, struct streamr_t *packet, size_t offset, unsigned short udp_payload_size)
+{
+    const unsigned char *p;
+    unsigned x;
+    unsigned char version;
+    unsigned short zero;
+    unsigned short rdlength;
+
+    p = _next_fixed(packet, 6);
+    if (p == NULL)
+        return;
+    x = p[0];
+    version = p[1];
+    zero = _load_be16(p + 2);
+    rdlength = _load_be16(p + 4);
+    _next_skip(packet, rdlength);
+    if (packet->is_error)
+        return;
+
+    /* Multiple EDNS0 records aren't allowed per RFC6891 6.1.1, and the
+     * name must be the root. In such cases, keep the first one we found
+     * and ignore the rest. */
+    if (flags->edns0.offset || packet->buf[offset] != 0x00)
+        return;
+
+    flags->edns0.offset = offset;
+    flags->edns0.rdlength = rdlength;
+    flags->edns0.udp_payload_size = udp_payload_size;
+    flags->edns0.extended_rcode = x<<4 | flags->rcode;
+    flags->edns0.version = version;
+    flags->edns0.zero = zero & 0x7FFF;
+    flags->edns0.is_dnssec = ((zero & 0x8000) != 0);
+    flags->rcode = flags->edns0.extended_rcode;
+}
+
+static int
+_parse_flags(struct dns_t *dns, const unsigned char *buf, size_t length)
+{
+    struct streamr_t packet = {buf, 0, length, 0};
+    struct dnsflags_t *flags = &dns->flags;
+    size_t additional_index;
+    size_t i;
+
+    _parse_header(&packet, flags,
+                  &dns->query_count, &dns->answer_count,
+                  &dns->nameserver_count, &dns->additional_count);
 
-    dns->query_count = _next_uint16(&packet);
-    dns->answer_count = _next_uint16(&packet);
-    dns->nameserver_count = _next_uint16(&packet);
-    dns->additional_count = _next_uint16(&packet);
-    
     /*
      * Go down the list of resource-records looking for an EDNS0
      * option. This means we are going to walk the entire list of 
@@ -754,21 +1278,19 @@ _parse_flags(struct dns_t *dns, const unsigned char *buf, size_t length)
     
     /* If we found an EDNS0 record, parse it */
     if (flags->edns0.offset) {
-        unsigned x;
+        size_t offset = flags->edns0.offset;
+        unsigned short udp_payload_size;
         
         /* reset the offset */
-        packet.offset = flags->edns0.offset;
+        packet.offset = offset;
         _skip_name(&packet);
         _next_uint16(&packet);
         
         /* At this point, we've already validated that we can't go
          * past the end of the packet */
-        flags->edns0.udp_payload_size = _next_uint16(&packet);
-        x = _next_uint8(&packet);
-        flags->edns0.extended_rcode = x<<4 | flags->rcode;
-        flags->edns0.version = _next_uint8(&packet);
-        x = _next_uint8(&packet);
-        flags->edns0.is_dnssec = ((x & 0x80) != 0);
+        udp_payload_size = _next_uint16(&packet);
+        flags->edns0.offset = 0;
+        _parse_edns0(flags, &packet, offset, udp_payload_size);
     }
 
 
@@ -881,17 +1403,107 @@ static const struct dnstypes dnstypes[] = {
     {0,0}
 };
 
+/*
+ * Lookup tables for the `dnstypes[]` list above, holding an index
+ * (plus one, so that zero means "none") into that list. If that list
+ * changes, these tables must be regenerated. This is checked by
+ * `dns_quicktest()`.
+ *
+ * The first is indexed directly by the rrtype value, for all values
+ * below DNSTYPES_DIRECT_MAX. The rest are found by searching the end
+ * of the list.
+ */
+#define DNSTYPES_DIRECT_MAX 261
+static const unsigned char dnstypes_by_value[DNSTYPES_DIRECT_MAX] = {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+    32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+    48, 49, 50, 51, 52, 53,  0, 54, 55, 56, 57, 58, 59, 60, 61, 62,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0, 63, 64, 65, 66, 67, 68, 69, 70, 71, 72, 73,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0, 74, 75, 76, 77, 78, 79, 80,
+    81, 82, 83, 84, 85,
+};
+
+/*
+ * The second is a perfect hash of the names: the FNV-1a hash of the
+ * name, multiplied by DNSTYPES_HASH_SEED, the top DNSTYPES_HASH_BITS of
+ * which are the index. The seed was found by trying them until there
+ * were no collisions.
+ */
+#define DNSTYPES_HASH_SEED 5297
+#define DNSTYPES_HASH_BITS 9
+static const unsigned char dnstypes_by_name[1 << DNSTYPES_HASH_BITS] = {
+     0,  0,  0,  0,  0,  0,  0,  0, 41,  0, 50, 28,  0,  0,  0,  0,
+     0, 49,  9,  0,  0,  0,  0,  0,  0,  0,  0,  0, 55,  0,  0,  0,
+     0,  0,  0,  0,  0, 33,  0,  0,  0,  0, 24,  0, 73, 31,  0, 48,
+     0,  0,  0, 36,  0, 67,  7,  0,  0,  0,  0,  0, 15,  0,  0,  0,
+     0,  0,  0,  0,  0, 13,  0,  0,  0, 19, 66,  0,  0, 47, 68,  0,
+     0,  0,  0,  0,  0,  0,  0,  0, 70,  0, 32,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  2,  0, 56,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0, 69,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0, 43,  0,  0, 71,  0,  0,  0,  0,  0,  5,  0,
+     0, 82,  0,  0,  0, 64,  0,  0, 45,  0,  0,  0,  0, 65,  0, 51,
+     0,  0, 62,  0, 25, 60,  0,  0, 76,  0,  0,  0,  0, 58,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 38,
+     0,  0,  0, 37,  0, 42,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0, 83, 26,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0, 29,  6,  0,  0,  0,  0, 10,  0,  0, 40,  0, 53,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  1,  0,  0,  0,  3,  0,  0,  0,  0,
+     0,  0,  0, 87,  0,  0,  0,  0,  0,  0,  0,  0,  0, 84,  0,  0,
+     0,  0,  0,  0, 11,  0,  0,  0,  0,  0,  0, 75,  0,  0,  0,  0,
+     0,  0,  8,  0,  0,  0,  0, 77,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0, 80,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0, 85,  0,  0,  0, 18,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0, 52,  0,  0,  0,  0,  0, 30,  0,  0,
+     0,  0,  0,  0,  0,  0,  0, 46,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0, 86,  0,  0,  0,  0,  0,  0,  0,  0, 23,
+     0,  0,  0,  0, 17,  0,  0,  0,  0,  0, 74,  0,  0,  0, 34,  0,
+    35, 39,  0, 63,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0, 20,  0,  0,  0,  0,  0,  0,  0, 14,  0,
+     0,  0,  0,  0,  0,  0, 57,  0,  0, 44,  0,  0,  0,  0, 81,  4,
+     0,  0, 78,  0,  0,  0,  0,  0,  0,  0,  0, 61,  0,  0,  0,  0,
+    54, 59,  0, 72,  0,  0,  0,  0,  0, 16,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0, 79,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0, 12,  0, 22, 21, 27,  0,  0,  0,
+};
+
+/*
+ * The buffer for "TYPEnnn" names needs to be thread-local storage
+ */
+#if defined(_MSC_VER)
+#define DNS_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define DNS_THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define DNS_THREAD_LOCAL _Thread_local
+#else
+#define DNS_THREAD_LOCAL
+#endif
+
 int
 dns_rrtype_from_name(const char *name)
 {
     size_t i;
+    size_t length;
+    unsigned index;
     
     if (name == NULL)
         return -1;
+    length = strlen(name);
     
     /* The name may be of the generic form "TYPEnnn", in which case we need to parse
      * the number instead of looking up the name */
-    if (strlen(name) > 4 && (memcmp(name, "TYxPE",4) == 0 || memcmp(name, "\x54\x59\x50\x45", 4) ==0)) {
+    if (length > 4 && (memcmp(name, "TYPE",4) == 0 || memcmp(name, "\x54\x59\x50\x45", 4) ==0)) {
         int result = 0;
         for (i=4; name[i]; i++) {
             char c = name[i];
@@ -908,39 +1520,48 @@ dns_rrtype_from_name(const char *name)
         return result;
     }
 
-    /* Otherwise, assume a string that we have too lookup */
-    for (i=0; dnstypes[i].name; i++) {
-        if (strcmp(name, dnstypes[i].name) == 0)
-            return dnstypes[i].value;
-    }
+    /* Otherwise, assume a string that we have too lookup. The hash
+     * tells us the only entry it could be */
+    index = (unsigned)(((uint32_t)_fnv1a((const unsigned char *)name, length)
+                        * DNSTYPES_HASH_SEED) >> (32 - DNSTYPES_HASH_BITS));
+    index = dnstypes_by_name[index];
+    if (index && strcmp(name, dnstypes[index - 1].name) == 0)
+        return dnstypes[index - 1].value;
     
     /* Not found, so return an error */
     return -1;
 }
 
 const char *
-dns_name_from_rrtype(int value)
+dns_name_from_rrtype_r(int value, char *buf, size_t sizeof_buf)
 {
-#ifdef __gnuc__
-    /* The following variable needs to be thread-local storage */
-    __thread
-#endif
-    static unsigned char tmp[64];
     size_t i;
     
     /* If it exists in our list, return that */
-    for (i=0; dnstypes[i].name; i++) {
-        if (value == dnstypes[i].value)
-            return dnstypes[i].name;
+    if (0 <= value && value < DNSTYPES_DIRECT_MAX) {
+        if (dnstypes_by_value[value])
+            return dnstypes[dnstypes_by_value[value] - 1].name;
+    } else {
+        for (i=sizeof(dnstypes)/sizeof(dnstypes[0]) - 1; i > 0 && dnstypes[i - 1].value >= DNSTYPES_DIRECT_MAX; i--) {
+            if (value == dnstypes[i - 1].value)
+                return dnstypes[i - 1].name;
+        }
     }
 
     /* According to RFC 3597, unknown types are represented
      * with TYPEn, where n is the value */
     //snprintf(tmp, sizeof(tmp), "TYPE%d", value);
-    _memcpy_s(tmp, sizeof(tmp), "TYPE", 5);
-    _append_number(tmp, 4, sizeof(tmp), value);
+    _memcpy_s(buf, sizeof_buf, "TYPE", 5);
+    _append_number((unsigned char *)buf, 4, sizeof_buf, value);
 
-    return (const char*)tmp;
+    return buf;
+}
+
+const char *
+dns_name_from_rrtype(int value)
+{
+    static DNS_THREAD_LOCAL char tmp[64];
+    return dns_name_from_rrtype_r(value, tmp, sizeof(tmp));
 }
 
 
@@ -978,7 +1599,7 @@ _copy_bytes(struct streamr_t *src, const unsigned char **dst, size_t *dst_length
         
     tmp = _calloc(mem, 1, len + 1);
 
-    if ((*mem)->mem.is_postalloc) {
+    if ((*mem)->mem.is_postalloc && tmp) {
         _memcpy_s(tmp, len + 1, src->buf + src->offset, len);
         tmp[len] = '\0'; /* always nul-termiante in case of text */
         *dst = tmp;
@@ -992,9 +1613,10 @@ _copy_bytes(struct streamr_t *src, const unsigned char **dst, size_t *dst_length
  * Grab the next resource-record from the stream.
  */
 static int
-_parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype, struct streamr_t packet, struct streamr_t rdata)
+_parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype, struct streamr_t packet, struct streamr_t rdata, struct nametable *names)
 {
     struct dnsrrdata_t *rr = NULL;
+    const unsigned char *p;
     size_t len;
     unsigned is_copyable = (*dns)->mem.is_postalloc;
     
@@ -1018,11 +1640,11 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             * name.
             *   google.com IN NS ns2.google.com.
             */
-            _copy_domainname(&rdata, packet, &rr->ns.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->ns.name, dns, names);
             break;
 
         case DNS_T_CNAME: /* canonical name */
-            _copy_domainname(&rdata, packet, &rr->cname.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->cname.name, dns, names);
             break;
             
         case DNS_T_SOA: /* (6) Start of zone Authority */
@@ -1031,21 +1653,24 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             *   google.com    IN SOA ns1.google.com dns-admin.google.com 268869309 900 900 1800 60
             *   twitter.com. IN    SOA    ns1.p26.dynect.net. zone-admin.dyndns.com. 2007142997 3600 600 604800 60
             */
-            _copy_domainname(&rdata, packet, &rr->soa.mname, dns, 0);
-            _copy_domainname(&rdata, packet, &rr->soa.rname, dns, 0);
-            _copy_uint32(&rdata, &rr->soa.serial, is_copyable);
-            _copy_uint32(&rdata, &rr->soa.refresh, is_copyable);
-            _copy_uint32(&rdata, &rr->soa.retry, is_copyable);
-            _copy_uint32(&rdata, &rr->soa.expire, is_copyable);
-            _copy_uint32(&rdata, &rr->soa.minimum, is_copyable);
+            _copy_domainname(&rdata, packet, &rr->soa.mname, dns, names);
+            _copy_domainname(&rdata, packet, &rr->soa.rname, dns, names);
+            p = _next_fixed(&rdata, 20);
+            if (p && is_copyable) {
+                rr->soa.serial = _load_be32(p);
+                rr->soa.refresh = _load_be32(p + 4);
+                rr->soa.retry = _load_be32(p + 8);
+                rr->soa.expire = _load_be32(p + 12);
+                rr->soa.minimum = _load_be32(p + 16);
+            }
             break;
 
         case DNS_T_MB: /* mailbox */
-            _copy_domainname(&rdata, packet, &rr->mb.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->mb.name, dns, names);
             break;
             
         case DNS_T_MR: /* mail rename */
-            _copy_domainname(&rdata, packet, &rr->mr.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->mr.name, dns, names);
             break;
 
         case DNS_T_WKS: /* (11) well-known service */
@@ -1056,7 +1681,7 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             break;
 
         case DNS_T_PTR: /* pointer (reverse lookup) */
-            _copy_domainname(&rdata, packet, &rr->ptr.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->ptr.name, dns, names);
             break;
 
         case DNS_T_HINFO: /* host info */
@@ -1065,8 +1690,8 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             break;
             
         case DNS_T_MINFO: /* MINFO (14) - mailbox info - rfc1035 */
-            _copy_domainname(&rdata, packet, &rr->minfo.rmailbx, dns, 0);
-            _copy_domainname(&rdata, packet, &rr->minfo.emailbx, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->minfo.rmailbx, dns, names);
+            _copy_domainname(&rdata, packet, &rr->minfo.emailbx, dns, names);
             break;
 
         case DNS_T_MX: /* mail exchnage*/
@@ -1078,7 +1703,7 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
              *  gmail.com.        2625    IN    MX    10 alt1.gmail-smtp-in.l.google.com.
              *  gmail.com.        2625    IN    MX    20 alt2.gmail-smtp-in.l.google.com.*/
             _copy_uint16(&rdata, &rr->mx.priority, is_copyable);
-            _copy_domainname(&rdata, packet, &rr->mx.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->mx.name, dns, names);
             break;
             
         case DNS_T_SPF: /* SPF - same as text */
@@ -1121,7 +1746,7 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
                 _next_memcpy(&rdata, tmp, len+1, len, is_copyable);
                 
                 /* If second pass, actually set the values */
-                if (is_copyable) {
+                if (is_copyable && array) {
                     array[j].buf = tmp;
                     array[j].length = len;
                 }
@@ -1136,13 +1761,13 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             break;
 
         case DNS_T_RP: /* Responsible Person */
-            _copy_domainname(&rdata, packet, &rr->rp.mbox_dname, dns, 0);
-            _copy_domainname(&rdata, packet, &rr->rp.txt_dname, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->rp.mbox_dname, dns, names);
+            _copy_domainname(&rdata, packet, &rr->rp.txt_dname, dns, names);
             break;
 
         case DNS_T_AFSDB: /* AFS */
             _copy_uint16(&rdata, &rr->afsdb.subtype, is_copyable);
-            _copy_domainname(&rdata, packet, &rr->afsdb.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->afsdb.name, dns, names);
             break;
 
             
@@ -1230,7 +1855,7 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             break;
 
         case DNS_T_NXT: /* NXT (30) - rfc2065 */
-            _copy_domainname(&rdata, packet, &rr->nxt.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->nxt.name, dns, names);
             len = rdata.length - rdata.offset; /* all remaining bytes in rdata field */
             _copy_bytes(&rdata, &rr->nxt.bitmap, &rr->nxt.length, len, dns);
 
@@ -1240,7 +1865,7 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             _copy_uint16(&rdata, &rr->srv.priority, is_copyable);
             _copy_uint16(&rdata, &rr->srv.weight, is_copyable);
             _copy_uint16(&rdata, &rr->srv.port, is_copyable);
-            _copy_domainname(&rdata, packet, &rr->srv.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->srv.name, dns, names);
             break;
 
         case DNS_T_NAPTR: /* Naming Authority Pointer for SIP[RFC 2915]  */
@@ -1249,11 +1874,11 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             _next_charstring(&rdata, &rr->naptr.flags.buf, &rr->naptr.flags.length, dns);
             _next_charstring(&rdata, &rr->naptr.service.buf, &rr->naptr.service.length, dns);
             _next_charstring(&rdata, &rr->naptr.regexp.buf, &rr->naptr.regexp.length, dns);
-            _copy_domainname(&rdata, packet, &rr->naptr.replacement, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->naptr.replacement, dns, names);
             break;
         
         case DNS_T_DNAME: /* DNAME (39) - canonical name for entire domain - rfc6672 */
-            _copy_domainname(&rdata, packet, &rr->dname.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->dname.name, dns, names);
             break;
             
         case DNS_T_DS: /* 43 */
@@ -1273,14 +1898,17 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             break;
                 
         case DNS_T_RRSIG: /* Resource Record Signature for DNSSEC */
-            _copy_uint16(&rdata, &rr->rrsig.type, is_copyable);
-            _copy_uint8(&rdata, &rr->rrsig.algorithm , is_copyable);
-            _copy_uint8(&rdata, &rr->rrsig.labels, is_copyable);
-            _copy_uint32(&rdata, &rr->rrsig.ttl, is_copyable);
-            _copy_uint32(&rdata, &rr->rrsig.expiration, is_copyable);
-            _copy_uint32(&rdata, &rr->rrsig.inception, is_copyable);
-            _copy_uint16(&rdata, &rr->rrsig.keytag, is_copyable);
-            _copy_domainname(&rdata, packet, &rr->rrsig.name, dns, 0);
+            p = _next_fixed(&rdata, 18);
+            if (p && is_copyable) {
+                rr->rrsig.type = _load_be16(p);
+                rr->rrsig.algorithm = p[2];
+                rr->rrsig.labels = p[3];
+                rr->rrsig.ttl = _load_be32(p + 4);
+                rr->rrsig.expiration = _load_be32(p + 8);
+                rr->rrsig.inception = _load_be32(p + 12);
+                rr->rrsig.keytag = _load_be16(p + 16);
+            }
+            _copy_domainname(&rdata, packet, &rr->rrsig.name, dns, names);
             len = rdata.length - rdata.offset; /* all remaining bytes in rdata field */
             _copy_bytes(&rdata, &rr->rrsig.sig, &rr->rrsig.length, len, dns);
             break;
@@ -1291,7 +1919,7 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             size_t types_count = 0;
             unsigned short *tmp;
             
-            _copy_domainname(&rdata, packet, &rr->nsec.name, dns, 0);
+            _copy_domainname(&rdata, packet, &rr->nsec.name, dns, names);
             
             while (rdata.offset < rdata.length) {
                 unsigned char window = _next_uint8(&rdata);
@@ -1314,7 +1942,7 @@ _parse_resource_record(struct dns_t **dns, size_t rindex, unsigned short rtype,
             
             tmp = _calloc(dns, sizeof(*tmp), types_count);
 
-            if (is_copyable) {
+            if (is_copyable && tmp) {
                 size_t j;
                 rr->nsec.types_count = types_count;
                 for (j=0; j<types_count; j++)
@@ -1390,6 +2018,91 @@ _default_realloc(void *p, size_t newsize, void *arena)
 
 
 
+/**
+ * Parses the resource-record at the current position in the packet,
+ * storing it in `(*dns)->queries[rindex]`, and advances the
+ * packet past it.
+ * @param flags
+ *      Where the EDNS0 fields are stored, if the record is an
+ *      OPT record and `is_singlepass` is set.
+ * @return
+ *      0 on success, or an error code like DNS_input_bad on failure.
+ */
+static int
+_parse_record(struct dns_t **dns, struct dnsflags_t *flags, struct streamr_t *packet,
+              size_t rindex, int section, unsigned is_singlepass,
+              struct nametable *names)
+{
+    unsigned short rtype;
+    unsigned short rclass;
+    unsigned ttl = 0;
+    int err;
+    dnsrrdata_t *rr = &(*dns)->queries[rindex];
+    size_t name_offset = packet->offset;
+    const unsigned char *p;
+
+    /* First, get the name. This may be either the full name, or a compressed name.
+     * Either way, we fully extract it and validate it. */
+    err = _copy_domainname(packet, *packet, &rr->name, dns, names);
+    if (err)
+        return err;
+
+    /* Get the resource-record header */
+    p = _next_fixed(packet, 4);
+    rtype = p ? _load_be16(p) : 0;
+    rclass = p ? _load_be16(p + 2) : 0;
+     
+    /* If not a short query-record, parse the contents of the
+     * longer answer-records in the rest of the sections. */
+    if (is_singlepass && section == DNS_additional && rtype == 41) {
+        /* There was no pass#0 to look ahead for the EDNS0 record,
+         * so parse it now that we've reached it */
+        _parse_edns0(flags, packet, name_offset, rclass);
+        if (packet->is_error)
+            return packet->is_error;
+    } else if (section != DNS_query && rtype != 41) {
+        struct streamr_t rdata = {0};
+        unsigned rdlength;
+        
+        /* Get the rest of the resource-record header */
+        p = _next_fixed(packet, 6);
+        ttl = p ? _load_be32(p) : 0;
+        rdlength = p ? _load_be16(p + 4) : 0;
+
+        /* Only support Internet class, unless it's the EDNS0 field */
+        if (rclass != 1 && rtype != 41) {
+            if (err) {
+                return DNS_input_bad;
+            }
+        }
+
+        /* create a 'slice' of the packet data */
+        rdata.length = rdlength;
+        rdata.buf = packet->buf + packet->offset;
+        rdata.offset = 0;
+        
+        /* Parse the individual record */
+        err = _parse_resource_record(dns, rindex, rtype, *packet, rdata, names);
+        if (err)
+            return err;
+
+        /* Skip the rdata field */
+        _next_skip(packet, rdata.length);
+        
+        if (packet->is_error)
+            return packet->is_error;
+    }
+
+    if ((*dns)->mem.is_postalloc) {
+
+        rr->section = section;
+        rr->rtype = rtype;
+        rr->rclass = rclass;
+        rr->ttl = ttl;
+    }
+    return 0;
+}
+
 static void
 _parse_records(struct dns_t **dns, const unsigned char *buf, size_t length, unsigned options)
 {
@@ -1401,23 +2114,29 @@ _parse_records(struct dns_t **dns, const unsigned char *buf, size_t length, unsi
     size_t additional_count;
     size_t total_record_count;
     struct dnsrrdata_t *records;
-    struct domainname_cache namecache;
-    
-    /* Cache some names we extract from the packet */
-    _cache_init(&namecache);
-
-    /* FIXME: I don't use this parameter yet, but I will */
-    (void)options;
-    
-    /* skip xid and flags field, as those were parsed in pass#0 */
-    (*dns)->flags.xid = _next_uint16(&packet);
-    _next_uint16(&packet);
-    
-    /* grab the number of records in each section */
-    query_count = _next_uint16(&packet);
-    answer_count = _next_uint16(&packet);
-    nameserver_count = _next_uint16(&packet);
-    additional_count = _next_uint16(&packet);
+    struct nametable names;
+    unsigned is_singlepass = ((options & DNS_F_SINGLEPASS) != 0);
+    
+    /* Remember the names we extract from the packet */
+    _nametable_init(&names);
+
+    if (is_singlepass) {
+        /* There was no pass#0 in single-pass mode, so parse the
+         * header here */
+        _parse_header(&packet, &(*dns)->flags,
+                      &query_count, &answer_count,
+                      &nameserver_count, &additional_count);
+    } else {
+        /* skip xid and flags field, as those were parsed in pass#0 */
+        (*dns)->flags.xid = _next_uint16(&packet);
+        _next_uint16(&packet);
+        
+        /* grab the number of records in each section */
+        query_count = _next_uint16(&packet);
+        answer_count = _next_uint16(&packet);
+        nameserver_count = _next_uint16(&packet);
+        additional_count = _next_uint16(&packet);
+    }
     total_record_count = query_count + answer_count + nameserver_count + additional_count;
     
     if (packet.is_error) {
@@ -1428,6 +2147,8 @@ _parse_records(struct dns_t **dns, const unsigned char *buf, size_t length, unsi
     /* Allocate all the records as a single array, then subdivide
      * that array for each section. */
     records =_calloc(dns, total_record_count, sizeof(records[0]));
+    if (records == NULL)
+        return;
     if ((*dns)->mem.is_postalloc) {
         (*dns)->query_count = query_count;
         (*dns)->queries = &records[0];
@@ -1452,12 +2173,8 @@ _parse_records(struct dns_t **dns, const unsigned char *buf, size_t length, unsi
     /* for all records in the packet ... */
     for (i=0; i<total_record_count; i++) {
         int section;
-        unsigned short rtype;
-        unsigned short rclass;
-        unsigned ttl = 0;
         int err;
-        dnsrrdata_t *rr = &(*dns)->queries[i];
-        
+
         /* Remember the index for the resource-record in case of error */
         (*dns)->error_index = (unsigned)i;
 
@@ -1471,64 +2188,11 @@ _parse_records(struct dns_t **dns, const unsigned char *buf, size_t length, unsi
         else
             section = DNS_additional;
 
-        /* First, get the name. This may be either the full name, or a compressed name.
-         * Either way, we fully extract it and validate it. */
-        err = _copy_domainname(&packet, packet, &rr->name, dns, &namecache);
+        err = _parse_record(dns, &(*dns)->flags, &packet, i, section, is_singlepass, &names);
         if (err) {
             (*dns)->error_code = err;
             return;
         }
-
-        /* Get the resource-record header */
-        rtype = _next_uint16(&packet);
-        rclass = _next_uint16(&packet);
-         
-        /* If not a short query-record, parse the contents of the
-         * longer answer-records in the rest of the sections. */
-        if (section != DNS_query && rtype != 41) {
-            struct streamr_t rdata = {0};
-            unsigned rdlength;
-            
-            /* Get the rest of the resource-record header */
-            ttl = _next_uint32(&packet);
-            rdlength = _next_uint16(&packet);
-
-            /* Only support Internet class, unless it's the EDNS0 field */
-            if (rclass != 1 && rtype != 41) {
-                if (err) {
-                    (*dns)->error_code = DNS_input_bad;
-                    return;
-                }
-            }
-
-            /* create a 'slice' of the packet data */
-            rdata.length = rdlength;
-            rdata.buf = packet.buf + packet.offset;
-            rdata.offset = 0;
-            
-            /* Parse the individual record */
-            err = _parse_resource_record(dns, i, rtype, packet, rdata);
-            if (err) {
-                (*dns)->error_code = err;
-                return;
-            }
-
-            /* Skip the rdata field */
-            _next_skip(&packet, rdata.length);
-            
-            if (packet.is_error) {
-                (*dns)->error_code = packet.is_error;
-                return;
-            }
-        }
-
-        if ((*dns)->mem.is_postalloc) {
-
-            rr->section = section;
-            rr->rtype = rtype;
-            rr->rclass = rclass;
-            rr->ttl = ttl;
-        }
     }
 }
 
@@ -1560,6 +2224,81 @@ dns_parse_allocator(void *(*myrealloc)(void*,size_t,void*), void *arena, size_t
     return result;
 }
 
+/**
+ * Calculates the worst-case amount of memory that parsing this packet
+ * could possibly need, so that single-pass mode can allocate it all up
+ * front instead of doing a sizing pass. Every allocation in the parser
+ * is rounded up to 16 bytes, and each is bounded by what it consumes:
+ *  - a name is at most 256 bytes, but through compression may consume
+ *    only 2 bytes of the packet, or 128 bytes per byte consumed
+ *  - TXT strings are at most 32 bytes per byte consumed (the array
+ *    entry plus a zero-length string)
+ *  - everything else (strings, blobs, NSEC types) is less than this,
+ *    plus some rounding overhead per record
+ * Every record consumes at least 5 bytes (a root name plus the type and
+ * class), which bounds the number of records.
+ * @return
+ *      the number of bytes, or 0 if the header claims more records than
+ *      could possibly fit in the packet.
+ */
+static size_t
+_parse_singlepass_bound(const unsigned char *buf, size_t length)
+{
+    struct streamr_t packet = {buf, 0, length, 0};
+    size_t record_count = 0;
+    size_t sizeof_rr = (sizeof(struct dnsrrdata_t) + 15) & ~(size_t)15;
+    size_t i;
+
+    if (length < 12)
+        return sizeof(struct dns_t);
+
+    _next_skip(&packet, 4);
+    for (i=0; i<4; i++)
+        record_count += _next_uint16(&packet);
+    if (record_count > (length - 12) / 5)
+        return 0;
+
+    return sizeof(struct dns_t)
+            + record_count * (sizeof_rr + 256 + 512)
+            + length * 128;
+}
+
+/**
+ * Parses the packet with DNS_F_SINGLEPASS. Rather than the three
+ * passes of dns_parse() below, we allocate the worst-case amount of
+ * memory, then parse the packet once.
+ */
+static struct dns_t *
+_parse_singlepass(const unsigned char *buf, size_t length, unsigned options, struct dns_t *recycled, size_t max_size)
+{
+    struct dns_t *result;
+
+    /* Allocate (or reuse) the memory. Unlike the two-pass mode, we remember
+     * the real size of recycled memory rather than the amount this packet
+     * needs, because we need a larger amount here */
+    if (recycled && recycled->_max_size >= max_size) {
+        result = recycled;
+        max_size = recycled->_max_size;
+    } else if (recycled) {
+        result = recycled->mem.myrealloc(recycled, max_size, recycled->mem.arena);
+    } else
+        result = dns_parse_allocator(0, 0, max_size - sizeof(*result));
+    if (result == NULL)
+        return NULL;
+
+    result->_current_size = sizeof(*result);
+    result->_max_size = max_size;
+    result->error_code = 0;
+    result->error_index = 0;
+    result->mem.is_prealloc = 0;
+    result->mem.is_postalloc = 1;
+
+    /* The one and only pass */
+    _parse_records(&result, buf, length, options);
+
+    return result;
+}
+
 struct dns_t *
 dns_parse(const unsigned char *buf, size_t length, unsigned options, struct dns_t *recycled)
 {
@@ -1567,12 +2306,24 @@ dns_parse(const unsigned char *buf, size_t length, unsigned options, struct dns_
     struct dns_t *pass1 = &tmp0;
     struct dns_t *result = 0;
     
+    /* If the caller wants single-pass mode, then do that. If the packet
+     * claims more records than can fit, we can't bound the memory, so
+     * fall back to the normal mode, which will report the error */
+    if (options & DNS_F_SINGLEPASS) {
+        size_t max_size = _parse_singlepass_bound(buf, length);
+        if (max_size)
+            return _parse_singlepass(buf, length, options, recycled, max_size);
+        options &= ~DNS_F_SINGLEPASS;
+    }
+
 
     /* PASS#0
      * Parse the header, and look for an EDNS0 record near the end
      * of the packet, which may inform us how we should handle
      * resource-record content on subsequent passes. */
     _parse_flags(pass1, buf, length);
+    if (recycled)
+        pass1->mem.intern = recycled->mem.intern;
     
     /* PASS#1
      * Parse all the resource-records to discover the amount of memory
@@ -1612,6 +2363,13 @@ dns_parse(const unsigned char *buf, size_t length, unsigned options, struct dns_
     return result;
 }
 
+void
+dns_parse_intern(struct dns_t *dns, struct dnsintern_t *pool)
+{
+    if (dns)
+        dns->mem.intern = pool;
+}
+
 void
 dns_parse_free(struct dns_t *dns)
 {
@@ -1624,6 +2382,425 @@ dns_parse_free(struct dns_t *dns)
 }
 
 
+/**
+ * Rounds a size up to the alignment of memory in the batch
+ */
+static size_t
+_batch_align(size_t size)
+{
+    return (size + 15) & ~(size_t)15;
+}
+
+/**
+ * Finds the exact amount of memory needed for the results of these
+ * packets, using the same sizing pass as PASS#1 of dns_parse().
+ */
+static size_t
+_batch_size(const unsigned char *const bufs[], const size_t lengths[], size_t count)
+{
+    size_t total = 0;
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        struct dns_t tmp1 = {0};
+        struct dns_t *pass1 = &tmp1;
+
+        /* If the packet claims more records than could possibly fit, don't
+         * allocate memory for them, it'll fail anyway */
+        if (_parse_singlepass_bound(bufs[i], lengths[i]) == 0) {
+            total += _batch_align(sizeof(tmp1));
+            continue;
+        }
+
+        pass1->mem.is_prealloc = 1;
+        pass1->_current_size = sizeof(*pass1);
+        pass1->_max_size = sizeof(*pass1);
+        _parse_records(&pass1, bufs[i], lengths[i], DNS_F_SINGLEPASS);
+        total += _batch_align(pass1->_max_size);
+    }
+    return total;
+}
+
+struct dnsbatch_t *
+dns_parse_batch(const unsigned char *const bufs[], const size_t lengths[], size_t count,
+                unsigned flags, struct dnsbatch_t *recycled)
+{
+    struct dnsbatch_t *batch = recycled;
+    size_t header_size;
+    size_t total;
+    size_t offset;
+    size_t i;
+
+    header_size = _batch_align(sizeof(*batch)) + _batch_align(count * sizeof(batch->results[0]));
+
+    /* If there's no recycled memory, find out how much we need. In
+     * single-pass mode, there's no sizing pass, so just guess, and grow
+     * it below if the guess was too small */
+    if (batch == NULL) {
+        total = header_size;
+        if (flags & DNS_F_SINGLEPASS) {
+            for (i=0; i<count; i++)
+                total += _batch_align(sizeof(struct dns_t)) + lengths[i] * 8;
+        } else
+            total += _batch_size(bufs, lengths, count);
+    } else if (batch->_max_size < header_size)
+        total = header_size;
+    else
+        total = batch->_max_size;
+
+again:
+    if (batch == NULL || batch->_max_size < total) {
+        struct dnsbatch_t *tmp = realloc(batch, total);
+        if (tmp == NULL) {
+            free(batch);
+            return NULL;
+        }
+        batch = tmp;
+    }
+    batch->count = count;
+    batch->results = (struct dns_t **)((char *)batch + _batch_align(sizeof(*batch)));
+    batch->_max_size = total;
+    offset = header_size;
+
+    /* Parse each packet in a single pass into the memory after the one
+     * before it, the same as the scratch memory of dns_iter_next(). Once
+     * recycled memory has grown large enough, this is the only pass. */
+    for (i=0; i<count; i++) {
+        struct dns_t *dns = (struct dns_t *)((char *)batch + offset);
+
+        if (offset + sizeof(*dns) > total)
+            break;
+        memset(dns, 0, sizeof(*dns));
+        dns->_current_size = sizeof(*dns);
+        dns->_max_size = total - offset;
+        dns->mem.is_postalloc = 1;
+        dns->mem.is_scratch = 1;
+        batch->results[i] = dns;
+
+        if (_parse_singlepass_bound(bufs[i], lengths[i]) == 0) {
+            dns->error_code = DNS_input_overflow;
+            dns->error_index = ~0;
+        } else
+            _parse_records(&dns, bufs[i], lengths[i], flags | DNS_F_SINGLEPASS);
+        if (dns->error_code == DNS_out_of_memory)
+            break;
+
+        dns->mem.is_scratch = 0;
+        dns->_max_size = dns->_current_size;
+        offset += _batch_align(dns->_current_size);
+    }
+
+    /* If we ran out of memory, grow it and start over, since growing it
+     * may have moved the results we've already parsed. Without
+     * DNS_F_SINGLEPASS, this finds the exact amount needed for the rest of
+     * the packets, the same as two-pass dns_parse() would. With it, we
+     * avoid that extra pass by doubling the memory instead. */
+    if (i < count) {
+        size_t needed = total * 2;
+        if ((flags & DNS_F_SINGLEPASS) == 0)
+            needed = offset + _batch_size(bufs + i, lengths + i, count - i);
+        if (needed <= total)
+            needed = total * 2;
+        total = needed;
+        goto again;
+    }
+    batch->_current_size = offset;
+
+    return batch;
+}
+
+void
+dns_parse_batch_free(struct dnsbatch_t *batch)
+{
+    free(batch);
+}
+
+struct dnsview_t *
+dns_view(const unsigned char *buf, size_t length, struct dnsview_t *recycled)
+{
+    struct streamr_t packet = {buf, 0, length, 0};
+    struct dnsview_t hdr = {0};
+    struct dnsview_t *view;
+    size_t total_record_count;
+    size_t i;
+
+    /* Parse the header to find out how many records we have */
+    _parse_header(&packet, &hdr.flags,
+                  &hdr.query_count, &hdr.answer_count,
+                  &hdr.nameserver_count, &hdr.additional_count);
+    total_record_count = hdr.query_count + hdr.answer_count
+                        + hdr.nameserver_count + hdr.additional_count;
+
+    /* Every record consumes at least 5 bytes, so if the header claims
+     * more than will fit, don't bother allocating memory for them */
+    if (packet.is_error) {
+        hdr.error_code = packet.is_error;
+        total_record_count = 0;
+    } else if (total_record_count > (length - 12) / 5) {
+        hdr.error_code = DNS_input_overflow;
+        hdr.error_index = (unsigned)((length - 12) / 5);
+        total_record_count = 0;
+    }
+
+    /* Allocate the memory, or reuse the recycled memory if big enough */
+    if (recycled && recycled->_max_records >= total_record_count) {
+        view = recycled;
+        hdr._max_records = recycled->_max_records;
+    } else {
+        view = realloc(recycled, sizeof(*view) + total_record_count * sizeof(view->queries[0]));
+        if (view == NULL) {
+            free(recycled);
+            return NULL;
+        }
+        hdr._max_records = total_record_count;
+    }
+    hdr.buf = buf;
+    hdr.length = length;
+    hdr.queries = (dnsrrview_t *)(view + 1);
+    hdr.answers = hdr.queries + hdr.query_count;
+    hdr.nameservers = hdr.answers + hdr.answer_count;
+    hdr.additional = hdr.nameservers + hdr.nameserver_count;
+    if (hdr.error_code) {
+        hdr.query_count = 0;
+        hdr.answer_count = 0;
+        hdr.nameserver_count = 0;
+        hdr.additional_count = 0;
+    }
+    *view = hdr;
+
+    /* Now walk the records, remembering where they are, but not
+     * decoding them */
+    for (i=0; i<total_record_count; i++) {
+        dnsrrview_t *rr = &view->queries[i];
+
+        view->error_index = (unsigned)i;
+
+        if (i < view->query_count)
+            rr->section = DNS_query;
+        else if (i < view->query_count + view->answer_count)
+            rr->section = DNS_answer;
+        else if (i < view->query_count + view->answer_count + view->nameserver_count)
+            rr->section = DNS_nameserver;
+        else
+            rr->section = DNS_additional;
+
+        rr->name_offset = packet.offset;
+        _skip_name(&packet);
+        rr->rtype = _next_uint16(&packet);
+        rr->rclass = _next_uint16(&packet);
+        rr->ttl = 0;
+        rr->rdoffset = 0;
+        rr->rdlength = 0;
+
+        if (rr->section != DNS_query) {
+            if (rr->section == DNS_additional && rr->rtype == 41) {
+                _parse_edns0(&view->flags, &packet, rr->name_offset, rr->rclass);
+            } else {
+                rr->ttl = _next_uint32(&packet);
+                rr->rdlength = _next_uint16(&packet);
+                rr->rdoffset = packet.offset;
+                _next_skip(&packet, rr->rdlength);
+            }
+        }
+
+        if (packet.is_error) {
+            view->error_code = packet.is_error;
+            return view;
+        }
+    }
+
+    return view;
+}
+
+size_t
+dns_view_name(const struct dnsview_t *view, size_t offset, char *dst, size_t dst_length)
+{
+    struct streamr_t packet = {view->buf, 0, view->length, 0};
+    struct streamr_t src = {view->buf, offset, view->length, 0};
+
+    if (dst == NULL || dst_length == 0)
+        return 0;
+    if (offset >= view->length) {
+        dst[0] = '\0';
+        return 0;
+    }
+
+    return _next_domainname(&src, packet, (unsigned char *)dst, dst_length);
+}
+
+void
+dns_view_free(struct dnsview_t *view)
+{
+    free(view);
+}
+
+/* The scratch memory only holds a table of names if there's also room
+ * for a few records besides */
+#define DNS_ITER_MIN_RECORD 4096
+
+/**
+ * Empties the scratch memory, which is laid out as a `dns_t` set up for
+ * the postalloc pass, followed by the table of names (if there's room for
+ * one), followed by the names and other data of the records. The names
+ * decoded by earlier records stay in the scratch memory until it fills
+ * up, so that later records can share them the same as in single-pass
+ * mode, instead of decompressing them again.
+ */
+static void
+_iter_reset(struct dnsiter_t *iter)
+{
+    struct dns_t *dns = (struct dns_t *)iter->_scratch;
+    size_t offset = sizeof(*dns);
+
+    memset(dns, 0, sizeof(*dns));
+    iter->_names = NULL;
+    if (offset + sizeof(struct nametable) + DNS_ITER_MIN_RECORD <= iter->_scratch_size) {
+        iter->_names = (struct nametable *)(iter->_scratch + offset);
+        _nametable_init(iter->_names);
+        offset += (sizeof(struct nametable) + 15) & ~(size_t)15;
+    }
+    dns->_current_size = offset;
+    dns->_max_size = iter->_scratch_size;
+    dns->mem.is_postalloc = 1;
+    dns->mem.is_scratch = 1;
+}
+
+int
+dns_iter_begin(struct dnsiter_t *iter, const unsigned char *buf, size_t length, void *scratch, size_t scratch_size)
+{
+    struct streamr_t packet = {buf, 0, length, 0};
+    size_t pad;
+
+    memset(iter, 0, sizeof(*iter));
+    iter->buf = buf;
+    iter->length = length;
+
+    /* Align the scratch memory, since we put a `dns_t` at the start */
+    pad = (16 - ((uintptr_t)scratch & 15)) & 15;
+    if (scratch == NULL || scratch_size < pad + sizeof(struct dns_t)) {
+        iter->_scratch = NULL;
+        iter->_scratch_size = 0;
+    } else {
+        iter->_scratch = (unsigned char *)scratch + pad;
+        iter->_scratch_size = scratch_size - pad;
+        _iter_reset(iter);
+    }
+
+    /* There's no PASS#0 looking ahead for the EDNS0 record, the same as
+     * single-pass mode of dns_parse(), so only the header is parsed here.
+     * The EDNS0 fields are filled in when the OPT record is reached. */
+    _parse_header(&packet, &iter->flags,
+                  &iter->query_count, &iter->answer_count,
+                  &iter->nameserver_count, &iter->additional_count);
+    iter->_offset = 12;
+    if (packet.is_error) {
+        iter->error_code = packet.is_error;
+        iter->error_index = ~0;
+    }
+    return iter->error_code;
+}
+
+const struct dnsrrdata_t *
+dns_iter_next(struct dnsiter_t *iter)
+{
+    struct streamr_t packet = {iter->buf, iter->_offset, iter->length, 0};
+    struct dns_t *dns = (struct dns_t *)iter->_scratch;
+    size_t index = iter->_index;
+    unsigned is_retry;
+    int section;
+    int err;
+
+    if (iter->_index >= iter->query_count + iter->answer_count
+                        + iter->nameserver_count + iter->additional_count)
+        return NULL;
+    if (iter->error_code)
+        return NULL;
+
+    /* Figure out which section we are in */
+    if (index < iter->query_count)
+        section = DNS_query;
+    else if (index < iter->query_count + iter->answer_count)
+        section = DNS_answer;
+    else if (index < iter->query_count + iter->answer_count + iter->nameserver_count)
+        section = DNS_nameserver;
+    else
+        section = DNS_additional;
+
+    if (dns == NULL) {
+        iter->error_code = DNS_out_of_memory;
+        iter->error_index = (unsigned)index;
+        return NULL;
+    }
+
+    /* Decode the record as if it were the only record of the `dns_t`
+     * at the start of the scratch memory. Rather than calculating ahead
+     * of time whether it'll fit, just try. If it doesn't, then start
+     * over with empty scratch memory, forgetting the names of the
+     * previous records. */
+    for (is_retry = 0; ; is_retry = 1) {
+        dns->queries = &iter->rr;
+        err = _parse_record(&dns, &iter->flags, &packet, 0, section, 1, iter->_names);
+        if (dns->error_code != DNS_out_of_memory)
+            break;
+        err = DNS_out_of_memory;
+        if (is_retry)
+            break;
+        _iter_reset(iter);
+        packet.offset = iter->_offset;
+        packet.is_error = 0;
+    }
+    if (err) {
+        iter->error_code = err;
+        iter->error_index = (unsigned)index;
+        return NULL;
+    }
+
+    iter->_offset = packet.offset;
+    iter->_index++;
+    return &iter->rr;
+}
+
+int
+dns_parse_header(const unsigned char *buf, size_t length, struct dnsheader_t *hdr)
+{
+    struct dns_t tmp0 = {0};
+    struct streamr_t packet = {buf, 12, length, 0};
+    const unsigned char *p;
+
+    memset(hdr, 0, sizeof(*hdr));
+
+    /* The same first pass as dns_parse(), which walks the records only
+     * far enough to find the EDNS0 record */
+    hdr->error_code = _parse_flags(&tmp0, buf, length);
+    _memcpy_s(&hdr->flags, sizeof(hdr->flags), &tmp0.flags, sizeof(tmp0.flags));
+    hdr->query_count = tmp0.query_count;
+    hdr->answer_count = tmp0.answer_count;
+    hdr->nameserver_count = tmp0.nameserver_count;
+    hdr->additional_count = tmp0.additional_count;
+    if (length < 12) {
+        hdr->error_code = DNS_input_overflow;
+        return hdr->error_code;
+    }
+
+    /* Decode the first query. This is done even if a later record was
+     * bad, since for triage the question is still useful. */
+    if (hdr->query_count == 0)
+        return hdr->error_code;
+    hdr->qname_length = _next_domainname(&packet, packet, (unsigned char *)hdr->qname, sizeof(hdr->qname));
+    p = _next_fixed(&packet, 4);
+    if (p == NULL || hdr->qname_length == 0) {
+        hdr->qname[0] = '\0';
+        hdr->qname_length = 0;
+        if (hdr->error_code == 0)
+            hdr->error_code = packet.is_error?packet.is_error:DNS_input_bad;
+        return hdr->error_code;
+    }
+    hdr->qtype = _load_be16(p + 0);
+    hdr->qclass = _load_be16(p + 2);
+
+    return hdr->error_code;
+}
+
 int dns_quicktest(void)
 {
     static const unsigned char packet00[] =
@@ -1660,6 +2837,21 @@ int dns_quicktest(void)
         return 1;
     if (strcmp(dns_name_from_rrtype(1), "A") != 0)
         return 1;
+    if (strcmp(dns_name_from_rrtype(32769), "DLV") != 0)
+        return 1;
+    if (dns_rrtype_from_name("TYPE99") != 99)
+        return 1;
+
+    /* Make sure the lookup tables match the list of names */
+    {
+        size_t i;
+        for (i=0; dnstypes[i].name; i++) {
+            if (dns_rrtype_from_name(dnstypes[i].name) != dnstypes[i].value)
+                return 1;
+            if (dns_name_from_rrtype(dnstypes[i].value) != dnstypes[i].name)
+                return 1;
+        }
+    }
 
     
     
@@ -511,8 +511,16 @@ typedef struct dns_t {
     struct {
         unsigned is_prealloc:1;
         unsigned is_postalloc:1;
+
+        /* Set for the scratch memory of `dns_iter_next()`, where running
+         * out of memory is expected, and only sets `error_code` */
+        unsigned is_scratch:1;
         void *arena;
         void *(*myrealloc)(void*,size_t,void*);
+
+        /* If set, names are stored in this pool instead, see
+         * `dns_parse_intern()` */
+        struct dnsintern_t *intern;
     } mem;
     
     /* If an error happens, then this contains the error code,
@@ -547,6 +555,20 @@ typedef struct dns_t {
     dnsrrdata_t *additional;
 } dns_t;
 
+/**
+ * Option flags passed to `dns_parse()`.
+ */
+enum {
+    /* Parse the packet in a single pass. Instead of first walking the
+     * packet to calculate how much memory is needed, then walking it
+     * again to copy the data, this allocates the worst-case amount of
+     * memory that the packet could possibly need, and decodes every
+     * byte exactly once. This uses more (mostly untouched) memory, so
+     * it works best when the result is recycled from one call to the
+     * next. */
+    DNS_F_SINGLEPASS = 0x0001,
+};
+
 /**
  * Parses a DNS response packet and returns an array of decoded records.
  * Callers will be particularly interested in the `answers`.
@@ -560,7 +582,7 @@ typedef struct dns_t {
  * @param length
  *     The number of bytes in the buffer pointed to by `buf`.
  * @param flags
- *      Flags of the form DNS_F_xxxx
+ *      Flags of the form DNS_F_xxxx, such as DNS_F_SINGLEPASS.
  * @param recycled
  *     A previous result from this function, allowing the memory to be reused
  *     for the new request, for efficiency, to avoid expensive allocations.
@@ -578,6 +600,102 @@ dns_parse(const unsigned char *buf, size_t length, unsigned flags, struct dns_t
 struct dns_t *
 dns_parse_allocator(void *(*myrealloc)(void*,size_t,void*arena), void *arena, size_t padding);
 
+/**
+ * Creates a pool of names that can be shared by many calls to `dns_parse()`,
+ * so that the same names, like "com." or "gtld-servers.net.", are
+ * stored only once no matter how many results refer to them. Names from
+ * the pool can be compared by pointer. The pool isn't thread-safe, and
+ * must outlive every result that uses it.
+ * @param max_bytes
+ *      The most memory the strings in the pool may use, or 0 for no limit.
+ *      Once the limit is reached, new names are stored in the `dns_t`
+ *      as if there were no pool.
+ * @return
+ *      The pool, to be freed with `dns_intern_destroy()`, or NULL
+ *      on out-of-memory.
+ */
+struct dnsintern_t *
+dns_intern_create(size_t max_bytes);
+
+/**
+ * Frees the pool of names. Any results that used it can no longer be used.
+ */
+void
+dns_intern_destroy(struct dnsintern_t *pool);
+
+/**
+ * Looks up (or adds) a name in the pool, such as "www.example.com.", in
+ * order to compare it by pointer with names in the results.
+ * @return
+ *      The pool's copy of the name, or NULL if the pool is full.
+ */
+const unsigned char *
+dns_intern(struct dnsintern_t *pool, const char *name);
+
+/**
+ * Reports how many names are in the pool, and how many bytes they use.
+ */
+void
+dns_intern_stats(const struct dnsintern_t *pool, size_t *count, size_t *bytes);
+
+/**
+ * Tells the parser to store names in the pool rather than in the
+ * result. This should be called on an object from `dns_parse_allocator()`
+ * (or a previous result) before it's passed as the `recycled` parameter
+ * to `dns_parse()`. The setting is kept when the object is recycled.
+ * @param pool
+ *      A pool from `dns_intern_create()`, or NULL to stop using a pool.
+ */
+void
+dns_parse_intern(struct dns_t *dns, struct dnsintern_t *pool);
+
+/**
+ * The result of `dns_parse_batch()`, one allocation holding the results
+ * for many packets laid out one after another.
+ */
+typedef struct dnsbatch_t {
+    /* The number of packets in the batch */
+    size_t count;
+
+    /* The result for each packet. These are views into the batch, so
+     * they can't be freed or recycled on their own. Parse errors are
+     * indicated by their `error_code` as usual. */
+    struct dns_t **results;
+
+    /* Internal parameters for recycling the memory */
+    size_t _current_size;
+    size_t _max_size;
+} dnsbatch_t;
+
+/**
+ * Parses many packets at once, the same as calling `dns_parse()` on each
+ * one, but putting all the results into a single allocation, which can
+ * be recycled for the next batch. Once the recycled memory is large
+ * enough, each packet is parsed in a single pass.
+ * @param bufs
+ *      An array of `count` packets.
+ * @param lengths
+ *      An array of `count` packet lengths.
+ * @param flags
+ *      Flags of the form DNS_F_xxxx. When the memory needs to grow, the
+ *      default is a sizing pass to find exactly how much is needed, while
+ *      with DNS_F_SINGLEPASS it skips that pass by growing it more.
+ * @param recycled
+ *      A previous batch, whose memory will be reused, or NULL.
+ * @return
+ *      The batch, which must be freed with `dns_parse_batch_free()`, or
+ *      NULL on out-of-memory.
+ */
+struct dnsbatch_t *
+dns_parse_batch(const unsigned char *const bufs[], const size_t lengths[], size_t count,
+                unsigned flags, struct dnsbatch_t *recycled);
+
+/**
+ * Frees the result from `dns_parse_batch()`, including all the results.
+ */
+void
+dns_parse_batch_free(struct dnsbatch_t *batch);
+
 /**
   * Frees the result from `dns_parse()`.
   * @param dns
@@ -587,6 +705,211 @@ dns_parse_allocator(void *(*myrealloc)(void*,size_t,void*arena), void *arena, si
 void
 dns_parse_free(struct dns_t *dns);
 
+/**
+ * A "view" of a resource-record. Instead of copying the contents out
+ * of the packet, this records where they are located within the packet,
+ * so that the programmer can decode only those fields they need. Names
+ * are decompressed only when asked for with `dns_view_name()`.
+ */
+typedef struct dnsrrview_t
+{
+    /* The offset from the start of the packet of the owner name. This
+     * may be compressed, pointing elsewhere in the packet. */
+    size_t name_offset;
+
+    /* The [type], [class], and [ttl] fields, the same as in
+     * `dnsrrdata_t`. The [ttl] is zero for query records. */
+    unsigned short rtype;
+    unsigned short rclass;
+    unsigned ttl;
+
+    /* Which section, 0=query, 1=answer, 2=nameserver, 3=additional */
+    int section;
+
+    /* The offset and length of the [rdata] field. These are both zero
+     * for query records. */
+    size_t rdoffset;
+    size_t rdlength;
+} dnsrrview_t;
+
+/**
+ * The result of `dns_view()`, the counterpart of `dns_t`, but
+ * with views of the records rather than decoded copies.
+ */
+typedef struct dnsview_t {
+    /* The packet we are viewing, which must remain valid for as long
+     * as this view is used. */
+    const unsigned char *buf;
+    size_t length;
+
+    /* The same as the fields in `dns_t` */
+    int error_code;
+    unsigned error_index;
+    struct dnsflags_t flags;
+    size_t query_count;
+    size_t answer_count;
+    size_t nameserver_count;
+    size_t additional_count;
+    dnsrrview_t *queries;
+    dnsrrview_t *answers;
+    dnsrrview_t *nameservers;
+    dnsrrview_t *additional;
+
+    /* The number of record views that fit in this allocation, used when
+     * the view is recycled */
+    size_t _max_records;
+} dnsview_t;
+
+/**
+ * Creates a zero-copy view of a DNS packet. This only walks the packet
+ * to find where each record is located and to parse the header and EDNS0
+ * fields. Nothing is copied out of the packet, and names are not
+ * decompressed (or validated) until `dns_view_name()` is called.
+ * @param buf
+ *      The DNS packet, which must remain valid while the view is used.
+ * @param length
+ *      The number of bytes in `buf`.
+ * @param recycled
+ *      A previous result from this function, whose memory will be
+ *      reused if it's large enough, or NULL.
+ * @return
+ *      The view, which must be freed with `dns_view_free()`, or NULL on
+ *      out-of-memory. Parse errors are indicated with `error_code`.
+ */
+struct dnsview_t *
+dns_view(const unsigned char *buf, size_t length, struct dnsview_t *recycled);
+
+/**
+ * Decompresses a name within the packet into a nul-terminated string,
+ * in the same format as the names in `dnsrrdata_t`, like "www.example.com.".
+ * @param offset
+ *      The offset within the packet of the name, such as the `name_offset`
+ *      of a record, or some offset within the [rdata] of a record.
+ * @return
+ *      The length of the name (not including the nul terminator), or 0
+ *      if the name was bad or wouldn't fit within the `dst` buffer.
+ */
+size_t
+dns_view_name(const struct dnsview_t *view, size_t offset, char *dst, size_t dst_length);
+
+/**
+ * Frees the result from `dns_view()`. The packet itself isn't touched.
+ */
+void
+dns_view_free(struct dnsview_t *view);
+
+enum {
+    /* A suggested size for the `scratch` buffer given to `dns_iter_begin()`,
+     * large enough for all but the most unusual records, with room to
+     * keep the names of earlier records so they can be shared. */
+    DNS_ITER_SCRATCH = 16384,
+};
+
+/**
+ * An iterator that decodes the records of a packet one at a time,
+ * using no heap memory. This is typically declared on the stack.
+ * The fields are the same as in `dns_t`.
+ */
+typedef struct dnsiter_t {
+    const unsigned char *buf;
+    size_t length;
+
+    int error_code;
+    unsigned error_index;
+    struct dnsflags_t flags;
+    size_t query_count;
+    size_t answer_count;
+    size_t nameserver_count;
+    size_t additional_count;
+
+    /* The record most recently returned by `dns_iter_next()`. Its
+     * strings point into the scratch buffer, and may be overwritten
+     * by the next call. */
+    dnsrrdata_t rr;
+
+    /* Internal state */
+    size_t _index;
+    size_t _offset;
+    unsigned char *_scratch;
+    size_t _scratch_size;
+    struct nametable *_names;
+} dnsiter_t;
+
+/**
+ * Starts iterating over the records in a packet. This parses only the
+ * header, after which the counts and `flags` are valid, but doesn't decode
+ * any records. Like DNS_F_SINGLEPASS, there's no first pass looking ahead
+ * for the EDNS0 record, so the `flags.edns0` fields (and an extended
+ * `rcode`) are filled in when the iterator reaches the OPT record.
+ * @param buf
+ *      The DNS packet, which must remain valid while iterating.
+ * @param scratch
+ *      Caller-owned memory, such as a buffer on the stack, which holds
+ *      the names and other data of the current record. It needn't be
+ *      aligned. See DNS_ITER_SCRATCH for a suggested size.
+ * @return
+ *      0 on success, or DNS_input_overflow if the packet is too short
+ *      for the header. Errors in the records are reported when
+ *      `dns_iter_next()` reaches the bad one, which is how
+ *      `dns_parse()` treats such packets.
+ */
+int
+dns_iter_begin(struct dnsiter_t *iter, const unsigned char *buf, size_t length, void *scratch, size_t scratch_size);
+
+/**
+ * Decodes the next record, starting with the queries, then answers,
+ * nameservers, and additional records, the same order as the array
+ * in `dns_t`. The caller can stop at any time. Nothing is allocated.
+ * @return
+ *      The record, which is valid until the next call, or NULL when
+ *      there are no more records or on error. In the case of error,
+ *      `error_code` and `error_index` are set. If a record needs more
+ *      memory than the scratch buffer, the error is DNS_out_of_memory.
+ */
+const struct dnsrrdata_t *
+dns_iter_next(struct dnsiter_t *iter);
+
+/**
+ * The result of `dns_parse_header()`, a small fixed-size summary of a
+ * packet for triage, such as counting NXDOMAINs or truncated responses.
+ * The fields are the same as in `dns_t`.
+ */
+typedef struct dnsheader_t {
+    int error_code;
+    struct dnsflags_t flags;
+    size_t query_count;
+    size_t answer_count;
+    size_t nameserver_count;
+    size_t additional_count;
+
+    /* The [type] and [class] of the first query, or zero if there are
+     * no queries (or it couldn't be parsed). */
+    unsigned short qtype;
+    unsigned short qclass;
+
+    /* The name of the first query, decompressed the same as names in
+     * `dnsrrdata_t`, like "www.example.com.", or an empty string. This
+     * is large enough for the longest name with every byte escaped. */
+    size_t qname_length;
+    char qname[512];
+} dnsheader_t;
+
+/**
+ * Parses only the header, EDNS0 fields, and first query of a packet,
+ * which is all that's needed to bucket traffic by rcode, flags, and
+ * name. This is much faster than `dns_parse()`, as nothing is allocated
+ * and no other records are decoded (though they are still walked in
+ * order to find the EDNS0 record).
+ * @param hdr
+ *      Caller-owned memory, typically on the stack, to hold the result.
+ * @return
+ *      0 on success, or an error code like DNS_input_overflow, which
+ *      is also stored in `error_code`. As with `dns_iter_begin()`, the
+ *      header fields are still filled in as far as they could be parsed.
+ */
+int
+dns_parse_header(const unsigned char *buf, size_t length, struct dnsheader_t *hdr);
+
 /**
  * Given a rr-type like "A" or "CNAME" or "MX", return the integer value 
  * corresponding to that name. Both the inputs and outputs to this
@@ -597,10 +920,17 @@ int dns_rrtype_from_name(const char *name);
 /**
  * Given an rr-type, return it's name, like "A" for 1 or "MX" for 5. Both
  * the inputs and outputs to this function are the external values defined
- * in RFCs.
+ * in RFCs. Unknown types are returned like "TYPE1234" in a thread-local
+ * buffer that's overwritten by the next call.
  */
 const char *dns_name_from_rrtype(int value);
 
+/**
+ * The same as `dns_name_from_rrtype()`, but unknown types are written to
+ * the caller's buffer, which should be at least 16 bytes.
+ */
+const char *dns_name_from_rrtype_r(int value, char *buf, size_t sizeof_buf);
+
 /**
   * Runs some quick tests that don't consume much memory or CPU,
   * to validate some internal functions that don't bloat executables using
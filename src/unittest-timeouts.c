@@ -54,6 +54,71 @@ _rand(uint64_t *seed)
 }
 
 
+/**
+ * Test a large gap in time, such as between two packets in a capture
+ * file that are hours apart. Everything should come out, in order,
+ * and without walking every tick in between.
+ */
+static int
+_test_gap(void)
+{
+    enum {GAP_ITEMS = 1000, GAP_SECONDS = 6 * 3600};
+    struct MyStruct *items;
+    struct Timeouts *ctx;
+    time_t start = 1000000000;
+    time_t last = 0;
+    time_t now;
+    uint64_t seed = 1;
+    size_t count = 0;
+    size_t i;
+
+    items = calloc(GAP_ITEMS, sizeof(*items));
+    ctx = timeouts_create(start, 0);
+
+    for (i=0; i<GAP_ITEMS; i++) {
+        items[i].expired.tv_sec = start + 1 + _rand(&seed) % GAP_SECONDS;
+        timeouts_add(ctx,
+                     &items[i].timeout,
+                     offsetof(struct MyStruct, timeout),
+                     items[i].expired.tv_sec,
+                     0);
+    }
+
+    /* Remove one item so that it shouldn't come back out */
+    timeout_unlink(&items[0].timeout);
+
+    /* Nothing has expired yet */
+    if (timeouts_remove_older(ctx, start, 0) != NULL) {
+        fprintf(stderr, "[-] timeouts: gap: expired too early\n");
+        return 1;
+    }
+
+    /* Jump forward a few hours at a time */
+    for (now = start + 3600; now <= start + GAP_SECONDS + 3600; now += 3600) {
+        struct MyStruct *x;
+
+        while ((x = timeouts_remove_older(ctx, now, 0)) != NULL) {
+            if (x == &items[0] || x->expired.tv_sec >= now || x->expired.tv_sec < last) {
+                fprintf(stderr, "[-] timeouts: gap: wrong item expired\n");
+                return 1;
+            }
+            last = x->expired.tv_sec;
+            count++;
+        }
+    }
+
+    if (count != GAP_ITEMS - 1) {
+        fprintf(stderr, "[-] timeouts: gap: expired %u items, expected %u\n",
+                (unsigned)count, (unsigned)GAP_ITEMS - 1);
+        return 1;
+    }
+
+    timeouts_destroy(ctx);
+    free(items);
+    return 0;
+}
+
+
 int main(int argc, char *argv[])
 {
     time_t test_start_time;
@@ -67,6 +132,9 @@ int main(int argc, char *argv[])
     
     fprintf(stderr, "[ ] timeouts: test started\n");
 
+    if (_test_gap() != 0)
+        return 1;
+
     /* Parse some command-line parameters */
     for (i=1; i<argc; i++) {
         if (strcmp(argv[i], "-d") == 0)
@@ -1,3 +1,6 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* recvmmsg() and sendmmsg() */
+#endif
 #include "util-dispatch.h"
 #include "util-timeouts.h"
 #include <assert.h>
@@ -19,6 +22,95 @@
 #include <sys/poll.h>
 #include <netdb.h>
 #include <sys/resource.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define HAVE_EPOLL 1
+#endif
+
+/* We talk to io_uring with raw system calls, rather than depending
+ * upon 'liburing'. We need the kernel headers from 5.11 or later, for
+ * waiting with a timeout. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+/* The number of submission entries in the io_uring */
+#define URING_ENTRIES 1024
+
+/* The most buffers we'll send from with one io_uring operation, which
+ * is kept small because every connection has room for this many */
+#define URING_IOV_MAX 16
+
+/* The most events we'll take from epoll_wait() at a time. Any more
+ * will be returned on the next call */
+#define MAX_EPOLL_EVENTS 256
+
+/* Linux can send or receive many datagrams with a single system call */
+#if defined(__linux__)
+#define HAVE_MMSG 1
+#endif
+
+/* The most datagrams we'll send or receive with one system call */
+#define DGRAM_BATCH 32
+
+/* No datagram is larger than this, so there's no point in receiving
+ * datagrams into buffers bigger than dispatch_set_recv_size() when
+ * that's been set larger */
+#define DGRAM_MAX 65536
+
+/* The size of each buffer in the pool used for queueing data to send,
+ * including its header, so that each fits in a page */
+#define IOBUF_BYTES 4096
+
+/* The most unused buffers the pool keeps for reuse. Beyond this, they
+ * are returned to the heap, so that a burst of backpressure doesn't
+ * keep memory tied up */
+#define IOBUF_POOL_MAX 256
+
+/* The most buffers we'll send from with one system call */
+#define SENDQ_IOV_MAX 64
+
+/* The default for how much we recv() at a time, which can be changed
+ * with dispatch_set_recv_size() */
+#define DEFAULT_RECV_SIZE 4096
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * A buffer holding data waiting to be sent, chained together into a
+ * queue for each connection. They come from a pool, so under
+ * backpressure, queueing more data doesn't copy what's already queued
+ * the way growing a single buffer would.
+ */
+struct iobuf {
+    struct iobuf *next;
+
+    /* The start of the data that hasn't been sent yet */
+    size_t offset;
+
+    /* The end of the data, where more is appended */
+    size_t length;
+
+    /* The size of 'data', which is the same for all the buffers in the
+     * pool, but larger for the occasional oversized datagram */
+    size_t capacity;
+
+    unsigned char data[];
+};
+
+#define IOBUF_CAPACITY (IOBUF_BYTES - offsetof(struct iobuf, data))
 
 enum {
     My_None,
@@ -27,6 +119,7 @@ enum {
     My_Listening,
     My_Closing,
     My_Established,
+    My_Wakeup,
 };
 
 struct my_connection
@@ -54,17 +147,65 @@ struct my_connection
     struct sockaddr_storage sa;
     socklen_t sa_addrlen;
     
+    /* Data waiting to be sent, as a chain of buffers. For datagram
+     * sockets, this is a series of datagrams, each prefixed by a 2-byte
+     * length, and each within a single buffer. */
     struct {
-        char *data;
+        struct iobuf *head;
+        struct iobuf *tail;
         size_t length;
     } buffered;
     
     struct TimeoutEntry timeout;
+
+    /* Whether this is a UDP socket, where every send() and recv() is a
+     * separate datagram, rather than part of a stream */
+    unsigned is_datagram:1;
+
+    /* Whether this is on the dispatcher's list of datagram sockets to
+     * flush */
+    unsigned is_flush_pending:1;
+    struct my_connection *_next_flush;
+
+    /* For DISPATCH_BACKEND_IO_URING, where operations are started, then
+     * complete later, and memory they use has to stay put until then */
+    struct {
+        /* A bit for each operation that hasn't completed, like URING_RECV */
+        unsigned inflight;
+
+        /* Closed, but waiting for operations to finish before this
+         * record can be reused */
+        unsigned is_zombie:1;
+
+        /* Points at the buffered data the kernel is sending, which
+         * stays in the queue until the send completes */
+        struct msghdr msg;
+        struct iovec iov[URING_IOV_MAX];
+
+        unsigned char *recvbuf;
+        size_t recvbuf_size;
+        struct sockaddr_storage accept_sa;
+        socklen_t accept_sa_length;
+    } uring;
 };
 
 
 struct dispatcher
 {
+    /* Such as DISPATCH_BACKEND_POLL or DISPATCH_BACKEND_EPOLL */
+    int backend;
+
+    /* For DISPATCH_BACKEND_IO_URING */
+    struct uring_t *uring;
+
+    /* The epoll descriptor, for DISPATCH_BACKEND_EPOLL. Every socket in
+     * 'pollist' is also registered here, and the 'events' field in the
+     * 'pollist' is kept in sync with what's registered. */
+    int epfd;
+
+    /* The list of sockets and the events we want on them. This is the
+     * set of descriptors passed to poll(), and is used to track the
+     * sockets even when we are using epoll instead */
     struct pollfd *pollist;
     int *listx;
     size_t pollcount;
@@ -89,6 +230,180 @@ struct dispatcher
     
     /* The numbero of timeouts we are waiting on */
     size_t timeout_count;
+
+    /* Datagram sockets with queued datagrams, which we send together
+     * with one system call each time through 'dispatch_dispatch()' */
+    struct my_connection *datagrams_pending;
+
+    /* Buffers for receiving or sending a batch of datagrams at once,
+     * allocated the first time they are needed */
+    struct dgram_batch *dgram;
+
+    /* Work handed to us by other threads, with dispatch_group_post().
+     * They push onto this stack without locks, and we take the whole
+     * stack at once. */
+    struct dispatch_post *posted;
+
+    /* A pipe other threads write to in order to wake us up from
+     * waiting, when they post work to us, or -1 if not used */
+    int wakeup[2];
+
+    /* The pool of unused buffers for queueing data to send */
+    struct iobuf *iobufs_free;
+    size_t iobufs_free_count;
+
+    /* The buffer we recv() into, shared by all connections */
+    unsigned char *recvbuf;
+    size_t recv_size;
+};
+
+struct dispatch_post {
+    struct dispatch_post *next;
+    dispatch_post_fn fn;
+    void *arg;
+};
+
+/**
+ * Get a buffer from the pool, or from the heap if the pool is empty,
+ * or if more than a pool buffer's worth is needed.
+ */
+static struct iobuf *
+_iobuf_alloc(struct dispatcher *d, size_t capacity)
+{
+    struct iobuf *b;
+
+    if (capacity <= IOBUF_CAPACITY && d->iobufs_free) {
+        b = d->iobufs_free;
+        d->iobufs_free = b->next;
+        d->iobufs_free_count--;
+    } else {
+        if (capacity < IOBUF_CAPACITY)
+            capacity = IOBUF_CAPACITY;
+        b = malloc(offsetof(struct iobuf, data) + capacity);
+        if (b == NULL)
+            return NULL;
+        b->capacity = capacity;
+    }
+    b->next = NULL;
+    b->offset = 0;
+    b->length = 0;
+    return b;
+}
+
+static void
+_iobuf_free(struct dispatcher *d, struct iobuf *b)
+{
+    if (b->capacity == IOBUF_CAPACITY && d->iobufs_free_count < IOBUF_POOL_MAX) {
+        b->next = d->iobufs_free;
+        d->iobufs_free = b;
+        d->iobufs_free_count++;
+    } else
+        free(b);
+}
+
+/**
+ * Add a buffer to the end of a connection's send queue.
+ */
+static void
+_sendq_link(struct my_connection *c, struct iobuf *b)
+{
+    if (c->buffered.tail)
+        c->buffered.tail->next = b;
+    else
+        c->buffered.head = b;
+    c->buffered.tail = b;
+}
+
+/**
+ * Copy data onto the end of the send queue, filling up the last buffer
+ * before adding new ones.
+ */
+static int
+_sendq_append(struct dispatcher *d, struct my_connection *c, const void *buf, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    while (length) {
+        struct iobuf *b = c->buffered.tail;
+        size_t count;
+
+        if (b == NULL || b->length == b->capacity) {
+            b = _iobuf_alloc(d, 0);
+            if (b == NULL)
+                return -1;
+            _sendq_link(c, b);
+        }
+        count = b->capacity - b->length;
+        if (count > length)
+            count = length;
+        memcpy(b->data + b->length, p, count);
+        b->length += count;
+        c->buffered.length += count;
+        p += count;
+        length -= count;
+    }
+    return 0;
+}
+
+/**
+ * Remove data from the front of the send queue once it's been sent,
+ * returning emptied buffers to the pool.
+ */
+static void
+_sendq_consume(struct dispatcher *d, struct my_connection *c, size_t count)
+{
+    c->buffered.length -= count;
+    while (c->buffered.head) {
+        struct iobuf *b = c->buffered.head;
+        size_t n = b->length - b->offset;
+
+        if (n > count) {
+            b->offset += count;
+            break;
+        }
+        count -= n;
+        c->buffered.head = b->next;
+        _iobuf_free(d, b);
+    }
+    if (c->buffered.head == NULL)
+        c->buffered.tail = NULL;
+}
+
+/**
+ * Throw away everything queued, such as when the connection closes.
+ */
+static void
+_sendq_clear(struct dispatcher *d, struct my_connection *c)
+{
+    _sendq_consume(d, c, c->buffered.length);
+}
+
+/**
+ * Point a list of 'iovec' at the queued data, so that it can be sent
+ * from where it is, with one system call.
+ * @return the number of 'iovec' filled in
+ */
+static int
+_sendq_iov(const struct my_connection *c, struct iovec *iov, int max)
+{
+    const struct iobuf *b;
+    int count = 0;
+
+    for (b = c->buffered.head; b && count < max; b = b->next) {
+        iov[count].iov_base = (void *)(b->data + b->offset);
+        iov[count].iov_len = b->length - b->offset;
+        count++;
+    }
+    return count;
+}
+
+struct dgram_batch {
+#if defined(HAVE_MMSG)
+    struct mmsghdr msgs[DGRAM_BATCH];
+#endif
+    struct iovec iovs[DGRAM_BATCH];
+    unsigned char *bufs;
+    size_t buf_size;
 };
 
 
@@ -242,7 +557,7 @@ _dispatch_event(dispatcher *d, struct my_connection *c, int event_type, ...)
             event_data.accept.sa = va_arg(marker, struct sockaddr *);
             event_data.accept.sa_length = va_arg(marker, size_t);
             e.accept = (void*)&event_data.accept;
-            c->connection_type = My_Established;
+            /* This stays a listener, ready to accept the next one */
             c->cb(d, c->external_handle, &e, c->cbdata);
             break;
             
@@ -294,6 +609,10 @@ _dispatch_event(dispatcher *d, struct my_connection *c, int event_type, ...)
 static void
 _mark_closed(dispatcher *d, struct my_connection *c)
 {
+    /* Don't add it to the list twice, such as when both an error
+     * and a hangup happen */
+    if (c->connection_type == My_Closing)
+        return;
     c->connection_type = My_Closing;
     c->_next = d->connections_closing;
     d->connections_closing = c;
@@ -315,8 +634,330 @@ dispatch_close(dispatcher *d, int external_handle)
     return 0;
 }
 
+#if defined(HAVE_IO_URING)
+/* The operations we submit to io_uring, stored in the low bits of the
+ * 'user_data' field, with the connection handle in the high bits */
+enum {
+    URING_RECV = 1,
+    URING_SEND = 2,
+    URING_ACCEPT = 4,
+    URING_CONNECT = 8,
+    URING_POLLOUT = 16,
+    URING_POLLIN = 32,
+    URING_CANCEL = 64,
+};
+
+/**
+ * The shared memory rings for submitting operations and reaping their
+ * completions.
+ */
+struct uring_t {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_length;
+    size_t sqes_length;
+
+    /* Submissions queued since the last io_uring_enter() */
+    unsigned to_submit;
+
+    /* The number of operations that haven't completed, for all
+     * connections */
+    size_t inflight;
+};
+
+static void
+_uring_destroy(struct uring_t *ring)
+{
+    if (ring == NULL)
+        return;
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_length);
+    if (ring->ring_ptr)
+        munmap(ring->ring_ptr, ring->ring_length);
+    if (ring->fd != -1)
+        close(ring->fd);
+    free(ring);
+}
+
+/**
+ * Create the rings. This fails on older kernels, or where io_uring has
+ * been disabled, such as by a seccomp filter, in which case the
+ * caller falls back to another backend.
+ */
+static struct uring_t *
+_uring_create(unsigned entries)
+{
+    struct io_uring_params params;
+    struct uring_t *ring;
+    size_t sq_length;
+    size_t cq_length;
+    unsigned char *ptr;
+
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+        return NULL;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        fprintf(stderr, "[-] io_uring_setup(): %s\n", strerror(errno));
+        goto fail;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0
+        || (params.features & IORING_FEAT_EXT_ARG) == 0) {
+        fprintf(stderr, "[-] io_uring: kernel too old\n");
+        goto fail;
+    }
+
+    /* Map the submission and completion rings, which share memory */
+    sq_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_length = (sq_length > cq_length) ? sq_length : cq_length;
+    ptr = mmap(0, ring->ring_length, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "[-] io_uring: mmap(): %s\n", strerror(errno));
+        goto fail;
+    }
+    ring->ring_ptr = ptr;
+    ring->sq_head = (unsigned *)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+
+    /* Map the submission entries themselves */
+    ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(0, ring->sqes_length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        fprintf(stderr, "[-] io_uring: mmap(): %s\n", strerror(errno));
+        goto fail;
+    }
+    return ring;
+
+fail:
+    _uring_destroy(ring);
+    return NULL;
+}
+
+/**
+ * Submit queued operations, and optionally wait for at least one to
+ * complete.
+ * @param timeout
+ *      Milliseconds to wait for a completion, or -1 to not wait
+ */
+static int
+_uring_enter(struct uring_t *ring, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned min_complete = 0;
+    int count;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+    }
+
+    count = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+                         min_complete, flags, &arg, sizeof(arg));
+    if (count >= 0)
+        ring->to_submit -= (unsigned)count;
+    else if (errno == ETIME || errno == EBUSY) {
+        /* A timeout with nothing completed isn't an error, and EBUSY
+         * means completions must be reaped before submitting more */
+        return 0;
+    }
+    return count;
+}
+
+/**
+ * Get a submission entry to fill in. The submission ring is larger than
+ * we typically need, but if it fills up, we submit what's there.
+ */
+static struct io_uring_sqe *
+_uring_get_sqe(struct uring_t *ring, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail;
+    unsigned index;
+
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask) {
+        if (_uring_enter(ring, -1) < 0)
+            return NULL;
+    }
+
+    index = tail & ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    ring->inflight++;
+    return sqe;
+}
+
+static uint64_t
+_uring_user_data(struct my_connection *c, unsigned op)
+{
+    return ((uint64_t)(unsigned)c->external_handle << 32) | op;
+}
+
+/**
+ * Start an operation on a connection, remembering that it's in flight
+ * so that we don't start a second one.
+ */
+static struct io_uring_sqe *
+_uring_start(struct dispatcher *d, struct my_connection *c, unsigned op, int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = _uring_get_sqe(d->uring, _uring_user_data(c, op));
+    if (sqe == NULL)
+        return NULL;
+    sqe->fd = fd;
+    c->uring.inflight |= op;
+    return sqe;
+}
+
+/**
+ * Make sure the operations matching what the connection is waiting for
+ * are in flight. This takes the place of registering for readiness with
+ * poll() or epoll: instead of waiting until we can recv(), we ask the
+ * kernel to do the recv() for us.
+ */
+static void
+_uring_arm(struct dispatcher *d, struct my_connection *c)
+{
+    struct io_uring_sqe *sqe;
+    int fd = d->pollist[c->pollfd_index].fd;
+    int events = d->pollist[c->pollfd_index].events;
+
+    /* Connecting sockets are handled by URING_CONNECT, and closing
+     * ones shouldn't start anything new */
+    if (fd == -1 || c->connection_type == My_Connecting || c->connection_type == My_Closing)
+        return;
+
+    /* The wakeup pipe isn't a socket, so we wait for it to be readable,
+     * then read it ourselves */
+    if (c->connection_type == My_Wakeup) {
+        if ((c->uring.inflight & URING_POLLIN) == 0) {
+            sqe = _uring_start(d, c, URING_POLLIN, fd);
+            if (sqe) {
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->poll32_events = POLLIN;
+            }
+        }
+        return;
+    }
+
+    if ((events & POLLIN) && c->connection_type == My_Listening) {
+        if ((c->uring.inflight & URING_ACCEPT) == 0) {
+            c->uring.accept_sa_length = sizeof(c->uring.accept_sa);
+            sqe = _uring_start(d, c, URING_ACCEPT, fd);
+            if (sqe) {
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->addr = (uint64_t)(uintptr_t)&c->uring.accept_sa;
+                sqe->addr2 = (uint64_t)(uintptr_t)&c->uring.accept_sa_length;
+            }
+        }
+    } else if (events & POLLIN) {
+        if ((c->uring.inflight & URING_RECV) == 0) {
+            /* Each connection needs its own buffer, because the kernel
+             * fills it in after we return */
+            if (c->uring.recvbuf_size != d->recv_size) {
+                free(c->uring.recvbuf);
+                c->uring.recvbuf = malloc(d->recv_size);
+                c->uring.recvbuf_size = c->uring.recvbuf ? d->recv_size : 0;
+            }
+            sqe = c->uring.recvbuf ? _uring_start(d, c, URING_RECV, fd) : NULL;
+            if (sqe) {
+                sqe->opcode = IORING_OP_RECV;
+                sqe->addr = (uint64_t)(uintptr_t)c->uring.recvbuf;
+                sqe->len = (unsigned)c->uring.recvbuf_size;
+
+                /* For datagrams, get the full length, so that we can
+                 * tell when one didn't fit */
+                if (c->is_datagram)
+                    sqe->msg_flags = MSG_TRUNC;
+            }
+        }
+    }
+
+    if ((events & POLLOUT) && (c->uring.inflight & (URING_SEND | URING_POLLOUT)) == 0) {
+        /* Datagrams are sent in batches with sendmmsg(), so for those we
+         * only wait until there's room */
+        if (c->buffered.length && !c->is_datagram) {
+            /* Send straight from the queued buffers. Anything sent after
+             * this gets queued behind it, and what's sent is removed
+             * from the queue when this completes */
+            memset(&c->uring.msg, 0, sizeof(c->uring.msg));
+            c->uring.msg.msg_iov = c->uring.iov;
+            c->uring.msg.msg_iovlen = _sendq_iov(c, c->uring.iov, URING_IOV_MAX);
+            sqe = _uring_start(d, c, URING_SEND, fd);
+            if (sqe) {
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->addr = (uint64_t)(uintptr_t)&c->uring.msg;
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL;
+            }
+        } else {
+            /* Nothing to send, so the caller wants to know when
+             * there's room to send */
+            sqe = _uring_start(d, c, URING_POLLOUT, fd);
+            if (sqe) {
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->poll32_events = POLLOUT;
+            }
+        }
+    }
+}
+
+/**
+ * Ask the kernel to cancel everything in flight for a connection. Each
+ * cancelled operation still completes, with -ECANCELED.
+ */
+static void
+_uring_cancel(struct dispatcher *d, struct my_connection *c)
+{
+    unsigned op;
+
+    for (op = URING_RECV; op < URING_CANCEL; op <<= 1) {
+        struct io_uring_sqe *sqe;
+        if ((c->uring.inflight & op) == 0)
+            continue;
+        sqe = _uring_get_sqe(d->uring, _uring_user_data(c, URING_CANCEL));
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = _uring_user_data(c, op);
+        }
+    }
+}
+#endif
+
 struct dispatcher *
-dispatch_create(void)
+dispatch_create_backend(int backend)
 {
     struct dispatcher *d;
 
@@ -326,10 +967,124 @@ dispatch_create(void)
         abort();
     
     d->to = timeouts_create(time(0), 0);
+    d->epfd = -1;
+    d->wakeup[0] = -1;
+    d->wakeup[1] = -1;
+    d->recv_size = DEFAULT_RECV_SIZE;
+
+    /* Choose how we'll wait for events. Where io_uring isn't supported,
+     * we fall back to epoll, and where that isn't supported, to poll() */
+    if (backend == DISPATCH_BACKEND_DEFAULT)
+        backend = DISPATCH_BACKEND_EPOLL;
+#if defined(HAVE_IO_URING)
+    if (backend == DISPATCH_BACKEND_IO_URING) {
+        d->uring = _uring_create(URING_ENTRIES);
+        if (d->uring) {
+            d->backend = DISPATCH_BACKEND_IO_URING;
+            return d;
+        }
+    }
+#endif
+    if (backend == DISPATCH_BACKEND_IO_URING)
+        backend = DISPATCH_BACKEND_EPOLL;
+#if defined(HAVE_EPOLL)
+    if (backend == DISPATCH_BACKEND_EPOLL) {
+        d->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (d->epfd == -1)
+            fprintf(stderr, "[-] epoll_create1(): %s\n", strerror(errno));
+    }
+#endif
+    if (d->epfd == -1)
+        d->backend = DISPATCH_BACKEND_POLL;
+    else
+        d->backend = DISPATCH_BACKEND_EPOLL;
 
     return d;
 }
 
+struct dispatcher *
+dispatch_create(void)
+{
+    return dispatch_create_backend(DISPATCH_BACKEND_DEFAULT);
+}
+
+int
+dispatch_set_recv_size(dispatcher *d, size_t size)
+{
+    if (size < 512 || size > 16 * 1024 * 1024)
+        return -1;
+    free(d->recvbuf);
+    d->recvbuf = NULL;
+    d->recv_size = size;
+    return 0;
+}
+
+int
+dispatch_backend(const dispatcher *d)
+{
+    return d->backend;
+}
+
+#if defined(HAVE_EPOLL)
+/**
+ * Convert poll() event flags to epoll flags. We use poll() flags
+ * everywhere else, so that both backends share the same code.
+ */
+static uint32_t
+_epoll_from_poll(int events)
+{
+    uint32_t result = 0;
+    if (events & POLLIN)
+        result |= EPOLLIN;
+    if (events & POLLOUT)
+        result |= EPOLLOUT;
+    return result;
+}
+
+static int
+_poll_from_epoll(uint32_t events)
+{
+    int result = 0;
+    if (events & EPOLLIN)
+        result |= POLLIN;
+    if (events & EPOLLOUT)
+        result |= POLLOUT;
+    if (events & EPOLLERR)
+        result |= POLLERR;
+    if (events & EPOLLHUP)
+        result |= POLLHUP;
+    return result;
+}
+#endif
+
+/**
+ * Change the events we are waiting for on a connection, such as adding
+ * POLLOUT when there's data waiting to be sent.
+ */
+static void
+_set_events(struct dispatcher *d, struct my_connection *c, int events)
+{
+    struct pollfd *p = &d->pollist[c->pollfd_index];
+
+    if (p->events == events)
+        return;
+    p->events = (short)events;
+
+#if defined(HAVE_EPOLL)
+    if (d->backend == DISPATCH_BACKEND_EPOLL && p->fd != -1) {
+        struct epoll_event ev = {0};
+        ev.events = _epoll_from_poll(events);
+        ev.data.u32 = (uint32_t)c->external_handle;
+        if (epoll_ctl(d->epfd, EPOLL_CTL_MOD, p->fd, &ev) != 0)
+            fprintf(stderr, "[-] epoll_ctl(MOD): %s\n", strerror(errno));
+    }
+#endif
+#if defined(HAVE_IO_URING)
+    if (d->backend == DISPATCH_BACKEND_IO_URING)
+        _uring_arm(d, c);
+#endif
+}
+
 
 
 int is_decimal(const char *str)
@@ -426,6 +1181,9 @@ dispatch_new(struct dispatcher *d, dispatch_callback cb, void *cbdata, int type)
         memset(c, 0xa3, sizeof(*c));
         c->external_handle = (int)d->connection_count;
         memset(&c->timeout, 0, sizeof(c->timeout));
+        memset(&c->uring, 0, sizeof(c->uring));
+        c->buffered.head = NULL;
+        c->buffered.tail = NULL;
         
         /* Append to list of connections */
         d->connection_count += 1;
@@ -437,6 +1195,8 @@ dispatch_new(struct dispatcher *d, dispatch_callback cb, void *cbdata, int type)
     c->_next = 0;
     c->connection_type = type;
     c->buffered.length = 0;
+    c->is_datagram = 0;
+    c->is_flush_pending = 0;
     c->cb = cb;
     c->cbdata = cbdata;
     return c;
@@ -450,6 +1210,16 @@ dispatcher_add(struct dispatcher *d, int fd, struct sockaddr *sa, socklen_t sa_a
     c = dispatch_new(d, cb, cbdata, type);
     c->sa_addrlen = sa_addrlen;
     memcpy(&c->sa, sa, sa_addrlen);
+
+    /* Datagram sockets are read and written a packet at a time, whether
+     * we created them or they were adopted */
+    {
+        int sotype = 0;
+        socklen_t sotype_length = sizeof(sotype);
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &sotype, &sotype_length) == 0
+            && sotype == SOCK_DGRAM)
+            c->is_datagram = 1;
+    }
     
     /* Allocate a "pollfd" record. This has to be in a non-sparse memory,
      * so we are going to just use the last free entry on the end of the list
@@ -470,6 +1240,22 @@ dispatcher_add(struct dispatcher *d, int fd, struct sockaddr *sa, socklen_t sa_a
     d->pollist[d->pollcount].events = POLLIN; /* every entry is always POLLIN */
     d->pollist[d->pollcount].revents = 0;
     d->pollcount += 1;
+
+#if defined(HAVE_EPOLL)
+    /* Register with epoll too, using the handle rather than the index
+     * into 'pollist', because the index changes as things are removed */
+    if (d->backend == DISPATCH_BACKEND_EPOLL) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)c->external_handle;
+        if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            fprintf(stderr, "[-] epoll_ctl(ADD): %s\n", strerror(errno));
+    }
+#endif
+#if defined(HAVE_IO_URING)
+    if (d->backend == DISPATCH_BACKEND_IO_URING)
+        _uring_arm(d, c);
+#endif
     return c;
 }
 
@@ -504,6 +1290,10 @@ dispatcher_remove_at(struct dispatcher *d, size_t pollfd_index)
     
     /* close the socket if it's still open */
     if (d->pollist[pollfd_index].fd > 0) {
+#if defined(HAVE_EPOLL)
+        if (d->backend == DISPATCH_BACKEND_EPOLL)
+            epoll_ctl(d->epfd, EPOLL_CTL_DEL, d->pollist[pollfd_index].fd, NULL);
+#endif
         close(d->pollist[pollfd_index].fd);
         d->pollist[pollfd_index].fd = -1;
     }
@@ -518,25 +1308,82 @@ dispatcher_remove_at(struct dispatcher *d, size_t pollfd_index)
         d->connections[d->listx[pollfd_index]]->pollfd_index = pollfd_index;
     }
     d->pollcount--;
+
+    /* Forget any datagrams that were waiting to be sent */
+    if (c->is_flush_pending) {
+        struct my_connection **r;
+        for (r = &d->datagrams_pending; *r != c; r = &(*r)->_next_flush)
+            ;
+        *r = c->_next_flush;
+        c->is_flush_pending = 0;
+    }
     
+#if defined(HAVE_IO_URING)
+    /* The kernel may still be using this record's buffers, so it can't
+     * be reused until everything in flight has completed */
+    if (c->uring.inflight) {
+        c->uring.is_zombie = 1;
+        _uring_cancel(d, c);
+        return;
+    }
+#endif
+    _sendq_clear(d, c);
+
     /* put this "connection" record on the free list, so that the next
      * time we need one, we can just reuse this one */
     c->_next = d->connections_free;
     d->connections_free = c;
 }
 
+static int _dispatch_uring(struct dispatcher *d, int timeout);
+
 void dispatch_destroy(struct dispatcher *d)
 {
     while (d->pollcount)
         dispatcher_remove_at(d, d->pollcount-1);
 
+#if defined(HAVE_IO_URING)
+    /* Wait for cancelled operations to finish, so that the kernel is
+     * done with our buffers before we free them */
+    if (d->uring) {
+        unsigned tries;
+        for (tries = 0; d->uring->inflight && tries < 100; tries++)
+            _dispatch_uring(d, 10);
+        _uring_destroy(d->uring);
+    }
+#endif
+
     free(d->pollist);
     free(d->listx);
     while (d->connection_count) {
+        struct my_connection *c;
         d->connection_count--;
-        free(d->connections[d->connection_count]);
+        c = d->connections[d->connection_count];
+        _sendq_clear(d, c);
+        free(c->uring.recvbuf);
+        free(c);
     }
     free(d->connections);
+    if (d->dgram)
+        free(d->dgram->bufs);
+    free(d->dgram);
+    free(d->recvbuf);
+    while (d->iobufs_free) {
+        struct iobuf *b = d->iobufs_free;
+        d->iobufs_free = b->next;
+        free(b);
+    }
+    if (d->epfd != -1)
+        close(d->epfd);
+    if (d->wakeup[1] != -1)
+        close(d->wakeup[1]);
+    while (d->posted) {
+        struct dispatch_post *p = d->posted;
+        d->posted = p->next;
+        free(p);
+    }
+    timeouts_destroy(d->to);
+    free(d);
 }
 
 
@@ -631,7 +1478,7 @@ dispatch_connect(dispatcher *d, dispatch_callback cb, void *cbdata, const char *
     struct my_connection *c = NULL;
     int error_code = 0;
 
-    assert(protocol == 6);
+    assert(protocol == 6 || protocol == 17);
     assert(port < 65536);
     
     /* Convert the address string and port number into sockets structure */
@@ -642,7 +1489,7 @@ dispatch_connect(dispatcher *d, dispatch_callback cb, void *cbdata, const char *
     }
 
     /* Create a socket */
-    fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    fd = socket(ai->ai_family, (protocol==6)?SOCK_STREAM:SOCK_DGRAM, 0);
     if (fd == -1) {
         error_code = DISPATCH_ERR_SOCKET;
         fprintf(stderr, "[-] socket(): %d: %s\n", errno, strerror(errno));
@@ -663,10 +1510,58 @@ dispatch_connect(dispatcher *d, dispatch_callback cb, void *cbdata, const char *
         error_code = DISPATCH_ERR_NONBLOCKING;
         goto fail;
     }
+
+    /* A UDP "connection" just sets the default destination, and
+     * filters incoming datagrams to those from the destination. This
+     * completes immediately, with no packets exchanged. */
+    if (protocol == 17) {
+        err = connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (err) {
+            error_code = DISPATCH_ERR_SOCKET;
+            fprintf(stderr, "[-] connect([%s]:%u): %d: %s\n",
+                addr, port, errno, strerror(errno));
+            /* No connection has been added yet, so there's nobody
+             * to send the error/closed events to */
+            close(fd);
+            freeaddrinfo(ai);
+            return -1;
+        }
+        c = dispatcher_add(d, fd, (struct sockaddr *)ai->ai_addr, ai->ai_addrlen, cb, cbdata, My_Established);
+        if (c == NULL) {
+            close(fd);
+            freeaddrinfo(ai);
+            return -1;
+        }
+        _dispatch_event(d, c, DISPATCH_CONNECTING);
+        _dispatch_event(d, c, DISPATCH_CONNECTED);
+        freeaddrinfo(ai);
+        return c->external_handle;
+    }
     
     /* Add to our poll list */
     c = dispatcher_add(d, fd, (struct sockaddr *)ai->ai_addr, ai->ai_addrlen, cb, cbdata, My_Connecting);
     
+#if defined(HAVE_IO_URING)
+    /* With io_uring, the kernel does the connect() for us, and we find
+     * out the result when it completes */
+    if (d->backend == DISPATCH_BACKEND_IO_URING) {
+        struct io_uring_sqe *sqe;
+        sqe = _uring_start(d, c, URING_CONNECT, fd);
+        if (sqe == NULL) {
+            _mark_closed(d, c);
+            freeaddrinfo(ai);
+            return -1;
+        }
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = (uint64_t)(uintptr_t)&c->sa;
+        sqe->off = c->sa_addrlen;
+        _set_events(d, c, POLLOUT);
+        _dispatch_event(d, c, DISPATCH_CONNECTING);
+        freeaddrinfo(ai);
+        return c->external_handle;
+    }
+#endif
+
     /* 
      * Initiate the TCP connection process.
      */
@@ -675,7 +1570,7 @@ dispatch_connect(dispatcher *d, dispatch_callback cb, void *cbdata, const char *
         /* EXPECTED result. This isn't an error, but simply telling us that
          * the connection is in progress. We'll need to poll() to see when
          * the connection completes */
-        d->pollist[c->pollfd_index].events = POLLOUT;
+        _set_events(d, c, POLLOUT);
 
         /* At this point, though, the socket should be in a state where we
          * can grab the the local IP address and port that the system chose
@@ -685,7 +1580,7 @@ dispatch_connect(dispatcher *d, dispatch_callback cb, void *cbdata, const char *
         /* This is unexpected/abnormal, but happens sometimes when connecting
          * to localhost, because it doesn't need to wait for packets from the
          * network, because it's all internal to the kernel. */
-        d->pollist[c->pollfd_index].events = 0;
+        _set_events(d, c, 0);
         _dispatch_event(d, c, DISPATCH_CONNECTING);
         c->connection_type = My_None;
         _dispatch_event(d, c, DISPATCH_CONNECTED);
@@ -706,6 +1601,7 @@ dispatch_connect(dispatcher *d, dispatch_callback cb, void *cbdata, const char *
 
     /* Return the index in our array as a handle that can be used
      * by the caller */
+    freeaddrinfo(ai);
     return c->external_handle; /* success */
 
 fail:
@@ -717,8 +1613,8 @@ fail:
     return -1; /* failure */
 }
 
-int
-dispatch_listen(dispatcher *d, dispatch_callback cb, void *cbdata, const char *addr, unsigned port, unsigned protocol)
+static int
+_dispatch_listen(dispatcher *d, dispatch_callback cb, void *cbdata, const char *addr, unsigned port, unsigned protocol, int is_reuseport)
 {
     int fd = -1;
     int err;
@@ -750,6 +1646,22 @@ dispatch_listen(dispatcher *d, dispatch_callback cb, void *cbdata, const char *a
         goto fail;
     }
     
+#if defined(SO_REUSEPORT)
+    /* Allow several sockets to listen on the same port, with the kernel
+     * spreading incoming connections among them */
+    if (is_reuseport) {
+        int yes = 1;
+        err = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        if (err) {
+            error_code = DISPATCH_ERR_SOCKET;
+            fprintf(stderr, "[-] setsockopt(SO_REUSEPORT): %s\n", strerror(errno));
+            goto fail;
+        }
+    }
+#else
+    (void)is_reuseport;
+#endif
+
     /* Bind the desired port */
     err = bind(fd, ai->ai_addr, ai->ai_addrlen);
     if (err) {
@@ -785,6 +1697,7 @@ dispatch_listen(dispatcher *d, dispatch_callback cb, void *cbdata, const char *a
 
     /* Return the index in our array as a handle that can be used
      * by the caller */
+    freeaddrinfo(ai);
     return c->external_handle; /* success */
 
 fail:
@@ -796,6 +1709,12 @@ fail:
     return -1; /* failure */
 }
 
+int
+dispatch_listen(dispatcher *d, dispatch_callback cb, void *cbdata, const char *addr, unsigned port, unsigned protocol)
+{
+    return _dispatch_listen(d, cb, cbdata, addr, port, protocol, 0);
+}
+
 /**
  * Go through the list of pending closes and do the closing. These were connections
  * added by '_dispatch_close()', either during the execution of 'dispatch_dispatch()'
@@ -912,11 +1831,18 @@ dispatch_poll_error(struct dispatcher *d, struct my_connection *c, int fd)
 static int
 dispatch_poll_recv(struct dispatcher *d, struct my_connection *c, int fd)
 {
-    char buf[4096];
     ssize_t length;
+
+    /* All connections share one buffer, since it's only used until the
+     * callback returns */
+    if (d->recvbuf == NULL) {
+        d->recvbuf = malloc(d->recv_size);
+        if (d->recvbuf == NULL)
+            abort();
+    }
         
     /* Data is ready to receive */
-    length = recv(fd, buf, sizeof(buf), 0);
+    length = recv(fd, d->recvbuf, d->recv_size, 0);
     if (length == 0 ) {
         /* Shouldn't be possible, should've got POLLHUP instead */
         fprintf(stderr, "[-] RECV(): %s\n", "CONNECTION CLOSED");
@@ -925,7 +1851,7 @@ dispatch_poll_recv(struct dispatcher *d, struct my_connection *c, int fd)
         fprintf(stderr, "[-] RECV(): %s\n", strerror(errno));
         _mark_closed(d, c);
     } else {
-        _dispatch_event(d, c, DISPATCH_RECEIVED, buf, length);
+        _dispatch_event(d, c, DISPATCH_RECEIVED, d->recvbuf, length);
     }
     
     return 0;
@@ -956,25 +1882,28 @@ static int
 dispatch_poll_send(struct dispatcher *d, struct my_connection *c, int fd)
 {
     if (c->buffered.length) {
-        ssize_t bytes_sent;
-        
-        bytes_sent = send(fd, c->buffered.data, c->buffered.length, 0);
-        if (bytes_sent < 0) {
-            /* might've reset connection between poll() and send() */
-            fprintf(stderr, "[-] SEND(): %s\n", strerror(errno));
-            _mark_closed(d, c);
-        } else if (bytes_sent < c->buffered.length) {
-            size_t offset = bytes_sent;
-            size_t diff = c->buffered.length - bytes_sent;
-            memmove(c->buffered.data, c->buffered.data + offset, diff);
-            c->buffered.length -= diff;
-        } else {
-            c->buffered.length = 0;
-            c->connection_type = My_None;
-            _dispatch_event(d, c, DISPATCH_SENT);
+        while (c->buffered.length) {
+            struct iovec iov[SENDQ_IOV_MAX];
+            struct msghdr msg = {0};
+            ssize_t bytes_sent;
+
+            /* Send as many of the queued buffers as the kernel will
+             * take, without first copying them together */
+            msg.msg_iov = iov;
+            msg.msg_iovlen = _sendq_iov(c, iov, SENDQ_IOV_MAX);
+            bytes_sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (bytes_sent < 0) {
+                /* might've reset connection between poll() and send() */
+                fprintf(stderr, "[-] SEND(): %s\n", strerror(errno));
+                _mark_closed(d, c);
+                return 0;
+            }
+            _sendq_consume(d, c, (size_t)bytes_sent);
         }
+        _dispatch_event(d, c, DISPATCH_SENT);
     } else {
-        c->connection_type = My_None;
         _dispatch_event(d, c, DISPATCH_SEND_AVAILABLE);
     }
 
@@ -983,11 +1912,527 @@ dispatch_poll_send(struct dispatcher *d, struct my_connection *c, int fd)
 
 
 
+/**
+ * Run the work other threads have posted to us.
+ */
+static void
+_dispatch_posted(struct dispatcher *d)
+{
+    struct dispatch_post *list;
+    struct dispatch_post *reversed = NULL;
+    char buf[64];
+
+    /* Empty the pipe before taking the list, so that anything posted
+     * after we take it will wake us up again */
+    while (read(d->wakeup[0], buf, sizeof(buf)) > 0)
+        ;
+    list = __atomic_exchange_n(&d->posted, NULL, __ATOMIC_ACQUIRE);
+
+    /* The stack is newest first, so reverse it to run them in the order
+     * they were posted */
+    while (list) {
+        struct dispatch_post *p = list;
+        list = p->next;
+        p->next = reversed;
+        reversed = p;
+    }
+    while (reversed) {
+        struct dispatch_post *p = reversed;
+        reversed = p->next;
+        p->fn(d, p->arg);
+        free(p);
+    }
+}
+
+static struct dgram_batch *
+_dgram_batch(struct dispatcher *d)
+{
+    if (d->dgram == NULL) {
+        d->dgram = calloc(1, sizeof(*d->dgram));
+        if (d->dgram == NULL)
+            abort();
+    }
+    return d->dgram;
+}
+
+/**
+ * Receive a batch of datagrams, with one system call where we can, then
+ * dispatch a separate DISPATCH_RECEIVED for each of them.
+ */
+static int
+_dgram_recv(struct dispatcher *d, struct my_connection *c, int fd)
+{
+    struct dgram_batch *b = _dgram_batch(d);
+    size_t buf_size = (d->recv_size < DGRAM_MAX) ? d->recv_size : DGRAM_MAX;
+    int count;
+    int i;
+
+    /* Datagrams bigger than the receive size are dropped, the same as
+     * with the io_uring backend, so resize when that changes */
+    if (b->buf_size != buf_size) {
+        free(b->bufs);
+        b->bufs = malloc(DGRAM_BATCH * buf_size);
+        if (b->bufs == NULL)
+            abort();
+        b->buf_size = buf_size;
+    }
+
+#if defined(HAVE_MMSG)
+    for (i=0; i<DGRAM_BATCH; i++) {
+        b->iovs[i].iov_base = b->bufs + i * buf_size;
+        b->iovs[i].iov_len = buf_size;
+        memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    count = recvmmsg(fd, b->msgs, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+#else
+    {
+        ssize_t length = recv(fd, b->bufs, buf_size, MSG_DONTWAIT);
+        count = (length < 0) ? -1 : 1;
+        b->iovs[0].iov_len = (size_t)length;
+    }
+#endif
+    if (count < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        fprintf(stderr, "[-] RECV(): %s\n", strerror(errno));
+        _mark_closed(d, c);
+        return -1;
+    }
+
+    for (i=0; i<count; i++) {
+        size_t length;
+#if defined(HAVE_MMSG)
+        if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            fprintf(stderr, "[-] RECV(): datagram too big\n");
+            continue;
+        }
+        length = b->msgs[i].msg_len;
+#else
+        length = b->iovs[i].iov_len;
+#endif
+        _dispatch_event(d, c, DISPATCH_RECEIVED, b->bufs + i * buf_size, length);
+
+        /* The callback may have closed the socket */
+        if (c->connection_type == My_Closing)
+            break;
+    }
+    return count;
+}
+
+/**
+ * Send the datagrams queued on this socket, as many at a time as we
+ * can. If the kernel runs out of buffers, wait for POLLOUT to send
+ * the rest. Once everything is sent, we dispatch DISPATCH_SENT.
+ */
+static int
+_dgram_flush(struct dispatcher *d, struct my_connection *c)
+{
+    struct dgram_batch *b = _dgram_batch(d);
+    int fd = d->pollist[c->pollfd_index].fd;
+
+    while (c->buffered.length) {
+        const struct iobuf *buf = c->buffered.head;
+        size_t offset = buf->offset;
+        size_t total = 0;
+        int count = 0;
+        int sent;
+        int i;
+
+        /* Point at the next batch of queued datagrams, without copying
+         * them. Each is within a single buffer. */
+        while (buf && count < DGRAM_BATCH) {
+            const unsigned char *p;
+            size_t length;
+
+            if (offset >= buf->length) {
+                buf = buf->next;
+                if (buf)
+                    offset = buf->offset;
+                continue;
+            }
+            p = buf->data + offset;
+            length = p[0] << 8 | p[1];
+            b->iovs[count].iov_base = (void *)(p + 2);
+            b->iovs[count].iov_len = length;
+            offset += 2 + length;
+            count++;
+        }
+
+#if defined(HAVE_MMSG)
+        for (i=0; i<count; i++) {
+            memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+            b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+            b->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        sent = sendmmsg(fd, b->msgs, (unsigned)count, MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+        sent = (send(fd, b->iovs[0].iov_base, b->iovs[0].iov_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) ? -1 : 1;
+#endif
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+        if (sent < 0) {
+            fprintf(stderr, "[-] SEND(): %s\n", strerror(errno));
+            _mark_closed(d, c);
+            return -1;
+        }
+
+        /* Remove the ones that were sent from the queue */
+        for (i=0; i<sent; i++)
+            total += 2 + b->iovs[i].iov_len;
+        _sendq_consume(d, c, total);
+        if (sent < count)
+            break;
+    }
+
+    /* If anything is left, then the kernel was out of buffers, so wait
+     * until there is room */
+    if (c->buffered.length) {
+        _set_events(d, c, d->pollist[c->pollfd_index].events | POLLOUT);
+        return 0;
+    }
+    _set_events(d, c, d->pollist[c->pollfd_index].events & ~POLLOUT);
+    _dispatch_event(d, c, DISPATCH_SENT);
+    return 0;
+}
+
+/**
+ * Flush all the sockets with queued datagrams.
+ */
+static void
+_dgram_flush_pending(struct dispatcher *d)
+{
+    while (d->datagrams_pending) {
+        struct my_connection *c = d->datagrams_pending;
+        d->datagrams_pending = c->_next_flush;
+        c->_next_flush = NULL;
+        c->is_flush_pending = 0;
+        if (c->connection_type != My_Closing)
+            _dgram_flush(d, c);
+    }
+}
+
+/**
+ * Queue a datagram to be sent the next time we flush. If too many are
+ * queued, then flush now.
+ */
+static int
+_dgram_queue(struct dispatcher *d, struct my_connection *c, const void *buf, size_t length)
+{
+    struct iobuf *b;
+    unsigned char *p;
+
+    if (length > 0xFFFF)
+        return -1;
+
+    /* Keep each datagram within one buffer, so that it can be sent from
+     * where it is */
+    b = c->buffered.tail;
+    if (b == NULL || b->capacity - b->length < 2 + length) {
+        b = _iobuf_alloc(d, 2 + length);
+        if (b == NULL) {
+            _mark_closed(d, c);
+            return -1;
+        }
+        _sendq_link(c, b);
+    }
+    p = b->data + b->length;
+    p[0] = (unsigned char)(length >> 8);
+    p[1] = (unsigned char)(length >> 0);
+    memcpy(p + 2, buf, length);
+    b->length += 2 + length;
+    c->buffered.length += 2 + length;
+
+    /* If we're already waiting on POLLOUT, it'll be sent then */
+    if (d->pollist[c->pollfd_index].events & POLLOUT)
+        return 0;
+    if (!c->is_flush_pending) {
+        c->is_flush_pending = 1;
+        c->_next_flush = d->datagrams_pending;
+        d->datagrams_pending = c;
+    }
+    return 0;
+}
+
+/**
+ * Handle the events that poll() or epoll_wait() reported on a connection.
+ */
+static void
+_dispatch_revents(struct dispatcher *d, struct my_connection *c, int revents)
+{
+    int fd = d->pollist[c->pollfd_index].fd;
+
+    if ((revents & POLLERR) != 0) {
+        /* An error has occurred on this TCP connection, like a RST */
+        dispatch_poll_error(d, c, fd);
+        
+        /* Close the connection if an error occurs */
+        _mark_closed(d, c);
+        
+        /* this overrides any other event that might be pending */
+        return;
+    }
+    
+    if ((revents & POLLHUP) != 0) {
+        /* The TCP connection has been closed*/
+        dispatch_poll_hangup(d, c);
+        
+        _mark_closed(d, c);
+        
+        /* Don't process any more events on this socket */
+        return;
+    }
+    
+    
+    if ((revents & POLLIN) != 0 && c->is_datagram) {
+        if (c->connection_type != My_Closing)
+            _dgram_recv(d, c, fd);
+    } else if ((revents & POLLIN) != 0) {
+        switch (c->connection_type) {
+            case My_Connecting:
+                c->connection_type = My_None;
+                _dispatch_event(d, c, DISPATCH_CONNECTED);
+                break;
+            case My_Listening:
+                dispatch_poll_accept(d, c, fd);
+                break;
+            case My_Established:
+                dispatch_poll_recv(d, c, fd);
+                break;
+            case My_Wakeup:
+                _dispatch_posted(d);
+                break;
+            default:
+                fprintf(stderr, "[-] unknown poll condition\n");
+        }
+    }
+    
+    /* Note that callbacks can add new connections, which can move the
+     * 'pollist' in memory, so we look up our entry each time */
+    if ((revents & POLLOUT) != 0 && c->is_datagram) {
+        if (c->connection_type != My_Closing)
+            _dgram_flush(d, c);
+    } else if ((revents & POLLOUT) != 0) {
+        int events = d->pollist[c->pollfd_index].events & ~POLLOUT;
+        switch (c->connection_type) {
+            case My_Connecting:
+                c->connection_type = My_Established;
+                _set_events(d, c, events | POLLIN);
+                _dispatch_event(d, c, DISPATCH_CONNECTED);
+                break;
+            case My_Listening:
+                dispatch_poll_accept(d, c, fd);
+                break;
+            case My_Established:
+                _set_events(d, c, events);
+                dispatch_poll_send(d, c, fd);
+                if (c->buffered.length)
+                    _set_events(d, c, d->pollist[c->pollfd_index].events | POLLOUT);
+                break;
+            default:
+                _set_events(d, c, events);
+                fprintf(stderr, "[-] unknown poll condition\n");
+        }
+    }
+}
+
+/**
+ * Wait using poll(), then walk the entire list of sockets to find
+ * the ones with events.
+ */
+static int
+_dispatch_poll(struct dispatcher *d, int timeout)
+{
+    size_t i;
+    int count;
+
+    count = poll(d->pollist, (int)d->pollcount, timeout);
+    if (count <= 0)
+        return count;
+
+    /* Process all the sockets  */
+    for (i=0; i<d->pollcount; i++) {
+        int revents = d->pollist[i].revents;
+        
+        /* Only process sockets that have events waiting */
+        if (revents == 0)
+            continue;
+        d->pollist[i].revents = 0;
+
+        _dispatch_revents(d, d->connections[d->listx[i]], revents);
+    }
+    return count;
+}
+
+#if defined(HAVE_EPOLL)
+/**
+ * Wait using epoll, which tells us only the sockets with events, so
+ * that the cost doesn't depend on how many sockets are idle.
+ */
+static int
+_dispatch_epoll(struct dispatcher *d, int timeout)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int i;
+    int count;
+
+    count = epoll_wait(d->epfd, events, MAX_EPOLL_EVENTS, timeout);
+    for (i=0; i<count; i++) {
+        struct my_connection *c = d->connections[events[i].data.u32];
+        _dispatch_revents(d, c, _poll_from_epoll(events[i].events));
+    }
+    return count;
+}
+#endif
+
+#if defined(HAVE_IO_URING)
+/**
+ * Handle a completed io_uring operation, turning it into the same
+ * events as the other backends.
+ */
+static void
+_uring_complete(struct dispatcher *d, uint64_t user_data, int res)
+{
+    struct my_connection *c;
+    unsigned op = (unsigned)(user_data & 0xFFFFFFFF);
+
+    d->uring->inflight--;
+    c = d->connections[user_data >> 32];
+
+    /* The results of a cancel request don't matter, only that of the
+     * operation that was cancelled */
+    if (op == URING_CANCEL)
+        return;
+    c->uring.inflight &= ~op;
+
+    /* If the connection was closed while this was in flight, then now
+     * that the last one is done, the record can be reused */
+    if (c->uring.is_zombie) {
+        if (c->uring.inflight == 0) {
+            c->uring.is_zombie = 0;
+            _sendq_clear(d, c);
+            c->_next = d->connections_free;
+            d->connections_free = c;
+        }
+        return;
+    }
+    if (c->connection_type == My_Closing)
+        return;
+
+    switch (op) {
+        case URING_RECV:
+            if (c->is_datagram && (size_t)res > c->uring.recvbuf_size && res > 0) {
+                fprintf(stderr, "[-] RECV(): datagram too big\n");
+            } else if (c->is_datagram && res >= 0) {
+                /* Empty datagrams are allowed, and aren't a hangup */
+                _dispatch_event(d, c, DISPATCH_RECEIVED, c->uring.recvbuf, (size_t)res);
+            } else if (res == 0) {
+                dispatch_poll_hangup(d, c);
+            } else if (res < 0) {
+                fprintf(stderr, "[-] RECV(): %s\n", strerror(-res));
+                _mark_closed(d, c);
+            } else {
+                _dispatch_event(d, c, DISPATCH_RECEIVED, c->uring.recvbuf, (size_t)res);
+            }
+            break;
+        case URING_ACCEPT:
+            if (res < 0) {
+                fprintf(stderr, "[-] accept(): error: %s\n", strerror(-res));
+                break;
+            }
+            _dispatch_event(d, c, DISPATCH_ACCEPTED, res,
+                            &c->uring.accept_sa, (size_t)c->uring.accept_sa_length);
+            break;
+        case URING_CONNECT:
+            if (res < 0) {
+                fprintf(stderr, "[-] connect(): %s\n", strerror(-res));
+                _mark_closed(d, c);
+                break;
+            }
+            c->connection_type = My_Established;
+            _set_events(d, c, POLLIN);
+            _dispatch_event(d, c, DISPATCH_CONNECTED);
+            break;
+        case URING_SEND:
+            if (res < 0) {
+                fprintf(stderr, "[-] SEND(): %s\n", strerror(-res));
+                _mark_closed(d, c);
+                break;
+            }
+            _sendq_consume(d, c, (size_t)res);
+            if (c->buffered.length) {
+                /* A partial send, or more was queued while this was
+                 * being sent, so send the rest */
+                _uring_arm(d, c);
+                break;
+            }
+            _set_events(d, c, d->pollist[c->pollfd_index].events & ~POLLOUT);
+            _dispatch_event(d, c, DISPATCH_SENT);
+            break;
+        case URING_POLLIN:
+            _dispatch_posted(d);
+            break;
+        case URING_POLLOUT:
+            if (res < 0 || (res & (POLLERR | POLLHUP))) {
+                _mark_closed(d, c);
+                break;
+            }
+            if (c->is_datagram) {
+                _dgram_flush(d, c);
+                break;
+            }
+            _set_events(d, c, d->pollist[c->pollfd_index].events & ~POLLOUT);
+            _dispatch_event(d, c, DISPATCH_SEND_AVAILABLE);
+            break;
+    }
+
+    /* Keep receiving or accepting */
+    _uring_arm(d, c);
+}
+
+/**
+ * Submit everything queued since last time, wait for completions, then
+ * handle the whole batch of them.
+ */
+static int
+_dispatch_uring(struct dispatcher *d, int timeout)
+{
+    struct uring_t *ring = d->uring;
+    unsigned head;
+    int count = 0;
+
+    if (_uring_enter(ring, timeout) < 0 && errno != EINTR)
+        return -1;
+
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+
+        /* Release the entry before the callback, which may queue more */
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        _uring_complete(d, user_data, res);
+        count++;
+    }
+    return count;
+}
+#else
+static int
+_dispatch_uring(struct dispatcher *d, int timeout)
+{
+    (void)d;
+    (void)timeout;
+    return -1;
+}
+#endif
+
 int
 dispatch_dispatch(struct dispatcher *d, uint64_t nanoseconds)
 {
     int timeout = (int)(nanoseconds / (1000 * 1000));
-    size_t i;
     int count;
 
     /* Dispatch timeouts */
@@ -996,12 +2441,23 @@ dispatch_dispatch(struct dispatcher *d, uint64_t nanoseconds)
     /* First do any necessary cleanup of connections that need
      * to be closed. */
     _dispatch_close_list(d);
+
+    /* Send datagrams queued since last time */
+    _dgram_flush_pending(d);
     
     if (d->pollcount == 0)
         goto good;
     
-    /* wait for incoming event on any connection */
-    count = poll(d->pollist, (int)d->pollcount, timeout);
+    /* wait for incoming event on any connection, and process them */
+    if (d->backend == DISPATCH_BACKEND_IO_URING)
+        count = _dispatch_uring(d, timeout);
+    else
+#if defined(HAVE_EPOLL)
+    if (d->backend == DISPATCH_BACKEND_EPOLL)
+        count = _dispatch_epoll(d, timeout);
+    else
+#endif
+        count = _dispatch_poll(d, timeout);
     if (count < 0) {
         switch (errno) {
             case EINTR:
@@ -1016,87 +2472,19 @@ dispatch_dispatch(struct dispatcher *d, uint64_t nanoseconds)
                 goto fail;
         }
     }
-    if (count == 0)
-        goto good;
 
-    /* Process all the sockets  */
-    for (i=0; i<d->pollcount; i++) {
-        struct my_connection *c = d->connections[d->listx[i]];
-        struct pollfd *p = &d->pollist[i];
-        
-        /* Only process sockets that have events waiting */
-        if (p->revents == 0)
-            continue;
-        
-        if ((p->revents & POLLERR) != 0) {
-            /* An error has occurred on this TCP connection, like a RST */
-            dispatch_poll_error(d, c, p->fd);
-            
-            /* Close the connection if an error occurs */
-            _mark_closed(d, c);
-            
-            /* this overrides any other event that might be pending */
-            continue;
-        }
-        
-        if ((p->revents & POLLHUP) != 0) {
-            /* The TCP connection has been closed*/
-            dispatch_poll_hangup(d, c);
-            
-            _mark_closed(d, c);
-            
-            /* Don't process any more events on this socket */
-            continue;
-        }
-        
-        
-        if ((p->revents & POLLIN) != 0) {
-            switch (c->connection_type) {
-                case My_Connecting:
-                    c->connection_type = My_None;
-                    _dispatch_event(d, c, DISPATCH_CONNECTED);
-                    break;
-                case My_Listening:
-                    dispatch_poll_accept(d, c, p->fd);
-                    break;
-                case My_Established:
-                    dispatch_poll_recv(d, c, p->fd);
-                    break;
-                default:
-                    fprintf(stderr, "[-] unknown poll condition\n");
-            }
-        }
-        
-        if ((p->revents & POLLOUT) != 0) {
-            p->events &= ~POLLOUT;
-            switch (c->connection_type) {
-                case My_Connecting:
-                    c->connection_type = My_Established;
-                    p->events |= POLLIN;
-                    _dispatch_event(d, c, DISPATCH_CONNECTED);
-                    break;
-                case My_Listening:
-                    p->events |= POLLOUT;
-                    dispatch_poll_accept(d, c, p->fd);
-                    break;
-                case My_Established:
-                    dispatch_poll_send(d, c, p->fd);
-                    if (c->buffered.length)
-                        p->events |= POLLOUT;
-                    break;
-                default:
-                    fprintf(stderr, "[-] unknown poll condition\n");
-            }
-        }
-    }
+    /* Send the datagrams queued by callbacks, such as responses to
+     * the ones just received */
+    _dgram_flush_pending(d);
 
     /* Lastly, do the actual closing of things that were marked for closing
      * above. */
     _dispatch_close_list(d);
 
 good:
-    /* This is the number of things still left to do */
-    return (int)d->pollcount + (int)d->timeout_count;
+    /* This is the number of things still left to do, not counting our
+     * own wakeup pipe */
+    return (int)d->pollcount + (int)d->timeout_count - (d->wakeup[0] != -1);
 
 fail:
     /* If we reach this code, it's because 'poll()' returned an error.
@@ -1121,34 +2509,43 @@ int
 dispatch_send_buffered(dispatcher *d, int external_handle, const void *buf, size_t length, size_t *sent)
 {
     struct my_connection *c = d->connections[external_handle];
-    struct pollfd *p = &d->pollist[c->pollfd_index];
+    int fd = d->pollist[c->pollfd_index].fd;
     ssize_t bytes_sent;
+
+    /* Datagrams are queued, then sent in a batch */
+    if (c->is_datagram) {
+        if (sent)
+            *sent = 0;
+        return _dgram_queue(d, c, buf, length);
+    }
     
     /* If there is already buffered data pending, then don't do anything
-     * but append to the end of our buffer. */
+     * but append to the end of our queue. */
     if (c->buffered.length) {
-        c->buffered.data = realloc(c->buffered.data, c->buffered.length + length);
-        memcpy(c->buffered.data + c->buffered.length,
-               buf,
-               length);
-        c->buffered.length += length;
         if (sent)
             *sent = 0;
-        p->events |= POLLOUT;
+        if (_sendq_append(d, c, buf, length) != 0) {
+            _mark_closed(d, c);
+            return -1;
+        }
+        _set_events(d, c, d->pollist[c->pollfd_index].events | POLLOUT);
         return 0;
     }
     
     /* Attempt to send data */
-    bytes_sent = send(p->fd, buf, length, 0);
+    bytes_sent = send(fd, buf, length, MSG_NOSIGNAL);
     
     /* Do different things, depending on the results */
     if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         /* Expected result. We are using a non-blocking socket, so
          * one expected result is that this will return such a
-         * result. */
-        *sent = 0;
-        return 0;
-    } else if (bytes_sent < 0) {
+         * result. We buffer all of it below. */
+        bytes_sent = 0;
+    }
+    if (sent)
+        *sent = (bytes_sent < 0) ? 0 : (size_t)bytes_sent;
+
+    if (bytes_sent < 0) {
         /* Unexpected result. We need to simply close the connection and
          * return an error */
         _mark_closed(d, c);
@@ -1156,8 +2553,6 @@ dispatch_send_buffered(dispatcher *d, int external_handle, const void *buf, size
     } else if (bytes_sent == length) {
         /* We successfully sent all the data requested. Therefore, we don't
          * need to buffer anything. We just return this indication. */
-        if (sent)
-            *sent = (size_t)bytes_sent;
         _dispatch_event(d, c, DISPATCH_SENT);
         return 0;
     } else {
@@ -1166,38 +2561,266 @@ dispatch_send_buffered(dispatcher *d, int external_handle, const void *buf, size
         size_t diff = length - bytes_sent;
         size_t offset = bytes_sent;
         
-        c->buffered.data = realloc(c->buffered.data, diff);
-        if (c->buffered.data == NULL) {
+        if (_sendq_append(d, c, (const char *)buf + offset, diff) != 0) {
             /* out-of-memory
              * We are are going to attempt to recover by closing the connection */
+            _sendq_clear(d, c);
             _mark_closed(d, c);
             return -1;
         }
-        
-        memcpy(c->buffered.data, buf + offset, diff);
-        p->events |= POLLOUT;
+        _set_events(d, c, d->pollist[c->pollfd_index].events | POLLOUT);
         return 0;
     }
 
 }
 
-struct selftest_globals {
-    unsigned is_wait_succeeded:1;
-    unsigned error_count;
+/**
+ * The internal callback for the wakeup pipe, which has no events
+ * other than being closed.
+ */
+static void
+_wakeup_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
+{
+    (void)d;
+    (void)handle;
+    (void)e;
+    (void)cbdata;
+}
+
+/**
+ * Create the pipe that other threads use to wake us up when they post
+ * work. This has to be done before any other thread posts to us.
+ */
+static int
+_dispatch_enable_post(struct dispatcher *d)
+{
+    struct sockaddr_storage sa = {0};
+    struct my_connection *c;
+
+    if (pipe(d->wakeup) != 0) {
+        fprintf(stderr, "[-] pipe(): %s\n", strerror(errno));
+        d->wakeup[0] = -1;
+        d->wakeup[1] = -1;
+        return -1;
+    }
+    fcntl(d->wakeup[0], F_SETFD, FD_CLOEXEC);
+    fcntl(d->wakeup[1], F_SETFD, FD_CLOEXEC);
+    _set_nonblocking(d->wakeup[0]);
+    _set_nonblocking(d->wakeup[1]);
+
+    c = dispatcher_add(d, d->wakeup[0], (struct sockaddr *)&sa, 0, _wakeup_cb, 0, My_Wakeup);
+    return c ? 0 : -1;
+}
+
+/**
+ * Hand work to a dispatcher from any thread. This pushes onto the
+ * dispatcher's stack with compare-and-swap, and only the thread that
+ * finds the stack empty needs to wake the dispatcher.
+ */
+static int
+_dispatch_post(struct dispatcher *d, dispatch_post_fn fn, void *arg)
+{
+    struct dispatch_post *p;
+    struct dispatch_post *head;
+
+    p = malloc(sizeof(*p));
+    if (p == NULL)
+        return -1;
+    p->fn = fn;
+    p->arg = arg;
+
+    head = __atomic_load_n(&d->posted, __ATOMIC_RELAXED);
+    do {
+        p->next = head;
+    } while (!__atomic_compare_exchange_n(&d->posted, &head, p, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        /* If the pipe is full, then a wakeup is already pending */
+        if (write(d->wakeup[1], "", 1) < 0 && errno != EAGAIN)
+            return -1;
+    }
+    return 0;
+}
+
+struct dispatch_reactor {
+    struct dispatcher *d;
+    struct dispatch_group *group;
+    pthread_t thread;
+    unsigned is_running:1;
+};
+
+struct dispatch_group {
+    struct dispatch_reactor *reactors;
+    unsigned count;
+
+    /* Set when the reactor threads should exit */
+    int is_stopping;
 };
 
+struct dispatch_group *
+dispatch_group_create(unsigned count, int backend)
+{
+    struct dispatch_group *g;
+    unsigned i;
+
+    if (count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (cpus > 0) ? (unsigned)cpus : 1;
+    }
+
+    g = calloc(1, sizeof(*g));
+    if (g == NULL)
+        return NULL;
+    g->reactors = calloc(count, sizeof(g->reactors[0]));
+    if (g->reactors == NULL) {
+        free(g);
+        return NULL;
+    }
+    g->count = count;
+
+    for (i=0; i<count; i++) {
+        struct dispatch_reactor *r = &g->reactors[i];
+        r->group = g;
+        r->d = dispatch_create_backend(backend);
+        if (_dispatch_enable_post(r->d) != 0) {
+            dispatch_group_destroy(g);
+            return NULL;
+        }
+    }
+    return g;
+}
+
+unsigned
+dispatch_group_count(const struct dispatch_group *g)
+{
+    return g->count;
+}
+
+dispatcher *
+dispatch_group_get(struct dispatch_group *g, unsigned index)
+{
+    if (index >= g->count)
+        return NULL;
+    return g->reactors[index].d;
+}
+
+int
+dispatch_group_listen(struct dispatch_group *g, dispatch_callback cb, void *userdata, const char *addr, unsigned port, unsigned protocol)
+{
+    unsigned i;
+
+    for (i=0; i<g->count; i++) {
+        struct dispatcher *d = g->reactors[i].d;
+        int x;
+
+        x = _dispatch_listen(d, cb, userdata, addr, port, protocol, 1);
+        if (x < 0)
+            return -1;
+
+        /* If the caller asked for any port, the rest of the reactors
+         * need to listen on the one chosen for the first */
+        if (port == 0) {
+            char tmp[64];
+            dispatch_getsockname(d, x, tmp, sizeof(tmp), &port);
+        }
+#if !defined(SO_REUSEPORT)
+        /* Without this, only one socket can listen on the port */
+        break;
+#endif
+    }
+    return (int)port;
+}
+
+int
+dispatch_group_post(struct dispatch_group *g, unsigned index, dispatch_post_fn fn, void *arg)
+{
+    if (index >= g->count)
+        return -1;
+    return _dispatch_post(g->reactors[index].d, fn, arg);
+}
+
+static void *
+_reactor_thread(void *v)
+{
+    struct dispatch_reactor *r = (struct dispatch_reactor *)v;
+
+    while (!__atomic_load_n(&r->group->is_stopping, __ATOMIC_ACQUIRE))
+        dispatch_dispatch(r->d, 100ULL * 1000ULL * 1000ULL);
+    return NULL;
+}
+
+int
+dispatch_group_start(struct dispatch_group *g)
+{
+    unsigned i;
+
+    for (i=0; i<g->count; i++) {
+        struct dispatch_reactor *r = &g->reactors[i];
+        if (pthread_create(&r->thread, 0, _reactor_thread, r) != 0) {
+            fprintf(stderr, "[-] pthread_create() failed\n");
+            dispatch_group_stop(g);
+            return -1;
+        }
+        r->is_running = 1;
+    }
+    return 0;
+}
+
+static void
+_reactor_nothing(dispatcher *d, void *arg)
+{
+    (void)d;
+    (void)arg;
+}
+
+void
+dispatch_group_stop(struct dispatch_group *g)
+{
+    unsigned i;
+
+    /* Tell them to stop, then wake them up to see that */
+    __atomic_store_n(&g->is_stopping, 1, __ATOMIC_RELEASE);
+    for (i=0; i<g->count; i++) {
+        if (g->reactors[i].is_running)
+            _dispatch_post(g->reactors[i].d, _reactor_nothing, 0);
+    }
+
+    for (i=0; i<g->count; i++) {
+        struct dispatch_reactor *r = &g->reactors[i];
+        if (r->is_running) {
+            pthread_join(r->thread, 0);
+            r->is_running = 0;
+        }
+    }
+}
+
+void
+dispatch_group_destroy(struct dispatch_group *g)
+{
+    unsigned i;
+
+    if (g == NULL)
+        return;
+    dispatch_group_stop(g);
+    for (i=0; i<g->count; i++) {
+        if (g->reactors[i].d)
+            dispatch_destroy(g->reactors[i].d);
+    }
+    free(g->reactors);
+    free(g);
+}
+
 /**
  * A callback structure to hold the results from the various self-tests.
  */
 struct selftest_data {
-    struct {
-        char buf[16];
-        size_t count;
-    } receiving;
-    char hostaddr[64];
-    unsigned hostport;
-    char peeraddr[64];
-    unsigned peerport;
+    unsigned is_wait_succeeded:1;
+    unsigned is_client_received:1;
+    unsigned error_count;
+    int listener;
+
+    /* The number of datagrams echoed back to the UDP client */
+    unsigned udp_received_count;
 };
 
 void _selftest_wait_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
@@ -1209,7 +2832,6 @@ void _selftest_wait_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
             data->is_wait_succeeded = 1;
             break;
         case DISPATCH_CLOSED:
-            free(data);
             break;
         default:
             data->error_count++;
@@ -1221,8 +2843,10 @@ void _selftest_wait_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
 
 void _selftest_server_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
 {
-    ta *data = (struct selftest_data *)cbdata;
-    
+    char hostaddr[64];
+    unsigned hostport;
+    char peeraddr[64];
+    unsigned peerport;
     dispatch_getsockname(d, handle, hostaddr, sizeof(hostaddr), &hostport);
     dispatch_getpeername(d, handle, peeraddr, sizeof(peeraddr), &peerport);
 
@@ -1260,6 +2884,7 @@ void _selftest_server_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
 
 void _selftest_client_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
 {
+    struct selftest_data *data = (struct selftest_data *)cbdata;
     char hostaddr[64];
     unsigned hostport;
     char peeraddr[64];
@@ -1290,6 +2915,7 @@ void _selftest_client_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
                     peeraddr, peerport,
                     (unsigned)e->read->length, e->read->buf
                     );
+            data->is_client_received = 1;
             dispatch_close(d, handle);
             break;
 
@@ -1298,6 +2924,8 @@ void _selftest_client_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
                     hostaddr, hostport,
                     peeraddr, peerport
                     );
+            /* The test is over, so stop listening too */
+            dispatch_close(d, data->listener);
             break;
         
         default:
@@ -1305,6 +2933,48 @@ void _selftest_client_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
     }
 }
 
+void _selftest_udp_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
+{
+    struct selftest_data *data = (struct selftest_data *)cbdata;
+
+    switch (e->type) {
+        case DISPATCH_CONNECTED:
+            /* These should arrive as three separate datagrams, rather
+             * than one stream of bytes */
+            dispatch_send_buffered(d, handle, "UDP-1", 5, 0);
+            dispatch_send_buffered(d, handle, "UDP-22", 6, 0);
+            dispatch_send_buffered(d, handle, "UDP-333", 7, 0);
+            break;
+        case DISPATCH_RECEIVED:
+            if (e->read->length != 5 + data->udp_received_count) {
+                fprintf(stderr, "[-] UDP: wrong length datagram\n");
+                data->error_count++;
+            }
+            if (++data->udp_received_count == 3)
+                dispatch_close(d, handle);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Echo back any datagrams sent to our plain UDP socket
+ */
+static void
+_selftest_udp_echo(int fd)
+{
+    char buf[512];
+    struct sockaddr_storage sa;
+    socklen_t sa_length = sizeof(sa);
+    ssize_t length;
+
+    while ((length = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&sa, &sa_length)) >= 0) {
+        sendto(fd, buf, (size_t)length, 0, (struct sockaddr *)&sa, sa_length);
+        sa_length = sizeof(sa);
+    }
+}
+
 void _selftest_accept_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
 {
     char hostaddr[64];
@@ -1318,6 +2988,8 @@ void _selftest_accept_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
         case DISPATCH_ACCEPTED:
             dispatch_adopt(d, _selftest_server_cb, 0, e->accept->fd, e->accept->sa, e->accept->sa_length);
             break;
+        case DISPATCH_CLOSED:
+            break;
         default:
             printf("unknown event type = %u\n", e->type);
             break;
@@ -1325,17 +2997,18 @@ void _selftest_accept_cb(dispatcher *d, int handle, dpevent *e, void *cbdata)
     return;
 }
 
-int
-dispatch_selftest(void)
+static int
+_selftest_backend(int backend)
 {
     struct dispatcher *d;
     int x;
     char hostaddr[64] = "";
     unsigned hostport = 0;
     struct selftest_data data = {0};
+    int udp_fd = -1;
     
     /* Create a dispatch subsystem */
-    d = dispatch_create();
+    d = dispatch_create_backend(backend);
     if (d == NULL)
         return 1; /* failure */
     
@@ -1348,26 +3021,161 @@ dispatch_selftest(void)
     x = dispatch_listen(d, _selftest_accept_cb, &data, "127.0.0.1", 0, 6);
     if (x < 0)
         goto fail;
+    data.listener = x;
     dispatch_getsockname(d, x, hostaddr, sizeof(hostaddr), &hostport);
 
     x = dispatch_connect(d, _selftest_client_cb, &data, hostaddr, hostport, 6);
     if (x < 0)
         goto fail;
 
+    /* Create a UDP socket outside the dispatcher that echoes datagrams,
+     * and a UDP client within the dispatcher to send them */
+    {
+        struct sockaddr_in sin = {0};
+        socklen_t sin_length = sizeof(sin);
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(0x7f000001);
+        udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp_fd == -1
+            || bind(udp_fd, (struct sockaddr *)&sin, sizeof(sin)) != 0
+            || getsockname(udp_fd, (struct sockaddr *)&sin, &sin_length) != 0)
+            goto fail;
+        x = dispatch_connect(d, _selftest_udp_cb, &data, "127.0.0.1", ntohs(sin.sin_port), 17);
+        if (x < 0)
+            goto fail;
+    }
+
+    /* A UDP connect() that fails immediately (broadcast without
+     * SO_BROADCAST) must return an error, not crash */
+    x = dispatch_connect(d, _selftest_udp_cb, &data, "255.255.255.255", 53, 17);
+    if (x >= 0) {
+        fprintf(stderr, "[-] dispatch_connect(UDP broadcast) succeeded\n");
+        goto fail;
+    }
+
     /* continue dispatching events until there are none left */
     while (dispatch_dispatch(d, TEN_MILLISECONDS))
-        ;
+        _selftest_udp_echo(udp_fd);
     
     dispatch_destroy(d);
+    close(udp_fd);
     
     /* Make sure conditions were successfully reached during the test */
     if (!data.is_wait_succeeded) {
         fprintf(stderr, "[-] dispatch_wait() failed\n");
         return 1;
     }
+    if (!data.is_client_received) {
+        fprintf(stderr, "[-] dispatch_connect() failed\n");
+        return 1;
+    }
+    if (data.udp_received_count != 3 || data.error_count) {
+        fprintf(stderr, "[-] dispatch_connect(UDP) failed\n");
+        return 1;
+    }
     return 0; /* success */
     
 fail:
     dispatch_destroy(d);
+    if (udp_fd != -1)
+        close(udp_fd);
     return 1; /* fail */
 }
+
+struct selftest_post {
+    dispatcher *expected;
+    int is_correct;
+};
+
+static void
+_selftest_post_cb(dispatcher *d, void *arg)
+{
+    struct selftest_post *post = (struct selftest_post *)arg;
+    __atomic_store_n(&post->is_correct, d == post->expected, __ATOMIC_RELEASE);
+}
+
+/**
+ * Run a group of two reactors, sharing a listening port, and connect
+ * to it several times from this thread with plain blocking sockets.
+ */
+static int
+_selftest_group(void)
+{
+    struct dispatch_group *g;
+    struct selftest_post posts[2];
+    int port;
+    unsigned i;
+    int result = 1;
+
+    g = dispatch_group_create(2, DISPATCH_BACKEND_DEFAULT);
+    if (g == NULL)
+        return 1;
+    port = dispatch_group_listen(g, _selftest_accept_cb, 0, "127.0.0.1", 0, 6);
+    if (port <= 0)
+        goto fail;
+    for (i=0; i<2; i++) {
+        posts[i].expected = dispatch_group_get(g, i);
+        posts[i].is_correct = 0;
+        dispatch_group_post(g, i, _selftest_post_cb, &posts[i]);
+    }
+    if (dispatch_group_start(g) != 0)
+        goto fail;
+
+    for (i=0; i<4; i++) {
+        struct sockaddr_in sin = {0};
+        struct timeval tv = {2, 0};
+        char buf[16];
+        ssize_t length;
+        int fd;
+
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(0x7f000001);
+        sin.sin_port = htons((unsigned short)port);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+            goto fail;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0
+            || send(fd, "HELLO-1\n", 7, 0) != 7
+            || (length = recv(fd, buf, sizeof(buf), 0)) != 7
+            || memcmp(buf, "HELLO-2", 7) != 0) {
+            fprintf(stderr, "[-] dispatch_group: no response\n");
+            close(fd);
+            goto fail;
+        }
+        close(fd);
+    }
+
+    /* Wait for the posted work to be done */
+    for (i=0; i<100; i++) {
+        if (__atomic_load_n(&posts[0].is_correct, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&posts[1].is_correct, __ATOMIC_ACQUIRE))
+            break;
+        usleep(10000);
+    }
+    if (i == 100) {
+        fprintf(stderr, "[-] dispatch_group_post() failed\n");
+        goto fail;
+    }
+    result = 0;
+
+fail:
+    dispatch_group_destroy(g);
+    return result;
+}
+
+int
+dispatch_selftest(void)
+{
+    /* Run the same test with each way of waiting for events. Where
+     * one isn't supported, it falls back to the next one */
+    if (_selftest_backend(DISPATCH_BACKEND_POLL))
+        return 1;
+    if (_selftest_backend(DISPATCH_BACKEND_EPOLL))
+        return 1;
+    if (_selftest_backend(DISPATCH_BACKEND_IO_URING))
+        return 1;
+    if (_selftest_group())
+        return 1;
+    return 0;
+}
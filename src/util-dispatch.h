@@ -10,6 +10,10 @@
     the triggered function (like send or recv) and deliver the results.
     In other words, the caller never calls 'recv()' themselves, but
     instead accepts incoming data from the subsystem.
+
+    On Linux, 'epoll' is used instead of 'poll()' by default, so that
+    the cost of waiting depends upon the number of sockets with events,
+    rather than the total number of sockets.
  
     Objects tracked by the system are referenced by a 'handle', which
     is an integer starting from around 0, with a value of -1 to indicate
@@ -79,6 +83,24 @@ enum {
     DISPATCH_ERR_NONBLOCKING,
 };
 
+/* How the dispatcher waits for events, passed to dispatch_create_backend() */
+enum {
+    /* Use the best one available on this system */
+    DISPATCH_BACKEND_DEFAULT,
+
+    /* Use poll(), which is supported everywhere */
+    DISPATCH_BACKEND_POLL,
+
+    /* Use epoll on Linux, falling back to poll() elsewhere */
+    DISPATCH_BACKEND_EPOLL,
+
+    /* Use io_uring on Linux 5.11 and later, where the kernel does the
+     * send(), recv(), accept(), and connect() for us, and tells us
+     * the results in batches. This falls back to epoll, or poll(), if
+     * the kernel doesn't support it. */
+    DISPATCH_BACKEND_IO_URING,
+};
+
 typedef void (*dispatch_callback)(dispatcher *d, int handle, dpevent *e, void *cbdata);
 
 struct dispatchevent {
@@ -114,6 +136,33 @@ struct dispatchevent {
 dispatcher *
 dispatch_create(void);
 
+/**
+ * Create an instance of this subsystem, choosing how it waits for
+ * events, such as DISPATCH_BACKEND_POLL. If that way isn't supported,
+ * this falls back to one that is.
+ */
+dispatcher *
+dispatch_create_backend(int backend);
+
+/**
+ * Returns the way the dispatcher is waiting for events, such as
+ * DISPATCH_BACKEND_EPOLL.
+ */
+int
+dispatch_backend(const dispatcher *d);
+
+/**
+ * Set how much is received at a time, which is 4096 bytes by default.
+ * Larger sizes mean fewer system calls and callbacks when a lot of
+ * data is arriving. With DISPATCH_BACKEND_IO_URING, each connection
+ * has a buffer of this size, so it's best kept small when there are
+ * many connections. Datagrams larger than this are dropped.
+ * @return
+ *      0 on success, or -1 if the size isn't reasonable.
+ */
+int
+dispatch_set_recv_size(dispatcher *d, size_t size);
+
 /**
  * Destroy a dispatcher subsystem and free all resources. Pending
  * things will be sent DISPATCH_CLOSE events..
@@ -133,6 +182,12 @@ dispatch_dispatch(dispatcher *d, uint64_t nanoseconds);
 
 /**
  * Start a TCP connection to the target address/port.
+ * @param protocol
+ *      Either 6 for TCP, or 17 for UDP. A UDP socket is "connected"
+ *      immediately, and every DISPATCH_RECEIVED event is one datagram,
+ *      as is every call to dispatch_send_buffered(). Queued datagrams
+ *      are sent in batches each time through dispatch_dispatch(),
+ *      followed by DISPATCH_SENT.
  * @triggers
  *  DISPATCH_ERROR if the connection fails.
  *  DISPATCH_CONNECTING if the connection process started successfully.
@@ -223,6 +278,87 @@ dispatch_getsockname(dispatcher *d, int handle, char *addr, size_t addr_length,
 void
 dispatch_getpeername(dispatcher *d, int handle, char *addr, size_t addr_length, unsigned *port);
 
+/**
+ * A group of dispatchers, each run by its own thread, for using all the
+ * cores on a machine. Each dispatcher has its own sockets and timeouts,
+ * and isn't thread-safe, so a connection is only ever used by the thread
+ * that owns it. Other threads hand it work with dispatch_group_post().
+ */
+struct dispatch_group;
+
+/**
+ * A function to run on a dispatcher's own thread.
+ */
+typedef void (*dispatch_post_fn)(dispatcher *d, void *arg);
+
+/**
+ * Create a group of dispatchers. The threads aren't started until
+ * dispatch_group_start(), so until then, the dispatchers can be set up
+ * from this thread.
+ * @param count
+ *      The number of dispatchers, or 0 for one per CPU.
+ * @param backend
+ *      Such as DISPATCH_BACKEND_DEFAULT, used for all of them.
+ */
+struct dispatch_group *
+dispatch_group_create(unsigned count, int backend);
+
+/**
+ * Stop the threads, if started, and free everything.
+ */
+void
+dispatch_group_destroy(struct dispatch_group *g);
+
+/**
+ * The number of dispatchers in the group.
+ */
+unsigned
+dispatch_group_count(const struct dispatch_group *g);
+
+/**
+ * Get one of the dispatchers. Once the threads are started, this
+ * should only be used by its own thread, or to compare against.
+ */
+dispatcher *
+dispatch_group_get(struct dispatch_group *g, unsigned index);
+
+/**
+ * Listen on the same port with every dispatcher, using SO_REUSEPORT so
+ * that the kernel spreads incoming connections among them. Where that
+ * isn't supported, only the first dispatcher listens. Call this before
+ * dispatch_group_start().
+ * @param port
+ *      The port to listen on, or 0 to choose any, which is then used
+ *      for all of them.
+ * @return
+ *      The port listened on, or -1 on failure.
+ */
+int
+dispatch_group_listen(struct dispatch_group *g, dispatch_callback cb, void *userdata, const char *addr, unsigned port, unsigned protocol);
+
+/**
+ * Run a function on a dispatcher's thread, such as to start a
+ * connection from there. This can be called from any thread, and
+ * doesn't block. Functions posted to the same dispatcher run in the
+ * order they were posted.
+ */
+int
+dispatch_group_post(struct dispatch_group *g, unsigned index, dispatch_post_fn fn, void *arg);
+
+/**
+ * Start a thread for each dispatcher, which dispatches events until
+ * the group is stopped.
+ */
+int
+dispatch_group_start(struct dispatch_group *g);
+
+/**
+ * Stop all the threads, waiting for them to finish. Anything still
+ * open stays open until the group is destroyed.
+ */
+void
+dispatch_group_stop(struct dispatch_group *g);
+
 /**
  * Run a self-test of 
  */
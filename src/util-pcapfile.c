@@ -13,6 +13,10 @@
   may not have libpcap installed, we decode it ourselves in this
   module rather than using the libpcap module.
 
+  Besides the classic format, this reads the variant with nanosecond
+  timestamps, and the newer block-based "pcapng" format. In both cases
+  the timestamps are returned as microseconds.
+
   Also, this has the feature of being able to read corrupted
   files. When it encounters a malformed back (such as one with
   an impossibly large packet), it skips the malformed data and
@@ -30,12 +34,55 @@
 
 #ifdef WIN32
 #define snprintf _snprintf
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(HAVE_LZ4)
+#include <lz4frame.h>
+#endif
 #endif
 
 enum InternalParameters {
     /** The maximum size of a frame within a file. If a frame is larger than this,
      * we'll assume corruption has happened. */
     MAX_FRAME_SIZE = 128 * 1024,
+
+    /** The size of the buffer pcapfile_readframes() reads into, which must
+     * be large enough for the largest frame and its header. */
+    BATCH_BUFFER_SIZE = 256 * 1024,
+
+    /** The maximum size of a pcapng block that we'll read into memory.
+     * Packet blocks larger than this are assumed to be corrupt, while
+     * other large blocks are simply skipped. */
+    PCAPNG_MAX_BLOCK = 2 * MAX_FRAME_SIZE,
+
+    /** The maximum number of interfaces within a pcapng section */
+    PCAPNG_MAX_INTERFACES = 256,
+};
+
+/** The kinds of files we can read */
+enum FileFormat {
+    FORMAT_PCAP,        /* the classic format, with microsecond timestamps */
+    FORMAT_PCAP_NSEC,   /* the same, but with nanosecond timestamps */
+    FORMAT_PCAPNG,      /* the newer block-based format */
+};
+
+/** The pcapng block types that we care about */
+enum PcapngBlockType {
+    PCAPNG_SECTION_HEADER   = 0x0A0D0D0A,
+    PCAPNG_INTERFACE        = 1,
+    PCAPNG_OBSOLETE_PACKET  = 2,
+    PCAPNG_SIMPLE_PACKET    = 3,
+    PCAPNG_ENHANCED_PACKET  = 6,
 };
 
 
@@ -103,6 +150,25 @@ Link-layer type:
 
  */
 
+/**
+ * In pcapng files, each packet refers to an interface described earlier
+ * in the file, which tells us its linktype and how to interpret the
+ * timestamp.
+ */
+struct pcapng_interface_t
+{
+	int linktype;
+
+	/* The timestamp resolution from the [if_tsresol] option, which is
+	 * either 10^-exponent or 2^-exponent seconds, default microseconds */
+	unsigned is_binary;
+	unsigned exponent;
+	uint64_t divisor;
+
+	/* The [if_tsoffset] option, in seconds, normally zero */
+	int64_t offset;
+};
+
 struct pcapfile_ctx_t
 {
 	FILE *fp;
@@ -126,6 +192,36 @@ struct pcapfile_ctx_t
     
     /* The current size of the buffer */
     size_t sizeof_buffer;
+
+    /* When opened with pcapfile_openread_mmap(), the entire file is
+     * mapped into memory, and [bytes_read] is the offset of the next
+     * frame within the mapping. */
+    const unsigned char *map;
+    size_t map_size;
+
+    /* Set by pcapfile_set_range(), no frames starting at or after this
+     * offset are read, or zero to read to the end of the file */
+    uint64_t range_end;
+
+    /* The large buffer used by pcapfile_readframes() when reading with
+     * stdio, holding [batch_length] bytes read from the file, of which
+     * we've consumed up to [batch_offset]. */
+    unsigned char *batch_buffer;
+    size_t batch_offset;
+    size_t batch_length;
+
+    /* Whether this is a classic, nanosecond, or pcapng file */
+    int format;
+
+    /* Set when the file can't seek, such as when it's the output of a
+     * [decompressor] thread */
+    unsigned is_pipe:1;
+    struct pcapfile_decompressor *decompressor;
+
+    /* For pcapng files, the interfaces described so far in the
+     * current section */
+    struct pcapng_interface_t interfaces[PCAPNG_MAX_INTERFACES];
+    unsigned interface_count;
 };
 
 #define CAPFILE_BIGENDIAN		1
@@ -166,12 +262,29 @@ unsigned pcapfile_get_datalink(struct pcapfile_ctx_t *ctx)
 }
 
 
+/**
+ * Whether a timestamp is plausible. Once we know the time of the first
+ * frame in the file, that's within a day before or a year after it,
+ * otherwise it's between 1990 and 2010.
+ */
+static unsigned
+smells_like_valid_time(unsigned secs, time_t start_sec)
+{
+	if (start_sec <= 0)
+		return secs >= 0x26000000 && secs <= 0x50000000;
+	if ((uint64_t)secs + 86400 < (uint64_t)start_sec)
+		return 0;
+	if ((uint64_t)secs > (uint64_t)start_sec + 366 * 86400)
+		return 0;
+	return 1;
+}
+
 /**
  * Determine if the blob (the chunk of from the file read at a certain offset)
  * looks like a valid packet
  */
 static unsigned
-smells_like_valid_packet(const unsigned char *px, unsigned length, unsigned byte_order, unsigned link_type)
+smells_like_valid_packet(const unsigned char *px, unsigned length, unsigned byte_order, unsigned link_type, int format, time_t start_sec)
 {
 	unsigned secs, usecs, original_length, captured_length;
 
@@ -180,29 +293,32 @@ smells_like_valid_packet(const unsigned char *px, unsigned length, unsigned byte
 
 	secs = PCAP32(byte_order, px+0);
 	usecs = PCAP32(byte_order, px+4);
+	if (format == FORMAT_PCAP_NSEC)
+		usecs /= 1000;
 	captured_length = PCAP32(byte_order, px+8);
 	original_length = PCAP32(byte_order, px+12);
 
-	if (secs > 0x50000000) return 0; /* after 2010 */
-	if (secs < 0x26000000) return 0; /* before 1990 */
+	if (!smells_like_valid_time(secs, start_sec)) return 0;
 	if (usecs > 1000000) return 0;
 	if (captured_length > 10000) return 0;
 	if (captured_length < 16) return 0;
 	if (original_length < captured_length) return 0;
 	if (original_length > 10000) return 0;
 
-	if (captured_length + 16 < length) {
+	/* Only check the next header if all 16 bytes of it are within the
+	 * blob, because with a mapped file there is nothing after it */
+	if (captured_length + 32 <= length) {
 		unsigned secs2, usecs2, original_length2, captured_length2;
 		const unsigned char *px2 = px + captured_length + 16;
 
 		secs2 = PCAP32(byte_order, px2+0);
 		usecs2 = PCAP32(byte_order, px2+4);
+		if (format == FORMAT_PCAP_NSEC)
+			usecs2 /= 1000;
 		captured_length2 = PCAP32(byte_order, px2+8);
 		original_length2 = PCAP32(byte_order, px2+12);
 
-		if (secs2 > 0x50000000)
-			return 0;
-		if (secs2 < 0x26000000)
+		if (!smells_like_valid_time(secs2, start_sec))
 			return 0;
 		if (usecs2 > 1000000)
 			return 0;
@@ -228,8 +344,10 @@ smells_like_valid_packet(const unsigned char *px, unsigned length, unsigned byte
 
 unsigned pcapfile_percentdone(struct pcapfile_ctx_t *ctx)
 {
-	if (ctx->fp == NULL)
+	if (ctx->fp == NULL && ctx->map == NULL)
 		return 100;
+	if (ctx->file_size == 0)
+		return 0; /* unknown, such as decompressed files */
 	return (unsigned)(ctx->bytes_read*100/ctx->file_size);
 }
 
@@ -259,6 +377,181 @@ _is_corrupt(size_t captured_length, size_t original_length, time_t secs, long us
     return 0;
 }
 
+/**
+ * Allocate the buffer used by pcapfile_readframes(), which also holds
+ * bytes we've read ahead of the current position in the file.
+ */
+static void
+_batch_alloc(struct pcapfile_ctx_t *ctx)
+{
+	if (ctx->batch_buffer == NULL) {
+		ctx->batch_buffer = malloc(BATCH_BUFFER_SIZE);
+		if (ctx->batch_buffer == NULL)
+			abort();
+	}
+}
+
+/**
+ * If there are bytes in the batch buffer that we've read ahead but not
+ * yet consumed, seek backwards so that the file position is where the
+ * seeking repair logic expects it.
+ */
+static void
+_batch_unread(struct pcapfile_ctx_t *ctx)
+{
+	size_t unread = ctx->batch_length - ctx->batch_offset;
+
+	if (unread)
+		fseek(ctx->fp, -(long)unread, SEEK_CUR);
+	ctx->batch_offset = 0;
+	ctx->batch_length = 0;
+}
+
+/**
+ * Read from the file, first consuming any bytes we've already read
+ * ahead into the batch buffer. All the stdio reads go through this,
+ * so that they work on pipes that can't seek backwards.
+ */
+static size_t
+_read_bytes(struct pcapfile_ctx_t *ctx, void *dst, size_t count)
+{
+	size_t leftover = ctx->batch_length - ctx->batch_offset;
+	size_t n = 0;
+
+	if (leftover) {
+		n = (count < leftover) ? count : leftover;
+		memcpy(dst, ctx->batch_buffer + ctx->batch_offset, n);
+		ctx->batch_offset += n;
+		if (n == count)
+			return n;
+	}
+	ctx->batch_offset = 0;
+	ctx->batch_length = 0;
+	return n + fread((unsigned char *)dst + n, 1, count - n, ctx->fp);
+}
+
+/**
+ * Push bytes back in front of the current position, so that they'll
+ * be read next. The caller must have just read them, so that there's
+ * room for them in the batch buffer.
+ */
+static void
+_unread_bytes(struct pcapfile_ctx_t *ctx, const void *src, size_t count)
+{
+	size_t leftover = ctx->batch_length - ctx->batch_offset;
+
+	_batch_alloc(ctx);
+	if (count <= ctx->batch_offset) {
+		ctx->batch_offset -= count;
+	} else {
+		if (leftover + count > BATCH_BUFFER_SIZE)
+			abort();
+		memmove(ctx->batch_buffer + count, ctx->batch_buffer + ctx->batch_offset, leftover);
+		ctx->batch_offset = 0;
+		ctx->batch_length = count + leftover;
+	}
+	memmove(ctx->batch_buffer + ctx->batch_offset, src, count);
+}
+
+/**
+ * Skip forward in the file, seeking if we can, reading if we can't.
+ * @return
+ *  0 on success, or -1 if we reached the end of the file.
+ */
+static int
+_skip_bytes(struct pcapfile_ctx_t *ctx, uint64_t count)
+{
+	size_t leftover = ctx->batch_length - ctx->batch_offset;
+
+	if (leftover >= count) {
+		ctx->batch_offset += (size_t)count;
+		return 0;
+	}
+	count -= leftover;
+	ctx->batch_offset = 0;
+	ctx->batch_length = 0;
+
+	if (!ctx->is_pipe)
+		return fseek(ctx->fp, (long)count, SEEK_CUR) == 0 ? 0 : -1;
+	while (count) {
+		unsigned char tmp[4096];
+		size_t n = (count < sizeof(tmp)) ? (size_t)count : sizeof(tmp);
+
+		if (fread(tmp, 1, n, ctx->fp) != n)
+			return -1;
+		count -= n;
+	}
+	return 0;
+}
+
+/**
+ * The same as _repair(), but for streams that can't seek, such as the
+ * output of a decompressor. Instead of seeking, we push the bytes after
+ * the good packet back onto the stream. We can only look backwards for
+ * the truncated packet within the bytes read since the corruption.
+ */
+static int
+_repair_stream(struct pcapfile_ctx_t *ctx,
+    time_t *secs,
+    long *usecs,
+    size_t *original_length,
+    size_t *captured_length,
+    const unsigned char **buf
+)
+{
+    for (;;) {
+        unsigned char tmp[4096];
+        size_t bytes_read;
+        size_t i;
+
+        fprintf(stderr, "%s(%u): corruption found at 0x%08llx (%llu)\n",
+            ctx->filename,
+            ctx->frame_number,
+            (unsigned long long)ctx->bytes_read,
+            (unsigned long long)ctx->bytes_read
+            );
+
+        bytes_read = _read_bytes(ctx, tmp, sizeof(tmp));
+        if (bytes_read == 0) {
+            if (ferror(ctx->fp))
+                perror(ctx->filename);
+            else
+                fprintf(stderr, "%s: premature end of file\n", ctx->filename);
+            return -1;
+        }
+
+        for (i=0; i<bytes_read; i++) {
+            size_t j;
+
+            if (!smells_like_valid_packet(tmp+i, (unsigned)(bytes_read - i), ctx->byte_order, ctx->linktype, ctx->format, ctx->start_sec))
+                continue;
+
+            /* Look backwards for a length field pointing forward to
+             * the good packet, as in _repair() */
+            for (j=0; j<2000-16 && j+16 <= i; j++) {
+                if (PCAP32(ctx->byte_order, tmp+i-j-8) != j)
+                    continue;
+                if (smells_like_valid_packet(tmp+i-j-16, (unsigned)(j+16+16), ctx->byte_order, ctx->linktype, ctx->format, ctx->start_sec)) {
+                    i -= j + 16;
+                    break;
+                }
+            }
+
+            _unread_bytes(ctx, tmp + i, bytes_read - i);
+            ctx->bytes_read += i;
+            fprintf(stderr, "%s(%u): good packet found at 0x%08llx\n",
+                ctx->filename,
+                ctx->frame_number,
+                (unsigned long long)ctx->bytes_read
+                );
+            return pcapfile_readframe(ctx, secs, usecs, original_length, captured_length, buf);
+        }
+
+        ctx->bytes_read += bytes_read;
+        fprintf(stderr, "%s: no valid packet found in chunk\n", ctx->filename);
+    }
+}
+
 static int
 _repair(struct pcapfile_ctx_t *ctx,
     time_t *secs,
@@ -320,7 +613,7 @@ _repair(struct pcapfile_ctx_t *ctx,
         for (i=0; i<bytes_read; i++) {
             
             /* Test the current location */
-            if (!smells_like_valid_packet(tmp+i, (unsigned)(bytes_read - i), ctx->byte_order, ctx->linktype))
+            if (!smells_like_valid_packet(tmp+i, (unsigned)(bytes_read - i), ctx->byte_order, ctx->linktype, ctx->format, ctx->start_sec))
                 continue;
 
             /* Woot! We have a non-corrupt packet. Let's now change the
@@ -373,7 +666,7 @@ _repair(struct pcapfile_ctx_t *ctx,
                      * if it also matches. Note that we are checking the
                      * PREVIOUS 16-byte header, PREVIOUS contents, and the
                      * CURRENT 16-byte header */
-                    if (smells_like_valid_packet(tmp+endpoint-j-16, j+16+16, ctx->byte_order, ctx->linktype)) {
+                    if (smells_like_valid_packet(tmp+endpoint-j-16, j+16+16, ctx->byte_order, ctx->linktype, ctx->format, ctx->start_sec)) {
                         /* Woot! We have found a good packet. Let's now use that
                          * as the new location. */
                         fseek(ctx->fp, -(signed)(j+16+16), SEEK_CUR);
@@ -411,16 +704,83 @@ _repair(struct pcapfile_ctx_t *ctx,
 
         /* If we get to this point, we are totally hosed and the corruption
          * is more severe than a few packets. */
-        printf("No valid packet found in chunk\n");
+        fprintf(stderr, "%s: no valid packet found in chunk\n", ctx->filename);
     }
     return -1;
 }
 
 
 /**
- * Read the next packet from the file stream.
+ * The same as _repair(), but for files opened with pcapfile_openread_mmap().
+ * Since the whole file is mapped, we can scan forward and backward with
+ * plain 64-bit offsets rather than seeking.
  */
-int pcapfile_readframe(
+static int
+_repair_mmap(struct pcapfile_ctx_t *ctx,
+    time_t *secs,
+    long *usecs,
+    size_t *original_length,
+    size_t *captured_length,
+    const unsigned char **buf
+)
+{
+    uint64_t offset = ctx->bytes_read + 16;
+    uint64_t i;
+
+    fprintf(stderr, "%s(%u): corruption found at 0x%08llx (%llu)\n",
+        ctx->filename,
+        ctx->frame_number,
+        (unsigned long long)offset,
+        (unsigned long long)offset
+        );
+
+    /* Scan forward (one byte at a time ) looking for a non-corrupt
+     * packet located at that spot */
+    for (i=offset; i<ctx->map_size; i++) {
+        uint64_t remaining = ctx->map_size - i;
+
+        if (remaining > 0xFFFFFFFF)
+            remaining = 0xFFFFFFFF;
+        if (!smells_like_valid_packet(ctx->map + i, (unsigned)remaining, ctx->byte_order, ctx->linktype, ctx->format, ctx->start_sec))
+            continue;
+
+        /* As in _repair(), the corruption is most likely a truncated
+         * PREVIOUS packet, so look backwards for a length field that
+         * points forward to the good packet we just found */
+        if (i >= 2000) {
+            unsigned j;
+
+            for (j=0; j<2000-16; j++) {
+                if (PCAP32(ctx->byte_order, ctx->map+i-j-8) != j)
+                    continue;
+                if (smells_like_valid_packet(ctx->map+i-j-16, j+16+16, ctx->byte_order, ctx->linktype, ctx->format, ctx->start_sec)) {
+                    i -= j + 16;
+                    break;
+                }
+            }
+        }
+
+        fprintf(stderr, "%s(%u): good packet found at 0x%08llx\n",
+            ctx->filename,
+            ctx->frame_number,
+            (unsigned long long)i
+            );
+        ctx->bytes_read = i;
+        return pcapfile_readframe(ctx, secs, usecs, original_length, captured_length, buf);
+    }
+
+    fprintf(stderr, "%s: premature end of file\n", ctx->filename);
+    ctx->bytes_read = ctx->map_size;
+    return -1;
+}
+
+/**
+ * The same as pcapfile_readframe(), but for files opened with
+ * pcapfile_openread_mmap(), returning a pointer into the mapping
+ * rather than copying the frame.
+ */
+static int
+_readframe_mmap(
 	struct pcapfile_ctx_t *ctx,
 	time_t *secs,
 	long *usecs,
@@ -429,156 +789,649 @@ int pcapfile_readframe(
 	const unsigned char **buf
 	)
 {
-	size_t bytes_read;
-	unsigned char header[16];
+	const unsigned char *header;
+	uint64_t remaining = ctx->map_size - ctx->bytes_read;
 	unsigned byte_order = ctx->byte_order;
-	unsigned is_corrupt = 0;
 
-	/* Read in the 16-byte frame header. */
-	bytes_read = fread(header, 1, 16, ctx->fp);
-	if (bytes_read < 16) {
-		if (bytes_read == 0 && ferror(ctx->fp))
-			perror(ctx->filename);
-		else if (bytes_read == 0)
-			; /* normal end-of-file */
-		else
+	/* Stop at the end of the range given to pcapfile_set_range() */
+	if (ctx->range_end && ctx->bytes_read >= ctx->range_end)
+		return -1;
+
+	/* Make sure there's a full 16-byte frame header. */
+	if (remaining < 16) {
+		if (remaining)
 			fprintf(stderr, "%s: premature end-of-file\n", ctx->filename);
+		ctx->bytes_read = ctx->map_size;
 		return -1;
 	}
-	ctx->bytes_read += bytes_read;
+	header = ctx->map + ctx->bytes_read;
 
 	/* Parse the frame header into its four fields */
 	*secs = PCAP32(byte_order, header);
 	*usecs = PCAP32(byte_order, header+4);
+	if (ctx->format == FORMAT_PCAP_NSEC)
+		*usecs /= 1000;
 	*r_captured_length = PCAP32(byte_order, header+8);
 	*r_original_length = PCAP32(byte_order, header+12);
 
-
 	/* Test the frame heade fields to make sure they are sane */
-    is_corrupt = _is_corrupt(*r_captured_length, *r_original_length, *secs, *usecs);
-    if (is_corrupt)
-        return _repair(ctx, secs, usecs, r_original_length, r_captured_length, buf);
-
-    /* Sometimes packets are timestamped oddly, with slightly more than a
-     * million microseconds, in which case we need to repair this */
-    if (*usecs > 1000000) {
-        *secs += 1;
-        *usecs -= 1000000;
-    }
-    
-    /* Make sure we have a big enough buffer to read the packet. Our strategy
-     * is to use the realloc() function to keep expanding the memory. Note that
-     * we've validated this length field is reasonable, and not askign for
-     * gigabytes, with the corruption check above */
-    if (ctx->sizeof_buffer < *r_captured_length) {
-        ctx->sizeof_buffer = *r_captured_length;
-        ctx->frame_buffer = realloc(ctx->frame_buffer, *r_captured_length);
-        if (ctx->frame_buffer == NULL)
-            abort();
-    }
+	if (_is_corrupt(*r_captured_length, *r_original_length, *secs, *usecs))
+		return _repair_mmap(ctx, secs, usecs, r_original_length, r_captured_length, buf);
 
-    /* Return the internal frame buffer as the external pointer the
-     * caller will access */
-    *buf = ctx->frame_buffer;
+	if (*usecs > 1000000) {
+		*secs += 1;
+		*usecs -= 1000000;
+	}
 
-	/*
-	 * Read the packet data
-	 */
-	bytes_read = fread(ctx->frame_buffer, 1, *r_captured_length, ctx->fp);
-	if (bytes_read < *r_captured_length) {
-		if (bytes_read < 0)
-			perror(ctx->filename);
-		else
-			fprintf(stderr, "%s: premature end of file\n", ctx->filename);
-		return -1; /* fail */
+	if (*r_captured_length > remaining - 16) {
+		fprintf(stderr, "%s: premature end of file\n", ctx->filename);
+		ctx->bytes_read = ctx->map_size;
+		return -1;
 	}
-    
-	ctx->bytes_read += bytes_read;
+
+	*buf = header + 16;
+	ctx->bytes_read += 16 + *r_captured_length;
 	ctx->frame_number++;
 	return 0; /* success */
 }
 
-
 /**
- * Open a capture file for reading.
+ * Convert a pcapng timestamp, in the units of the interface, into
+ * seconds and microseconds.
  */
-struct pcapfile_ctx_t *
-pcapfile_openread(const char *filename, int *out_linktype, time_t *secs, long *usecs)
+static void
+_pcapng_timestamp(const struct pcapng_interface_t *iface, uint64_t timestamp, time_t *secs, long *usecs)
 {
-	FILE *fp;
-	ptrdiff_t bytes_read;
-	unsigned char buf[24];
-	unsigned byte_order;
-	unsigned linktype;
-	uint64_t file_size = 0xFFFFffff;
-    struct pcapfile_ctx_t *ctx = 0;
+	uint64_t fraction;
 
-	if (filename == NULL)
-		return NULL;
+	if (iface->is_binary) {
+		unsigned shift = iface->exponent;
 
-	/* Grab info about the file */
-	{
-		struct stat s;
-		memset(&s, 0, sizeof(s));
-		if (stat(filename, &s) == 0) {
-			file_size = s.st_size;
+		*secs = (time_t)(timestamp >> shift);
+		fraction = timestamp & ((1ULL << shift) - 1);
+
+		/* Drop precision we can't use, so the multiply can't overflow */
+		if (shift > 40) {
+			fraction >>= shift - 40;
+			shift = 40;
 		}
+		*usecs = (long)((fraction * 1000000) >> shift);
+	} else {
+		*secs = (time_t)(timestamp / iface->divisor);
+		fraction = timestamp % iface->divisor;
+		if (iface->divisor >= 1000000)
+			*usecs = (long)(fraction / (iface->divisor / 1000000));
+		else
+			*usecs = (long)(fraction * (1000000 / iface->divisor));
 	}
+	*secs += (time_t)iface->offset;
+}
 
+/**
+ * Parse an Interface Description Block, adding it to our list of
+ * interfaces for the current section.
+ */
+static void
+_pcapng_add_interface(struct pcapfile_ctx_t *ctx, const unsigned char *body, size_t body_length)
+{
+	struct pcapng_interface_t *iface;
+	unsigned byte_order = ctx->byte_order;
+	size_t offset = 8;
 
-	/* 
-	 * Open the file 
-	 */
-	fp = fopen(filename, "rb");
-	if (fp == NULL) {
-		perror(filename);
-		return NULL;
-	}
-
-	/*
-	 * Read in the file header
-	 */
-	bytes_read = fread(buf, 1, 24, fp);
-	if (bytes_read < 24) {
-		if (bytes_read < 0)
-			perror(filename);
-		else if (bytes_read == 0)
-			fprintf(stderr, "%s: file empty\n", filename);
-		else
-			fprintf(stderr, "%s: file too short\n", filename);
-		fclose(fp);
-		return NULL;
+	if (body_length < 8) {
+		fprintf(stderr, "%s(%u): corrupt interface block\n", ctx->filename, ctx->frame_number);
+		return;
 	}
-
-	/*
-	 * Find the "Magic Number", which will tell us what the byte-order
-	 * is going to be. There are also odd magic number used by some
-	 * speciality systems that hint at other features, such as a 64-bit
-	 * version of the file.
-	 */
-	switch ((unsigned)buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3]) {
-	case 0xa1b2c3d4:	byte_order = CAPFILE_BIGENDIAN; break;
-	case 0xd4c3b2a1:	byte_order = CAPFILE_LITTLEENDIAN; break;
-	default:
-		fprintf(stderr, "%s: unknown byte-order in cap file: 0x%08x\n", filename, (unsigned)buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3]);
-		byte_order = CAPFILE_ENDIANUNKNOWN; break;
+	if (ctx->interface_count >= PCAPNG_MAX_INTERFACES) {
+		fprintf(stderr, "%s(%u): too many interfaces\n", ctx->filename, ctx->frame_number);
+		return;
 	}
 
+	iface = &ctx->interfaces[ctx->interface_count++];
+	iface->linktype = PCAP16(byte_order, body);
+	iface->is_binary = 0;
+	iface->exponent = 6;
+	iface->divisor = 1000000;
+	iface->offset = 0;
+
+	/* Parse the options, which are 4-byte aligned TLVs */
+	while (offset + 4 <= body_length) {
+		unsigned code = PCAP16(byte_order, body + offset);
+		unsigned length = PCAP16(byte_order, body + offset + 2);
+		const unsigned char *value = body + offset + 4;
+
+		if (code == 0 || offset + 4 + length > body_length)
+			break; /* opt_endofopt */
+
+		if (code == 9 && length >= 1) {
+			/* if_tsresol */
+			unsigned is_binary = (value[0] & 0x80) != 0;
+			unsigned exponent = value[0] & 0x7F;
+
+			if ((is_binary && exponent > 63) || (!is_binary && exponent > 19))
+				fprintf(stderr, "%s: unsupported timestamp resolution 0x%02x\n", ctx->filename, value[0]);
+			else {
+				iface->is_binary = is_binary;
+				iface->exponent = exponent;
+				iface->divisor = 1;
+				while (!is_binary && exponent--)
+					iface->divisor *= 10;
+			}
+		} else if (code == 14 && length >= 8) {
+			/* if_tsoffset */
+			iface->offset = (int64_t)((uint64_t)PCAP32(byte_order, value) << 32 | PCAP32(byte_order, value + 4));
+		}
 
-	/* Version (of the libpcap standard) */
-	{
-		unsigned major = PCAP16(byte_order, buf+4);
-		unsigned minor = PCAP16(byte_order, buf+6);
-		
-		if (major != 2 || minor != 4)
-			fprintf(stderr, "%s: unknown version %d.%d\n", filename, major, minor);
+		offset += 4 + ((length + 3) & ~3U);
+	}
+}
+
+/**
+ * Read the next pcapng block, returning its type and its body, which
+ * is everything after the 8-byte type and length fields (including the
+ * trailing copy of the length). In a mapped file, the body points into
+ * the mapping. Otherwise, it's read into the same frame buffer that
+ * classic frames use, which only grows when a block is larger than
+ * any before it.
+ * @return
+ *  0 on success, or -1 at the end of the file or on an error.
+ */
+static int
+_pcapng_next_block(struct pcapfile_ctx_t *ctx, unsigned *r_type, const unsigned char **r_body, size_t *r_body_length)
+{
+	for (;;) {
+		unsigned char header[12];
+		const unsigned char *px;
+		size_t header_length = 8;
+		size_t bytes_read;
+		unsigned type;
+		unsigned block_length;
+		uint64_t remaining = 0;
+
+		if (ctx->map) {
+			remaining = ctx->map_size - ctx->bytes_read;
+			if (remaining < 12) {
+				if (remaining)
+					fprintf(stderr, "%s: premature end-of-file\n", ctx->filename);
+				ctx->bytes_read = ctx->map_size;
+				return -1;
+			}
+			px = ctx->map + ctx->bytes_read;
+		} else {
+			bytes_read = _read_bytes(ctx, header, 8);
+			if (bytes_read < 8) {
+				if (bytes_read == 0 && ferror(ctx->fp))
+					perror(ctx->filename);
+				else if (bytes_read != 0)
+					fprintf(stderr, "%s: premature end-of-file\n", ctx->filename);
+				return -1;
+			}
+			px = header;
+		}
+
+		/* A Section Header Block has the same type in either byte order,
+		 * and starts with a magic number telling us the byte order of
+		 * the rest of the section. Interfaces are numbered per section. */
+		if (memcmp(px, "\x0a\x0d\x0d\x0a", 4) == 0) {
+			if (ctx->map == NULL) {
+				if (_read_bytes(ctx, header + 8, 4) != 4) {
+					fprintf(stderr, "%s: premature end-of-file\n", ctx->filename);
+					return -1;
+				}
+				header_length = 12;
+			}
+			switch ((unsigned)px[8]<<24 | px[9]<<16 | px[10]<<8 | px[11]) {
+			case 0x1a2b3c4d:	ctx->byte_order = CAPFILE_BIGENDIAN; break;
+			case 0x4d3c2b1a:	ctx->byte_order = CAPFILE_LITTLEENDIAN; break;
+			default:
+				fprintf(stderr, "%s: unknown byte-order in pcapng section\n", ctx->filename);
+				return -1;
+			}
+			ctx->interface_count = 0;
+		}
+
+		type = PCAP32(ctx->byte_order, px);
+		block_length = PCAP32(ctx->byte_order, px + 4);
+		if (block_length < 12 || (block_length & 3)) {
+			fprintf(stderr, "%s(%u): corrupt block length %u\n", ctx->filename, ctx->frame_number, block_length);
+			return -1;
+		}
+		if (ctx->map && block_length > remaining) {
+			fprintf(stderr, "%s: premature end-of-file\n", ctx->filename);
+			ctx->bytes_read = ctx->map_size;
+			return -1;
+		}
+
+		/* Skip huge blocks that we don't care about anyway */
+		if (block_length > PCAPNG_MAX_BLOCK) {
+			switch (type) {
+			case PCAPNG_SECTION_HEADER:
+			case PCAPNG_INTERFACE:
+			case PCAPNG_OBSOLETE_PACKET:
+			case PCAPNG_SIMPLE_PACKET:
+			case PCAPNG_ENHANCED_PACKET:
+				fprintf(stderr, "%s(%u): corrupt block length %u\n", ctx->filename, ctx->frame_number, block_length);
+				return -1;
+			}
+			if (ctx->map == NULL && _skip_bytes(ctx, block_length - header_length) != 0) {
+				fprintf(stderr, "%s: premature end-of-file\n", ctx->filename);
+				return -1;
+			}
+			ctx->bytes_read += block_length;
+			continue;
+		}
+
+		*r_type = type;
+		*r_body_length = block_length - 8;
+		if (ctx->map) {
+			*r_body = px + 8;
+		} else {
+			if (ctx->sizeof_buffer < *r_body_length) {
+				ctx->sizeof_buffer = *r_body_length;
+				ctx->frame_buffer = realloc(ctx->frame_buffer, *r_body_length);
+				if (ctx->frame_buffer == NULL)
+					abort();
+			}
+			memcpy(ctx->frame_buffer, header + 8, header_length - 8);
+			bytes_read = _read_bytes(ctx, ctx->frame_buffer + header_length - 8, block_length - header_length);
+			if (bytes_read < block_length - header_length) {
+				fprintf(stderr, "%s: premature end-of-file\n", ctx->filename);
+				return -1;
+			}
+			*r_body = ctx->frame_buffer;
+		}
+		ctx->bytes_read += block_length;
+		return 0;
+	}
+}
+
+/**
+ * The same as pcapfile_readframe(), but for pcapng files. Blocks other
+ * than packets are processed (or skipped) until we find the next packet.
+ */
+static int
+_readframe_pcapng(
+	struct pcapfile_ctx_t *ctx,
+	time_t *secs,
+	long *usecs,
+	size_t *r_original_length,
+	size_t *r_captured_length,
+	const unsigned char **buf
+	)
+{
+	for (;;) {
+		unsigned type;
+		const unsigned char *body;
+		size_t body_length;
+		unsigned byte_order;
+		unsigned interface_id;
+		uint64_t timestamp;
+		size_t offset;
+
+		if (_pcapng_next_block(ctx, &type, &body, &body_length) != 0)
+			return -1;
+		body_length -= 4; /* the trailing length field */
+		byte_order = ctx->byte_order;
+
+		switch (type) {
+		case PCAPNG_SECTION_HEADER:
+			if (body_length < 16 || PCAP16(byte_order, body + 4) != 1)
+				fprintf(stderr, "%s: unknown pcapng version\n", ctx->filename);
+			continue;
+		case PCAPNG_INTERFACE:
+			_pcapng_add_interface(ctx, body, body_length);
+			continue;
+		case PCAPNG_ENHANCED_PACKET:
+		case PCAPNG_OBSOLETE_PACKET:
+			if (body_length < 20) {
+				fprintf(stderr, "%s(%u): corrupt packet block\n", ctx->filename, ctx->frame_number);
+				continue;
+			}
+			if (type == PCAPNG_ENHANCED_PACKET)
+				interface_id = PCAP32(byte_order, body);
+			else
+				interface_id = PCAP16(byte_order, body);
+			timestamp = (uint64_t)PCAP32(byte_order, body + 4) << 32 | PCAP32(byte_order, body + 8);
+			*r_captured_length = PCAP32(byte_order, body + 12);
+			*r_original_length = PCAP32(byte_order, body + 16);
+			offset = 20;
+			break;
+		case PCAPNG_SIMPLE_PACKET:
+			/* No timestamp, always the first interface, and the captured
+			 * length is however much fits in the block */
+			if (body_length < 4) {
+				fprintf(stderr, "%s(%u): corrupt packet block\n", ctx->filename, ctx->frame_number);
+				continue;
+			}
+			interface_id = 0;
+			timestamp = 0;
+			*r_original_length = PCAP32(byte_order, body);
+			*r_captured_length = body_length - 4;
+			if (*r_captured_length > *r_original_length)
+				*r_captured_length = *r_original_length;
+			offset = 4;
+			break;
+		default:
+			/* Name resolution, statistics, and so on */
+			continue;
+		}
+
+		if (*r_captured_length > body_length - offset) {
+			fprintf(stderr, "%s(%u): corrupt packet block\n", ctx->filename, ctx->frame_number);
+			continue;
+		}
+		if (interface_id >= ctx->interface_count) {
+			fprintf(stderr, "%s(%u): unknown interface %u\n", ctx->filename, ctx->frame_number, interface_id);
+			continue;
+		}
+
+		_pcapng_timestamp(&ctx->interfaces[interface_id], timestamp, secs, usecs);
+		ctx->linktype = ctx->interfaces[interface_id].linktype;
+		*buf = body + offset;
+		ctx->frame_number++;
+		return 0;
+	}
+}
+
+/**
+ * Parse as many complete frames as possible out of a buffer. This is
+ * the fast path for pcapfile_readframes(), and it stops at the first
+ * frame that's incomplete, or whose header is in any way unusual. Those
+ * are left to pcapfile_readframe(), which knows how to fix timestamps
+ * and repair corruption. Only frames that start within the first
+ * [limit] bytes are parsed, though they may extend past it.
+ * @return
+ *      The number of frames, with [r_consumed] set to the number of
+ *      bytes they took up, and [r_is_unusual] set if we stopped at an
+ *      unusual frame rather than an incomplete one.
+ */
+static size_t
+_parse_frames(struct pcapfile_ctx_t *ctx, const unsigned char *px, size_t length, size_t limit,
+	struct pcapframe_t *frames, size_t max, size_t *r_consumed, unsigned *r_is_unusual)
+{
+	size_t offset = 0;
+	size_t count = 0;
+	unsigned is_big = (ctx->byte_order == CAPFILE_BIGENDIAN);
+	unsigned is_nsec = (ctx->format == FORMAT_PCAP_NSEC);
+
+	*r_is_unusual = 0;
+	if (ctx->byte_order != CAPFILE_BIGENDIAN && ctx->byte_order != CAPFILE_LITTLEENDIAN) {
+		*r_is_unusual = 1;
+		max = 0;
+	}
+
+	while (count < max && offset < limit && length - offset >= 16) {
+		const unsigned char *header = px + offset;
+		unsigned secs, usecs, captured_length, original_length;
+		unsigned is_unusual;
+
+		if (is_big) {
+			secs = (unsigned)header[0]<<24 | header[1]<<16 | header[2]<<8 | header[3];
+			usecs = (unsigned)header[4]<<24 | header[5]<<16 | header[6]<<8 | header[7];
+			captured_length = (unsigned)header[8]<<24 | header[9]<<16 | header[10]<<8 | header[11];
+			original_length = (unsigned)header[12]<<24 | header[13]<<16 | header[14]<<8 | header[15];
+		} else {
+			secs = (unsigned)header[3]<<24 | header[2]<<16 | header[1]<<8 | header[0];
+			usecs = (unsigned)header[7]<<24 | header[6]<<16 | header[5]<<8 | header[4];
+			captured_length = (unsigned)header[11]<<24 | header[10]<<16 | header[9]<<8 | header[8];
+			original_length = (unsigned)header[15]<<24 | header[14]<<16 | header[13]<<8 | header[12];
+		}
+		if (is_nsec)
+			usecs /= 1000;
+
+		/* The same tests as _is_corrupt(), plus the timestamp fix in
+		 * pcapfile_readframe(), combined so there's only one branch */
+		is_unusual = (usecs > 1000000)
+			| (original_length > MAX_FRAME_SIZE)
+			| (original_length < captured_length)
+			| (original_length < 8);
+		if (is_unusual) {
+			*r_is_unusual = 1;
+			break;
+		}
+		if (length - offset - 16 < captured_length)
+			break;
+
+		frames[count].secs = secs;
+		frames[count].usecs = usecs;
+		frames[count].original_length = original_length;
+		frames[count].captured_length = captured_length;
+		frames[count].buf = header + 16;
+		frames[count].linktype = ctx->linktype;
+		count++;
+		offset += 16 + captured_length;
+	}
+
+	*r_consumed = offset;
+	return count;
+}
+
+size_t
+pcapfile_readframes(struct pcapfile_ctx_t *ctx, struct pcapframe_t *frames, size_t max)
+{
+	size_t count = 0;
+	size_t consumed;
+	unsigned is_unusual;
+	int err;
+
+	if (ctx == NULL || max == 0)
+		return 0;
+
+	if (ctx->format == FORMAT_PCAPNG) {
+		/* Blocks are read one at a time into the frame buffer, unless
+		 * the file is mapped, in which case they can be batched */
+		if (ctx->map == NULL)
+			max = 1;
+		for (count = 0; count < max; count++) {
+			struct pcapframe_t *frame = &frames[count];
+
+			err = _readframe_pcapng(ctx, &frame->secs, &frame->usecs,
+					&frame->original_length, &frame->captured_length, &frame->buf);
+			if (err)
+				break;
+			frame->linktype = ctx->linktype;
+		}
+		return count;
+	}
+
+	if (ctx->map) {
+		/* The entire file is already in memory, and we only parse
+		 * frames that start before the end of the range */
+		size_t limit = ctx->map_size - ctx->bytes_read;
+
+		if (ctx->range_end) {
+			if (ctx->bytes_read >= ctx->range_end)
+				return 0;
+			if (ctx->range_end - ctx->bytes_read < limit)
+				limit = (size_t)(ctx->range_end - ctx->bytes_read);
+		}
+		count = _parse_frames(ctx, ctx->map + ctx->bytes_read, ctx->map_size - ctx->bytes_read, limit,
+				frames, max, &consumed, &is_unusual);
+		ctx->bytes_read += consumed;
+	} else if (ctx->fp) {
+		_batch_alloc(ctx);
+
+		for (;;) {
+			size_t bytes_read;
+
+			count = _parse_frames(ctx, ctx->batch_buffer + ctx->batch_offset,
+					ctx->batch_length - ctx->batch_offset, ~(size_t)0,
+					frames, max, &consumed, &is_unusual);
+			ctx->batch_offset += consumed;
+			ctx->bytes_read += consumed;
+			if (count || is_unusual)
+				break;
+
+			/* We stopped at an incomplete frame at the end of the buffer,
+			 * so move it to the start and read more of the file after it.
+			 * Every valid frame fits within the buffer. */
+			memmove(ctx->batch_buffer, ctx->batch_buffer + ctx->batch_offset,
+					ctx->batch_length - ctx->batch_offset);
+			ctx->batch_length -= ctx->batch_offset;
+			ctx->batch_offset = 0;
+			bytes_read = fread(ctx->batch_buffer + ctx->batch_length, 1,
+					BATCH_BUFFER_SIZE - ctx->batch_length, ctx->fp);
+			if (bytes_read == 0)
+				break;
+			ctx->batch_length += bytes_read;
+		}
+	}
+	ctx->frame_number += (int)count;
+	if (count)
+		return count;
+
+	/* The next frame is unusual, corrupt, or we've reached the end of
+	 * the file, so let the single-frame function deal with it */
+	err = pcapfile_readframe(ctx, &frames[0].secs, &frames[0].usecs,
+			&frames[0].original_length, &frames[0].captured_length, &frames[0].buf);
+	if (err)
+		return 0;
+	frames[0].linktype = ctx->linktype;
+	return 1;
+}
+
+/**
+ * Read the next packet from the file stream.
+ */
+int pcapfile_readframe(
+	struct pcapfile_ctx_t *ctx,
+	time_t *secs,
+	long *usecs,
+	size_t *r_original_length,
+	size_t *r_captured_length,
+	const unsigned char **buf
+	)
+{
+	size_t bytes_read;
+	unsigned char header[16];
+	unsigned byte_order = ctx->byte_order;
+	unsigned is_corrupt = 0;
+
+	if (ctx->format == FORMAT_PCAPNG)
+		return _readframe_pcapng(ctx, secs, usecs, r_original_length, r_captured_length, buf);
+	if (ctx->map)
+		return _readframe_mmap(ctx, secs, usecs, r_original_length, r_captured_length, buf);
+
+	/* Read in the 16-byte frame header. */
+	bytes_read = _read_bytes(ctx, header, 16);
+	if (bytes_read < 16) {
+		if (bytes_read == 0 && ferror(ctx->fp))
+			perror(ctx->filename);
+		else if (bytes_read == 0)
+			; /* normal end-of-file */
+		else
+			fprintf(stderr, "%s: premature end-of-file\n", ctx->filename);
+		return -1;
+	}
+	ctx->bytes_read += bytes_read;
+
+	/* Parse the frame header into its four fields */
+	*secs = PCAP32(byte_order, header);
+	*usecs = PCAP32(byte_order, header+4);
+	if (ctx->format == FORMAT_PCAP_NSEC)
+		*usecs /= 1000;
+	*r_captured_length = PCAP32(byte_order, header+8);
+	*r_original_length = PCAP32(byte_order, header+12);
+
+
+	/* Test the frame heade fields to make sure they are sane */
+    is_corrupt = _is_corrupt(*r_captured_length, *r_original_length, *secs, *usecs);
+    if (is_corrupt && ctx->is_pipe)
+        return _repair_stream(ctx, secs, usecs, r_original_length, r_captured_length, buf);
+    if (is_corrupt) {
+        _batch_unread(ctx);
+        return _repair(ctx, secs, usecs, r_original_length, r_captured_length, buf);
+    }
+
+    /* Sometimes packets are timestamped oddly, with slightly more than a
+     * million microseconds, in which case we need to repair this */
+    if (*usecs > 1000000) {
+        *secs += 1;
+        *usecs -= 1000000;
+    }
+    
+    /* Make sure we have a big enough buffer to read the packet. Our strategy
+     * is to use the realloc() function to keep expanding the memory. Note that
+     * we've validated this length field is reasonable, and not askign for
+     * gigabytes, with the corruption check above */
+    if (ctx->sizeof_buffer < *r_captured_length) {
+        ctx->sizeof_buffer = *r_captured_length;
+        ctx->frame_buffer = realloc(ctx->frame_buffer, *r_captured_length);
+        if (ctx->frame_buffer == NULL)
+            abort();
+    }
+
+    /* Return the internal frame buffer as the external pointer the
+     * caller will access */
+    *buf = ctx->frame_buffer;
+
+	/*
+	 * Read the packet data
+	 */
+	bytes_read = _read_bytes(ctx, ctx->frame_buffer, *r_captured_length);
+	if (bytes_read < *r_captured_length) {
+		if (bytes_read < 0)
+			perror(ctx->filename);
+		else
+			fprintf(stderr, "%s: premature end of file\n", ctx->filename);
+		return -1; /* fail */
+	}
+    
+	ctx->bytes_read += bytes_read;
+	ctx->frame_number++;
+	return 0; /* success */
+}
+
+
+/**
+ * Parse the 24-byte file header, returning the linktype, and the
+ * byte-order in [r_byte_order]. Problems are printed, but aren't
+ * fatal, as we may still be able to read the file.
+ */
+static unsigned
+_parse_file_header(const char *filename, const unsigned char *buf, unsigned *r_byte_order, int *r_format)
+{
+	unsigned byte_order;
+	unsigned linktype;
+
+	*r_format = FORMAT_PCAP;
+
+	/*
+	 * Find the "Magic Number", which will tell us what the byte-order
+	 * is going to be. There are also odd magic number used by some
+	 * speciality systems that hint at other features, such as a 64-bit
+	 * version of the file.
+	 */
+	switch ((unsigned)buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3]) {
+	case 0xa1b2c3d4:	byte_order = CAPFILE_BIGENDIAN; break;
+	case 0xd4c3b2a1:	byte_order = CAPFILE_LITTLEENDIAN; break;
+	case 0xa1b23c4d:	byte_order = CAPFILE_BIGENDIAN; *r_format = FORMAT_PCAP_NSEC; break;
+	case 0x4d3cb2a1:	byte_order = CAPFILE_LITTLEENDIAN; *r_format = FORMAT_PCAP_NSEC; break;
+	case 0x0a0d0d0a:
+		/* A pcapng Section Header Block. The byte-order and linktypes
+		 * are parsed from the blocks as we read them. */
+		*r_format = FORMAT_PCAPNG;
+		*r_byte_order = CAPFILE_ENDIANUNKNOWN;
+		return 0;
+	default:
+		fprintf(stderr, "%s: unknown byte-order in cap file: 0x%08x\n", filename, (unsigned)buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3]);
+		byte_order = CAPFILE_ENDIANUNKNOWN; break;
+	}
+
+
+	/* Version (of the libpcap standard) */
+	{
+		unsigned major = PCAP16(byte_order, buf+4);
+		unsigned minor = PCAP16(byte_order, buf+6);
+		
+		if (major != 2 || minor != 4)
+			fprintf(stderr, "%s: unknown version %d.%d\n", filename, major, minor);
 	}
 
 	/* Protocol (ethernet, wifi, etc.) */
 	linktype = PCAP32(byte_order, buf+20);
 	if (linktype == 0)
 		linktype = 1;
-    *out_linktype = linktype;
 	switch (linktype) {
 	case 0x7f:	/* WiFi, with radiotap headers */
 	case 1:		/*ethernet*/
@@ -590,6 +1443,396 @@ pcapfile_openread(const char *filename, int *out_linktype, time_t *secs, long *u
 		break;
 	}
 
+	*r_byte_order = byte_order;
+	return linktype;
+}
+
+enum {
+	COMPRESS_NONE,
+	COMPRESS_GZIP,
+	COMPRESS_ZSTD,
+	COMPRESS_LZ4,
+};
+static const char *compress_names[] = {"none", "gzip", "zstd", "lz4"};
+
+/**
+ * If the file starts with the magic number of a compression format,
+ * return which one, or COMPRESS_NONE if it isn't compressed.
+ */
+static int
+_compressed_format(const unsigned char *buf, size_t length)
+{
+	if (length >= 2 && memcmp(buf, "\x1f\x8b", 2) == 0)
+		return COMPRESS_GZIP;
+	if (length >= 4 && memcmp(buf, "\x28\xb5\x2f\xfd", 4) == 0)
+		return COMPRESS_ZSTD;
+	if (length >= 4 && memcmp(buf, "\x04\x22\x4d\x18", 4) == 0)
+		return COMPRESS_LZ4;
+	return COMPRESS_NONE;
+}
+
+#ifndef WIN32
+/**
+ * A thread that reads the compressed file and writes the decompressed
+ * bytes into a socket, which we read from as if it were a pipe. This way
+ * decompression runs on another core in parallel with our parsing, with
+ * the socket buffering between the two. gzip uses zlib, which is always
+ * available, while zstd and lz4 need to be built with HAVE_ZSTD or
+ * HAVE_LZ4 and linked with their libraries.
+ */
+struct pcapfile_decompressor
+{
+	int format;
+	int fd_in;
+	int fd_out;
+	char filename[256];
+	pthread_t thread;
+};
+
+enum {
+	DECOMPRESS_BUFFER_SIZE = 128 * 1024,
+};
+
+/**
+ * Write all the decompressed bytes to the socket.
+ * @return
+ *  0 on success, or -1 if the reader has gone away, such as when the
+ *  file is closed before reaching the end.
+ */
+static int
+_decompress_write(struct pcapfile_decompressor *d, const void *buf, size_t length)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+
+	while (length) {
+		ssize_t n = send(d->fd_out, p, length, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		length -= (size_t)n;
+	}
+	return 0;
+}
+
+static void
+_decompress_gzip(struct pcapfile_decompressor *d, unsigned char *out)
+{
+	gzFile gz;
+	int n;
+
+	gz = gzdopen(d->fd_in, "rb");
+	if (gz == NULL) {
+		fprintf(stderr, "%s: %s: out of memory\n", d->filename, compress_names[d->format]);
+		close(d->fd_in);
+		return;
+	}
+	gzbuffer(gz, DECOMPRESS_BUFFER_SIZE);
+
+	/* This also continues through concatenated gzip files, the same
+	 * as `gzip -dc` does */
+	while ((n = gzread(gz, out, DECOMPRESS_BUFFER_SIZE)) > 0) {
+		if (_decompress_write(d, out, (size_t)n) != 0)
+			break;
+	}
+
+	/* A truncated file isn't an error from gzread(), only from gzerror() */
+	if (n <= 0) {
+		int errnum;
+		const char *msg = gzerror(gz, &errnum);
+		if (errnum != Z_OK)
+			fprintf(stderr, "%s: %s: %s\n", d->filename, compress_names[d->format], msg);
+	}
+	gzclose(gz);
+}
+
+#if defined(HAVE_ZSTD)
+static void
+_decompress_zstd(struct pcapfile_decompressor *d, unsigned char *out)
+{
+	ZSTD_DStream *zds;
+	unsigned char *in;
+	ssize_t count;
+
+	zds = ZSTD_createDStream();
+	in = malloc(DECOMPRESS_BUFFER_SIZE);
+	if (zds == NULL || in == NULL) {
+		fprintf(stderr, "%s: %s: out of memory\n", d->filename, compress_names[d->format]);
+		goto end;
+	}
+	ZSTD_initDStream(zds);
+
+	while ((count = read(d->fd_in, in, DECOMPRESS_BUFFER_SIZE)) > 0) {
+		ZSTD_inBuffer input = {in, (size_t)count, 0};
+
+		while (input.pos < input.size) {
+			ZSTD_outBuffer output = {out, DECOMPRESS_BUFFER_SIZE, 0};
+			size_t err;
+
+			err = ZSTD_decompressStream(zds, &output, &input);
+			if (ZSTD_isError(err)) {
+				fprintf(stderr, "%s: %s: %s\n", d->filename, compress_names[d->format], ZSTD_getErrorName(err));
+				goto end;
+			}
+			if (_decompress_write(d, out, output.pos) != 0)
+				goto end;
+		}
+	}
+	if (count < 0)
+		fprintf(stderr, "%s: %s\n", d->filename, strerror(errno));
+end:
+	ZSTD_freeDStream(zds);
+	free(in);
+	close(d->fd_in);
+}
+#endif
+
+#if defined(HAVE_LZ4)
+static void
+_decompress_lz4(struct pcapfile_decompressor *d, unsigned char *out)
+{
+	LZ4F_dctx *dctx = NULL;
+	unsigned char *in;
+	ssize_t count;
+
+	in = malloc(DECOMPRESS_BUFFER_SIZE);
+	if (in == NULL || LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+		fprintf(stderr, "%s: %s: out of memory\n", d->filename, compress_names[d->format]);
+		goto end;
+	}
+
+	while ((count = read(d->fd_in, in, DECOMPRESS_BUFFER_SIZE)) > 0) {
+		size_t offset = 0;
+
+		while (offset < (size_t)count) {
+			size_t in_length = (size_t)count - offset;
+			size_t out_length = DECOMPRESS_BUFFER_SIZE;
+			size_t err;
+
+			err = LZ4F_decompress(dctx, out, &out_length, in + offset, &in_length, NULL);
+			if (LZ4F_isError(err)) {
+				fprintf(stderr, "%s: %s: %s\n", d->filename, compress_names[d->format], LZ4F_getErrorName(err));
+				goto end;
+			}
+			offset += in_length;
+			if (_decompress_write(d, out, out_length) != 0)
+				goto end;
+		}
+	}
+	if (count < 0)
+		fprintf(stderr, "%s: %s\n", d->filename, strerror(errno));
+end:
+	LZ4F_freeDecompressionContext(dctx);
+	free(in);
+	close(d->fd_in);
+}
+#endif
+
+static void *
+_decompress_thread(void *v)
+{
+	struct pcapfile_decompressor *d = (struct pcapfile_decompressor *)v;
+	unsigned char *out;
+
+	out = malloc(DECOMPRESS_BUFFER_SIZE);
+	if (out == NULL) {
+		fprintf(stderr, "%s: out of memory\n", d->filename);
+		close(d->fd_in);
+	} else if (d->format == COMPRESS_GZIP)
+		_decompress_gzip(d, out);
+#if defined(HAVE_ZSTD)
+	else if (d->format == COMPRESS_ZSTD)
+		_decompress_zstd(d, out);
+#endif
+#if defined(HAVE_LZ4)
+	else if (d->format == COMPRESS_LZ4)
+		_decompress_lz4(d, out);
+#endif
+	free(out);
+
+	/* The reader now sees the end of the file */
+	shutdown(d->fd_out, SHUT_WR);
+	return NULL;
+}
+
+/**
+ * Waits for the decompressor thread to end, then frees it. The reader's
+ * end of the socket must already be closed, so that the thread stops
+ * if it hasn't reached the end of the file.
+ */
+static void
+_close_decompressor(struct pcapfile_decompressor *d)
+{
+	pthread_join(d->thread, NULL);
+	close(d->fd_out);
+	free(d);
+}
+#endif
+
+/**
+ * Start decompressing the file in a thread, returning a stream reading
+ * its output.
+ */
+static FILE *
+_open_decompressor(const char *filename, int format, struct pcapfile_decompressor **r_decompressor)
+{
+#ifdef WIN32
+	fprintf(stderr, "%s: %s compressed files not supported\n", filename, compress_names[format]);
+	return NULL;
+#else
+	struct pcapfile_decompressor *d;
+	int fds[2];
+	FILE *fp;
+	int err;
+
+#if !defined(HAVE_ZSTD)
+	if (format == COMPRESS_ZSTD) {
+		fprintf(stderr, "%s: %s compressed files not supported in this build\n", filename, compress_names[format]);
+		return NULL;
+	}
+#endif
+#if !defined(HAVE_LZ4)
+	if (format == COMPRESS_LZ4) {
+		fprintf(stderr, "%s: %s compressed files not supported in this build\n", filename, compress_names[format]);
+		return NULL;
+	}
+#endif
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		fprintf(stderr, "%s: out of memory\n", filename);
+		return NULL;
+	}
+	d->format = format;
+	snprintf(d->filename, sizeof(d->filename), "%s", filename);
+	d->fd_in = open(filename, O_RDONLY | O_CLOEXEC);
+	if (d->fd_in == -1) {
+		perror(filename);
+		free(d);
+		return NULL;
+	}
+
+	/* A socket rather than a pipe, so that the thread can write with
+	 * MSG_NOSIGNAL, and gets an error instead of SIGPIPE if we close
+	 * the file before reaching the end */
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		perror(filename);
+		close(d->fd_in);
+		free(d);
+		return NULL;
+	}
+	d->fd_out = fds[1];
+
+	fp = fdopen(fds[0], "rb");
+	if (fp == NULL) {
+		perror(filename);
+		close(fds[0]);
+		close(fds[1]);
+		close(d->fd_in);
+		free(d);
+		return NULL;
+	}
+
+	err = pthread_create(&d->thread, NULL, _decompress_thread, d);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(err));
+		fclose(fp);
+		close(fds[1]);
+		close(d->fd_in);
+		free(d);
+		return NULL;
+	}
+	*r_decompressor = d;
+	return fp;
+#endif
+}
+
+/**
+ * Open a capture file for reading.
+ */
+struct pcapfile_ctx_t *
+pcapfile_openread(const char *filename, int *out_linktype, time_t *secs, long *usecs)
+{
+	FILE *fp;
+	ptrdiff_t bytes_read;
+	unsigned char buf[24];
+	unsigned byte_order;
+	unsigned linktype;
+	int format;
+	uint64_t file_size = 0xFFFFffff;
+	int compression;
+	struct pcapfile_decompressor *decompressor = NULL;
+	unsigned is_pipe = 0;
+    struct pcapfile_ctx_t *ctx = 0;
+
+	if (filename == NULL)
+		return NULL;
+
+	/* Grab info about the file */
+	{
+		struct stat s;
+		memset(&s, 0, sizeof(s));
+		if (stat(filename, &s) == 0) {
+			file_size = s.st_size;
+		}
+	}
+
+
+	/* 
+	 * Open the file 
+	 */
+	fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		perror(filename);
+		return NULL;
+	}
+
+	/*
+	 * Read in the file header
+	 */
+	bytes_read = fread(buf, 1, 24, fp);
+	if (bytes_read < 24) {
+		if (bytes_read < 0)
+			perror(filename);
+		else if (bytes_read == 0)
+			fprintf(stderr, "%s: file empty\n", filename);
+		else
+			fprintf(stderr, "%s: file too short\n", filename);
+		fclose(fp);
+		return NULL;
+	}
+
+	/* If the file is compressed, read instead from a decompressor. We
+	 * no longer know how big the file is, and we can't seek */
+	compression = _compressed_format(buf, bytes_read);
+	if (compression != COMPRESS_NONE) {
+		fclose(fp);
+		fp = _open_decompressor(filename, compression, &decompressor);
+		if (fp == NULL)
+			return NULL;
+		file_size = 0;
+		bytes_read = fread(buf, 1, 24, fp);
+		if (bytes_read < 24) {
+			fprintf(stderr, "%s: decompressed file too short\n", filename);
+			fclose(fp);
+#ifndef WIN32
+			_close_decompressor(decompressor);
+#endif
+			return NULL;
+		}
+	}
+#ifndef WIN32
+	{
+		struct stat s;
+		if (fstat(fileno(fp), &s) == 0 && !S_ISREG(s.st_mode))
+			is_pipe = 1;
+	}
+#endif
+
+	/* Parse the byte-order, version, and linktype */
+	linktype = _parse_file_header(filename, buf, &byte_order, &format);
+
 
 	/*
 	 * Now that the file is open and we have read in the header,
@@ -600,7 +1843,7 @@ pcapfile_openread(const char *filename, int *out_linktype, time_t *secs, long *u
     memset(ctx,0,sizeof(*ctx));
     ctx->byte_order = byte_order;
 
-    if (strlen(filename) > sizeof(ctx->filename)+1)
+    if (strlen(filename) >= sizeof(ctx->filename))
         ctx->filename[0] = '\0';
     else {
         memcpy(ctx->filename, filename, strlen(filename));
@@ -609,8 +1852,28 @@ pcapfile_openread(const char *filename, int *out_linktype, time_t *secs, long *u
     ctx->fp = fp;
     ctx->byte_order = byte_order;
     ctx->linktype = linktype;
+    ctx->format = format;
     ctx->file_size = file_size;
+    ctx->is_pipe = is_pipe;
+    ctx->decompressor = decompressor;
     ctx->bytes_read = 24; /*from the header*/
+
+    /* The pcapng header is just the first block */
+    if (format == FORMAT_PCAPNG) {
+        if (is_pipe)
+            _unread_bytes(ctx, buf, 24);
+        else
+            fseek(fp, 0, SEEK_SET);
+        ctx->bytes_read = 0;
+    }
+
+    /* Since we can't seek back after reading the first frame, read ahead
+     * into our buffer, so that we can back up within the buffer instead */
+    if (is_pipe) {
+        _batch_alloc(ctx);
+        ctx->batch_length += fread(ctx->batch_buffer + ctx->batch_length, 1,
+                                   BATCH_BUFFER_SIZE - ctx->batch_length, fp);
+    }
   
     /* Read in the intial timestamp */
     {
@@ -634,14 +1897,232 @@ pcapfile_openread(const char *filename, int *out_linktype, time_t *secs, long *u
             *secs = time_secs;
         if (usecs)
             *usecs = time_usecs;
+
+        /* For pcapng, the linktype is that of the first frame */
+        *out_linktype = ctx->linktype;
         
-        fseek(fp, 24, SEEK_SET);
-        ctx->bytes_read = 24;
+        if (is_pipe) {
+            uint64_t consumed = ctx->bytes_read - ((format == FORMAT_PCAPNG) ? 0 : 24);
+            if (consumed > ctx->batch_offset) {
+                fprintf(stderr, "%s: first frame too large\n", filename);
+                pcapfile_close(ctx);
+                return NULL;
+            }
+            ctx->batch_offset -= (size_t)consumed;
+        }
+        ctx->bytes_read = (format == FORMAT_PCAPNG) ? 0 : 24;
+        if (!is_pipe)
+            fseek(fp, (long)ctx->bytes_read, SEEK_SET);
         ctx->frame_number = 0;
+        ctx->interface_count = 0;
 	}
     return ctx;
 }
+/**
+ * Open a capture file for reading by mapping it into memory.
+ */
+struct pcapfile_ctx_t *
+pcapfile_openread_mmap(const char *filename, int *out_linktype, time_t *secs, long *usecs)
+{
+#ifdef WIN32
+	return pcapfile_openread(filename, out_linktype, secs, usecs);
+#else
+	int fd;
+	struct stat s;
+	void *map;
+	size_t map_size;
+	unsigned byte_order;
+	unsigned linktype;
+	int format;
+	struct pcapfile_ctx_t *ctx;
+
+	if (filename == NULL)
+		return NULL;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		perror(filename);
+		return NULL;
+	}
+	memset(&s, 0, sizeof(s));
+	if (fstat(fd, &s) != 0) {
+		perror(filename);
+		close(fd);
+		return NULL;
+	}
+
+	/* Pipes and such can't be mapped, nor can files bigger than our
+	 * address space, so read them the normal way */
+	if (!S_ISREG(s.st_mode) || (uint64_t)s.st_size > (uint64_t)(size_t)~0) {
+		close(fd);
+		return pcapfile_openread(filename, out_linktype, secs, usecs);
+	}
+	if (s.st_size < 24) {
+		if (s.st_size == 0)
+			fprintf(stderr, "%s: file empty\n", filename);
+		else
+			fprintf(stderr, "%s: file too short\n", filename);
+		close(fd);
+		return NULL;
+	}
+	map_size = (size_t)s.st_size;
+	{
+		unsigned char magic[4];
+		if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && _compressed_format(magic, sizeof(magic))) {
+			close(fd);
+			return pcapfile_openread(filename, out_linktype, secs, usecs);
+		}
+	}
+
+	/* The mapping stays valid after the descriptor is closed */
+	map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(filename);
+		return pcapfile_openread(filename, out_linktype, secs, usecs);
+	}
+
+	/* We read the file front-to-back once, so tell the kernel to read
+	 * ahead aggressively and drop pages behind us. Huge pages reduce TLB
+	 * misses on large files, where the filesystem supports it. These are
+	 * only hints, so errors are ignored. */
+	madvise(map, map_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(map, map_size, MADV_HUGEPAGE);
+#endif
+
+	/* Parse the byte-order, version, and linktype */
+	linktype = _parse_file_header(filename, map, &byte_order, &format);
+
+	ctx = (struct pcapfile_ctx_t*)malloc(sizeof(*ctx));
+	memset(ctx,0,sizeof(*ctx));
+	if (strlen(filename) >= sizeof(ctx->filename))
+		ctx->filename[0] = '\0';
+	else {
+		memcpy(ctx->filename, filename, strlen(filename));
+		ctx->filename[strlen(filename)] = '\0';
+	}
+	ctx->map = map;
+	ctx->map_size = map_size;
+	ctx->byte_order = byte_order;
+	ctx->linktype = linktype;
+	ctx->format = format;
+	ctx->file_size = map_size;
+	ctx->bytes_read = (format == FORMAT_PCAPNG) ? 0 : 24;
+
+	/* Read in the intial timestamp */
+	{
+		int err;
+		time_t time_secs = 0;
+		long time_usecs = 0;
+		size_t original_length = 0;
+		size_t captured_length = 0;
+		const unsigned char *buf;
+
+		err = pcapfile_readframe(ctx, &time_secs, &time_usecs, &original_length, &captured_length, &buf);
+		if (err) {
+			pcapfile_close(ctx);
+			return NULL;
+		}
+
+		ctx->start_sec = time_secs;
+		ctx->start_usec = time_usecs;
+
+		if (secs)
+			*secs = time_secs;
+		if (usecs)
+			*usecs = time_usecs;
+
+		/* For pcapng, the linktype is that of the first frame */
+		*out_linktype = ctx->linktype;
+
+		ctx->bytes_read = (format == FORMAT_PCAPNG) ? 0 : 24;
+		ctx->frame_number = 0;
+		ctx->interface_count = 0;
+	}
+	return ctx;
+#endif
+}
+
+
+/**
+ * Test whether there's a chain of sane frame headers starting at this
+ * offset in the mapping, which either reaches the end of the file or
+ * is [depth] frames long.
+ */
+static unsigned
+_is_frame_chain(struct pcapfile_ctx_t *ctx, uint64_t offset, unsigned depth)
+{
+	unsigned i;
+
+	for (i=0; i<depth; i++) {
+		const unsigned char *header = ctx->map + offset;
+		time_t secs;
+		long usecs;
+		size_t captured_length, original_length;
+
+		if (offset == ctx->map_size)
+			return 1;
+		if (ctx->map_size - offset < 16)
+			return 0;
+
+		secs = PCAP32(ctx->byte_order, header);
+		usecs = PCAP32(ctx->byte_order, header+4);
+		if (ctx->format == FORMAT_PCAP_NSEC)
+			usecs /= 1000;
+		captured_length = PCAP32(ctx->byte_order, header+8);
+		original_length = PCAP32(ctx->byte_order, header+12);
+
+		if (_is_corrupt(captured_length, original_length, secs, usecs))
+			return 0;
+		if (!smells_like_valid_time((unsigned)secs, ctx->start_sec))
+			return 0;
+		if (captured_length > ctx->map_size - offset - 16)
+			return 0;
+		offset += 16 + captured_length;
+	}
+	return 1;
+}
+
+uint64_t
+pcapfile_find_frame(struct pcapfile_ctx_t *ctx, uint64_t offset)
+{
+	if (ctx == NULL || ctx->map == NULL || ctx->format == FORMAT_PCAPNG)
+		return 0;
+
+	if (offset <= 24)
+		return 24;
+
+	/* Scan forward a byte at a time, using the same test as when
+	 * repairing corrupt files, but then also making sure it's followed
+	 * by a long chain of frames, since a false match here means every
+	 * frame in a shard is garbage. */
+	for (; offset < ctx->map_size; offset++) {
+		uint64_t remaining = ctx->map_size - offset;
+
+		if (remaining > 0xFFFFFFFF)
+			remaining = 0xFFFFFFFF;
+		if (!smells_like_valid_packet(ctx->map + offset, (unsigned)remaining,
+				ctx->byte_order, ctx->linktype, ctx->format, ctx->start_sec))
+			continue;
+		if (_is_frame_chain(ctx, offset, 16))
+			return offset;
+	}
+	return ctx->map_size;
+}
+
+int
+pcapfile_set_range(struct pcapfile_ctx_t *ctx, uint64_t start, uint64_t end)
+{
+	if (ctx == NULL || ctx->map == NULL || ctx->format == FORMAT_PCAPNG)
+		return -1;
+	if (start < 24 || start > ctx->map_size || end < start)
+		return -1;
 
+	ctx->bytes_read = start;
+	ctx->range_end = end;
+	return 0;
+}
 
 /**
  * Open a capture file for writing
@@ -831,6 +2312,17 @@ void pcapfile_close(struct pcapfile_ctx_t *ctx)
 		return;
 	if (ctx->fp)
 		fclose(ctx->fp);
+#ifndef WIN32
+	if (ctx->map)
+		munmap((void *)ctx->map, ctx->map_size);
+
+	/* If we close before the end, the decompressor stops when it
+	 * can no longer write to us */
+	if (ctx->decompressor)
+		_close_decompressor(ctx->decompressor);
+#endif
+	free(ctx->frame_buffer);
+	free(ctx->batch_buffer);
 	free(ctx);
 }
 
@@ -925,3 +2417,192 @@ const char *pcapfile_datalink_name(int linktype)
             return "Unknown";
     }
 }
+
+#ifndef WIN32
+/** The timestamp of every frame in the self-test captures */
+#define SELFTEST_TIME 0x5d890000
+
+/**
+ * Write a classic little-endian frame header into the self-test image.
+ */
+static void
+_selftest_header(unsigned char *px, unsigned secs, unsigned captured_length, unsigned original_length)
+{
+	unsigned fields[4];
+	unsigned i;
+
+	fields[0] = secs;
+	fields[1] = 0;
+	fields[2] = captured_length;
+	fields[3] = original_length;
+	for (i=0; i<16; i++)
+		px[i] = (unsigned char)(fields[i/4] >> (8 * (i%4)));
+}
+
+/**
+ * Build a capture in memory that ends exactly where a page we can't
+ * read begins, so that reading even one byte too far crashes the test,
+ * the same as it could with a file mapped by pcapfile_openread_mmap().
+ * It has a good frame, a corrupt one followed by garbage, then
+ * 'tail_frames' good frames. When 'is_truncated', the last of these
+ * is followed by the first 8 bytes of another header.
+ * @return
+ *      A context reading the capture, or NULL if it can't be built.
+ */
+static struct pcapfile_ctx_t *
+_selftest_open(unsigned char **r_pages, size_t *r_page_size, unsigned is_truncated, uint64_t *r_tail)
+{
+	struct pcapfile_ctx_t *ctx;
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char *pages;
+	size_t offset;
+
+	pages = mmap(NULL, 2 * page_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED)
+		return NULL;
+	if (mprotect(pages + page_size, page_size, PROT_NONE) != 0) {
+		munmap(pages, 2 * page_size);
+		return NULL;
+	}
+	memset(pages, 0, page_size);
+
+	/* The file header, then a good frame, then a corrupt one */
+	memcpy(pages, "\xd4\xc3\xb2\xa1\x02\x00\x04\x00", 8);
+	pages[16] = 0xff;
+	pages[17] = 0xff;
+	pages[20] = 1;
+	_selftest_header(pages + 24, SELFTEST_TIME, 60, 60);
+	_selftest_header(pages + 100, SELFTEST_TIME, 0x00FFFFFF, 0x00FFFFFF);
+
+	/* The tail frames, working backwards from the end */
+	offset = page_size;
+	if (is_truncated) {
+		offset -= 8;
+		_selftest_header(pages + offset - 76, SELFTEST_TIME, 60, 60);
+		memcpy(pages + offset, pages + offset - 76, 8);
+		offset -= 76;
+	} else {
+		offset -= 2 * 76;
+		_selftest_header(pages + offset, SELFTEST_TIME, 60, 60);
+		_selftest_header(pages + offset + 76, SELFTEST_TIME, 60, 60);
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		munmap(pages, 2 * page_size);
+		return NULL;
+	}
+	snprintf(ctx->filename, sizeof(ctx->filename), "selftest");
+	ctx->byte_order = CAPFILE_LITTLEENDIAN;
+	ctx->linktype = 1;
+	ctx->format = FORMAT_PCAP;
+	ctx->start_sec = SELFTEST_TIME;
+	ctx->map = pages;
+	ctx->map_size = page_size;
+	ctx->file_size = page_size;
+	ctx->bytes_read = 24;
+
+	*r_pages = pages;
+	*r_page_size = page_size;
+	*r_tail = offset;
+	return ctx;
+}
+
+static void
+_selftest_close(struct pcapfile_ctx_t *ctx, unsigned char *pages, size_t page_size)
+{
+	/* The pages aren't a mapped file, so don't let pcapfile_close()
+	 * unmap them */
+	ctx->map = NULL;
+	pcapfile_close(ctx);
+	munmap(pages, 2 * page_size);
+}
+
+/**
+ * Read frames until the end, returning how many good ones there were.
+ */
+static unsigned
+_selftest_count(struct pcapfile_ctx_t *ctx)
+{
+	unsigned count = 0;
+
+	for (;;) {
+		time_t secs;
+		long usecs;
+		size_t original_length, captured_length;
+		const unsigned char *buf;
+
+		if (pcapfile_readframe(ctx, &secs, &usecs, &original_length, &captured_length, &buf) != 0)
+			break;
+		if (captured_length != 60)
+			return 0;
+		count++;
+	}
+	return count;
+}
+
+int
+pcapfile_selftest(void)
+{
+	struct pcapfile_ctx_t *ctx;
+	unsigned char *pages;
+	size_t page_size;
+	uint64_t tail;
+	uint64_t offset;
+	unsigned count;
+
+	/* Repairing finds the good frames after the corruption, at the very
+	 * end of the mapping */
+	ctx = _selftest_open(&pages, &page_size, 0, &tail);
+	if (ctx == NULL)
+		return 1;
+	count = _selftest_count(ctx);
+	if (count != 3) {
+		fprintf(stderr, "[-] pcapfile: repaired %u frames, expected 3\n", count);
+		goto fail;
+	}
+
+	/* A frame is found by its following header, so the last frame can't
+	 * be found on its own, but the one before can */
+	offset = pcapfile_find_frame(ctx, 25);
+	if (offset != tail) {
+		fprintf(stderr, "[-] pcapfile: found frame at %llu, expected %llu\n",
+			(unsigned long long)offset, (unsigned long long)tail);
+		goto fail;
+	}
+	if (pcapfile_find_frame(ctx, tail + 1) != page_size) {
+		fprintf(stderr, "[-] pcapfile: found frame past the last\n");
+		goto fail;
+	}
+	_selftest_close(ctx, pages, page_size);
+
+	/* When the file ends partway through a header, neither repairing
+	 * nor finding frames looks at the missing bytes */
+	ctx = _selftest_open(&pages, &page_size, 1, &tail);
+	if (ctx == NULL)
+		return 1;
+	count = _selftest_count(ctx);
+	if (count != 1) {
+		fprintf(stderr, "[-] pcapfile: repaired %u frames, expected 1\n", count);
+		goto fail;
+	}
+	for (offset=tail-4; offset<page_size; offset++) {
+		if (pcapfile_find_frame(ctx, offset) != page_size) {
+			fprintf(stderr, "[-] pcapfile: found frame in truncated tail\n");
+			goto fail;
+		}
+	}
+	_selftest_close(ctx, pages, page_size);
+	return 0; /* success */
+
+fail:
+	_selftest_close(ctx, pages, page_size);
+	return 1; /* failure */
+}
+#else
+int
+pcapfile_selftest(void)
+{
+	return 0;
+}
+#endif
@@ -7,6 +7,7 @@
 extern "C" {
 #endif
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 /**
@@ -45,10 +46,30 @@ enum {
  * Opens a file for reading. A context handle is returned which will be
  * supplied to pcapfile_readframe(). In addition, the linktype is returned
  * that tells how to start parsing the first bytes of a frame.
+ * Classic libpcap files (with microsecond or nanosecond timestamps) and
+ * pcapng files are supported. In pcapng files, each interface can have
+ * a different linktype, in which case this is the linktype of the first
+ * frame, and pcapfile_get_datalink() gives that of the current frame.
+ * Files compressed with gzip, zstd, or lz4 are detected by their magic
+ * number and decompressed as they are read, by a thread that reads the
+ * file and passes the decompressed bytes to us over a socketpair. Gzip
+ * uses zlib. Zstd and lz4 are only supported when built with HAVE_ZSTD
+ * or HAVE_LZ4 (linking libzstd or liblz4), otherwise opening such a file
+ * fails with a message that it's not supported in this build.
  */
 struct pcapfile_ctx_t *
 pcapfile_openread(const char *filename, int *linktype, time_t *secs, long *usecs);
 
+/**
+ * The same as pcapfile_openread(), but maps the file into memory, so
+ * that the buffer returned by pcapfile_readframe() points directly into
+ * the file contents rather than being copied. That buffer stays valid
+ * until pcapfile_close(), instead of only until the next frame is read.
+ * Files that can't be mapped, such as pipes, are opened the normal way.
+ */
+struct pcapfile_ctx_t *
+pcapfile_openread_mmap(const char *filename, int *linktype, time_t *secs, long *usecs);
+
 /**
  * Writes a packet to a file created with pcapfile_openwrite().
  * @return
@@ -69,6 +90,12 @@ struct pcapfile_ctx_t *pcapfile_openappend(const char *capfilename, int linktype
 
 unsigned pcapfile_percentdone(struct pcapfile_ctx_t *ctx);
 
+/**
+ * Return the linktype of the frame most recently read, which for pcapng
+ * files may change from frame to frame.
+ */
+unsigned pcapfile_get_datalink(struct pcapfile_ctx_t *ctx);
+
 const char *pcapfile_datalink_name(int linktype);
 
 /**
@@ -96,9 +123,80 @@ int pcapfile_readframe(
 	const unsigned char **buf
 	);
 
+/**
+ * A frame returned by pcapfile_readframes(), with the same fields as
+ * returned by pcapfile_readframe().
+ */
+typedef struct pcapframe_t {
+	time_t secs;
+	long usecs;
+	size_t original_length;
+	size_t captured_length;
+	const unsigned char *buf;
+	int linktype;
+} pcapframe_t;
+
+/**
+ * Read many frames from the file at once, which is faster than calling
+ * pcapfile_readframe() for each one when the processing of each frame
+ * is cheap. This can be mixed with calls to pcapfile_readframe().
+ * @param ctx
+ *      A handle to a file returned from pcapfile_openread() or
+ *      pcapfile_openread_mmap().
+ * @param frames
+ *      An array that receives the frames. Their [buf] pointers point into
+ *      an internal buffer, and are valid until the next read (or until
+ *      the file is closed, if it was opened with pcapfile_openread_mmap()).
+ * @param max
+ *      The number of elements in the [frames] array.
+ * @return
+ *      The number of frames read, from 1 to [max], or 0 at the end of the
+ *      file or on an error. Fewer than [max] frames are returned at the
+ *      end of the internal buffer, or before an unusual frame, so that
+ *      value doesn't indicate the end of the file.
+ */
+size_t pcapfile_readframes(
+	struct pcapfile_ctx_t *ctx,
+	struct pcapframe_t *frames,
+	size_t max
+	);
+
+/**
+ * Find the start of the first frame at or after an offset within a file,
+ * so that a large file can be split into shards that are read in
+ * parallel. This scans forward looking for a plausible chain of frame
+ * headers, the same way corrupt files are repaired. This only works for
+ * classic pcap files opened with pcapfile_openread_mmap().
+ * @param ctx
+ *      A handle to a file returned from pcapfile_openread_mmap().
+ * @param offset
+ *      The offset within the file to start searching from.
+ * @return
+ *      The offset of the frame, or the size of the file if there are no
+ *      more frames, or 0 if the file can't be split.
+ */
+uint64_t pcapfile_find_frame(struct pcapfile_ctx_t *ctx, uint64_t offset);
+
+/**
+ * Restrict reading to the frames that start within a range of the file,
+ * as found by pcapfile_find_frame(). The next frame read is the one at
+ * [start], and reading stops before the first frame at or after [end].
+ * A frame that starts within the range may end after it.
+ * @return
+ *      0 on success, or -1 if the file can't be split.
+ */
+int pcapfile_set_range(struct pcapfile_ctx_t *ctx, uint64_t start, uint64_t end);
+
 
 void pcapfile_close(struct pcapfile_ctx_t *handle);
 
+/**
+ * Unit-test this module.
+ * @return
+ *      0 on success, a positive integer otherwise.
+ */
+int pcapfile_selftest(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,299 @@
+#include "util-spscring.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Each record starts with this header, holding its length. The headers
+ * and records are padded to 8 bytes, so that they are always aligned.
+ */
+#define HEADER_SIZE 8
+
+/**
+ * A header with this length means the rest of the buffer is unused,
+ * and the next record is at the start.
+ */
+#define WRAP_MARKER 0xFFFFFFFF
+
+/**
+ * The positions count the total number of bytes ever written or read,
+ * and are masked to find the offset within the buffer. Each is written
+ * by only one side, and the two are on separate cache lines so that
+ * the threads aren't fighting over the same line on every record.
+ */
+struct spscring_t
+{
+    /* Written by the producer */
+    _Alignas(64) _Atomic uint64_t head;
+    uint64_t cached_tail;
+
+    /* Written by the consumer */
+    _Alignas(64) _Atomic uint64_t tail;
+    uint64_t cached_head;
+    uint64_t peek_size;
+
+    _Alignas(64) size_t size;
+    size_t mask;
+    unsigned char *buf;
+};
+
+static size_t
+_padded(size_t length)
+{
+    return (HEADER_SIZE + length + 7) & ~(size_t)7;
+}
+
+struct spscring_t *
+spscring_create(size_t size)
+{
+    struct spscring_t *ring;
+    size_t real_size = 64;
+
+    while (real_size < size)
+        real_size *= 2;
+
+    ring = aligned_alloc(64, sizeof(*ring));
+    if (ring == NULL)
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    ring->buf = malloc(real_size);
+    if (ring->buf == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->size = real_size;
+    ring->mask = real_size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ring;
+}
+
+void
+spscring_destroy(struct spscring_t *ring)
+{
+    if (ring == NULL)
+        return;
+    free(ring->buf);
+    free(ring);
+}
+
+void *
+spscring_reserve(struct spscring_t *ring, size_t length)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t offset = (size_t)(head & ring->mask);
+    size_t padded = _padded(length);
+    size_t room = ring->size - offset;
+    size_t needed = padded;
+
+    if (padded > ring->size / 2)
+        return NULL;
+
+    /* If the record doesn't fit before the end of the buffer, we also
+     * need the rest of the buffer, which we'll skip */
+    if (room < padded)
+        needed += room;
+
+    /* Only look at the consumer's position when our cached copy says
+     * there's not enough room */
+    if (ring->size - (head - ring->cached_tail) < needed) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (ring->size - (head - ring->cached_tail) < needed)
+            return NULL;
+    }
+
+    if (room < padded) {
+        *(uint32_t *)(ring->buf + offset) = WRAP_MARKER;
+        head += room;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+        offset = 0;
+    }
+
+    return ring->buf + offset + HEADER_SIZE;
+}
+
+void
+spscring_commit(struct spscring_t *ring, size_t length)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t offset = (size_t)(head & ring->mask);
+
+    *(uint32_t *)(ring->buf + offset) = (uint32_t)length;
+    atomic_store_explicit(&ring->head, head + _padded(length), memory_order_release);
+}
+
+const void *
+spscring_peek(struct spscring_t *ring, size_t *length)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (;;) {
+        size_t offset = (size_t)(tail & ring->mask);
+        uint32_t record_length;
+
+        if (tail == ring->cached_head) {
+            ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (tail == ring->cached_head)
+                return NULL;
+        }
+
+        record_length = *(const uint32_t *)(ring->buf + offset);
+        if (record_length == WRAP_MARKER) {
+            tail += ring->size - offset;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+            continue;
+        }
+
+        ring->peek_size = _padded(record_length);
+        *length = record_length;
+        return ring->buf + offset + HEADER_SIZE;
+    }
+}
+
+void
+spscring_release(struct spscring_t *ring)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + ring->peek_size, memory_order_release);
+    ring->peek_size = 0;
+}
+
+/**
+ * Write a record of 'length' bytes, each set to 'seqno', so that the
+ * consumer can check it got every record, in order, intact.
+ */
+static int
+_selftest_write(struct spscring_t *ring, size_t length, unsigned char seqno)
+{
+    unsigned char *p;
+
+    p = spscring_reserve(ring, length + 16);
+    if (p == NULL)
+        return 0;
+    memset(p, seqno, length);
+
+    /* Commit less than we reserved, as callers do when they reserve
+     * for the worst case */
+    spscring_commit(ring, length);
+    return 1;
+}
+
+static int
+_selftest_read(struct spscring_t *ring, size_t expected_length, unsigned char seqno)
+{
+    const unsigned char *p;
+    size_t length = 0;
+    size_t i;
+
+    p = spscring_peek(ring, &length);
+    if (p == NULL || length != expected_length)
+        return 0;
+    for (i=0; i<length; i++) {
+        if (p[i] != seqno)
+            return 0;
+    }
+    spscring_release(ring);
+    return 1;
+}
+
+int
+spscring_selftest(void)
+{
+    struct spscring_t *ring;
+    size_t length = 0;
+    unsigned count;
+    unsigned i;
+
+    ring = spscring_create(256);
+    if (ring == NULL)
+        return 1;
+
+    /* A new ring is empty */
+    if (spscring_peek(ring, &length) != NULL) {
+        fprintf(stderr, "[-] spscring: new ring not empty\n");
+        goto fail;
+    }
+
+    /* Records bigger than half the ring are never accepted */
+    if (spscring_reserve(ring, 256/2) != NULL) {
+        fprintf(stderr, "[-] spscring: oversized record accepted\n");
+        goto fail;
+    }
+
+    /* Fill it up. Each record takes 32 bytes with its header, so
+     * exactly 8 should fit */
+    for (count=0; count<100; count++) {
+        unsigned char *p = spscring_reserve(ring, 24);
+        if (p == NULL)
+            break;
+        memset(p, (unsigned char)count, 24);
+        spscring_commit(ring, 24);
+    }
+    if (count != 8) {
+        fprintf(stderr, "[-] spscring: full after %u records\n", count);
+        goto fail;
+    }
+
+    /* Freeing one record makes room for exactly one more */
+    if (!_selftest_read(ring, 24, 0)) {
+        fprintf(stderr, "[-] spscring: bad record when full\n");
+        goto fail;
+    }
+    if (spscring_reserve(ring, 24) == NULL) {
+        fprintf(stderr, "[-] spscring: no room after release\n");
+        goto fail;
+    }
+    spscring_commit(ring, 24);
+    if (spscring_reserve(ring, 24) != NULL) {
+        fprintf(stderr, "[-] spscring: room when full\n");
+        goto fail;
+    }
+
+    /* Drain it, and it's empty again */
+    for (i=1; i<=8; i++) {
+        const unsigned char *p = spscring_peek(ring, &length);
+        if (p == NULL || length != 24) {
+            fprintf(stderr, "[-] spscring: missing record while draining\n");
+            goto fail;
+        }
+        spscring_release(ring);
+    }
+    if (spscring_peek(ring, &length) != NULL) {
+        fprintf(stderr, "[-] spscring: drained ring not empty\n");
+        goto fail;
+    }
+
+    /* Pass many records of different lengths through the ring, so that
+     * the positions wrap around the end of the buffer many times, and
+     * records often don't fit before the end and skip to the start */
+    {
+        unsigned written = 0;
+        unsigned read = 0;
+
+        while (read < 10000) {
+            /* Write until full, then read a few */
+            while (written < 10000 && _selftest_write(ring, written % 61, (unsigned char)written))
+                written++;
+            for (i=0; i<3 && read < written; i++, read++) {
+                if (!_selftest_read(ring, read % 61, (unsigned char)read)) {
+                    fprintf(stderr, "[-] spscring: record %u corrupt\n", read);
+                    goto fail;
+                }
+            }
+        }
+        if (spscring_peek(ring, &length) != NULL) {
+            fprintf(stderr, "[-] spscring: records left over\n");
+            goto fail;
+        }
+    }
+
+    spscring_destroy(ring);
+    return 0; /* success */
+
+fail:
+    spscring_destroy(ring);
+    return 1; /* failure */
+}
@@ -0,0 +1,86 @@
+/*
+ License: MIT
+
+ Single-producer, single-consumer ring
+
+ This passes variable-length records from one thread to another without
+ locks. Exactly one thread may write to a ring, and exactly one thread
+ may read from it. Records are written in place: the producer reserves
+ space, fills it in, then commits it, and the consumer peeks at the
+ next record, processes it in place, then releases it.
+
+ A record is never split across the end of the buffer, so it can be
+ processed as a single contiguous chunk of memory.
+
+ NOTE: neither side ever blocks. When the ring is full or empty, the
+ functions return NULL, and it's up to the caller to decide whether to
+ spin, yield, or sleep before trying again.
+ */
+#ifndef UTIL_SPSCRING_H
+#define UTIL_SPSCRING_H
+#include <stddef.h>
+
+struct spscring_t;
+
+/**
+ * Create a ring.
+ * @param size
+ *      The number of bytes in the ring, which is rounded up to a power
+ *      of two. The largest record that fits is half this size.
+ * @return
+ *      The new ring, or NULL if memory couldn't be allocated.
+ */
+struct spscring_t *
+spscring_create(size_t size);
+
+/**
+ * Free the ring, after both threads are done with it.
+ */
+void
+spscring_destroy(struct spscring_t *ring);
+
+/**
+ * Called by the producer to reserve space for the next record.
+ * @return
+ *      A pointer to [length] bytes to fill in, or NULL if the ring
+ *      doesn't currently have room. It isn't visible to the consumer
+ *      until spscring_commit() is called.
+ */
+void *
+spscring_reserve(struct spscring_t *ring, size_t length);
+
+/**
+ * Called by the producer to publish the record filled in after the
+ * last call to spscring_reserve(). The [length] may be less than was
+ * reserved, but not more.
+ */
+void
+spscring_commit(struct spscring_t *ring, size_t length);
+
+/**
+ * Called by the consumer to get the next record.
+ * @param length
+ *      Receives the length of the record.
+ * @return
+ *      A pointer to the record, or NULL if the ring is empty. It stays
+ *      valid until spscring_release() is called.
+ */
+const void *
+spscring_peek(struct spscring_t *ring, size_t *length);
+
+/**
+ * Called by the consumer once it's done with the record returned by
+ * spscring_peek(), so the producer can reuse the space.
+ */
+void
+spscring_release(struct spscring_t *ring);
+
+/**
+ * Unit-test this module.
+ * @return
+ *      0 on success, a positive integer otherwise.
+ */
+int
+spscring_selftest(void);
+
+#endif
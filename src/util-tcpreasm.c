@@ -2,6 +2,7 @@
 #include "util-hashmap.h"
 #include "util-timeouts.h"
 #include "util-siphash24.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -20,12 +21,58 @@ uint64_t connection_hash(void *key);
  */
 uint64_t g_hashmap_key[2];
 
+/**
+ * A pool of fixed-size items. Memory is allocated in large slabs, which
+ * are carved into items and kept on a free-list. Items are returned to
+ * the free-list rather than to the system, so that a busy reassembler
+ * stops calling malloc() once it has reached its working set.
+ */
+struct pool_t {
+    size_t item_size;
+    size_t items_per_slab;
+    void *freelist;
+    struct slab_t *slabs;
+    struct tcpreasm_poolstats_t stats;
+};
+
+/** Every item in a pool is aligned to this many bytes */
+#define POOL_ALIGN 16
+
+/**
+ * The header of a slab. The union pads it so that the items that
+ * follow are aligned.
+ */
+struct slab_t {
+    union {
+        struct slab_t *next;
+        unsigned char pad[POOL_ALIGN];
+    } u;
+    unsigned char items[];
+};
+
+/** Roughly how many bytes to allocate at a time for a pool */
+#define SLAB_BYTES (256 * 1024)
+
+/**
+ * The sizes of fragment buffers, including the fragment header. These
+ * cover a small DNS query, a typical response, Ethernet and jumbo
+ * frames, and large segments from offloading. Anything bigger comes
+ * from malloc().
+ */
+static const size_t buffer_classes[TCPREASM_BUFFER_CLASSES] = {
+    128, 512, 2048, 9216, 16384, 65536 + 64,
+};
+#define CLASS_OVERSIZE TCPREASM_BUFFER_CLASSES
+
 struct tcpreasm_ctx_t {
     Hashmap *conntable;
     size_t sizeof_userdata;
     void (*cleanup_userdata)(void *userdata);
     unsigned default_timeout;
     struct Timeouts *timeouts;
+    struct pool_t stream_pool;
+    struct pool_t buffer_pools[TCPREASM_BUFFER_CLASSES];
+    size_t oversize_in_use;
 };
 
 struct tcpreasm_connkey_t {
@@ -41,6 +88,10 @@ struct fragment {
     struct fragment *next;
     unsigned seqno;
     unsigned length;
+    /** The number of bytes that 'buf' can hold */
+    unsigned capacity;
+    /** Which pool this came from, or CLASS_OVERSIZE */
+    unsigned size_class;
     unsigned char buf[];
 };
 
@@ -50,11 +101,133 @@ struct tcpreasm_stream_t {
     unsigned seqno;
     unsigned is_payload_seen:1;
     struct TimeoutEntry timeout;
+    /** The bytes available to read, starting at 'seqno'. This is a ring
+     * of 'ring->capacity' bytes, starting at offset 'ring_head', with
+     * 'ring->length' bytes in use. It's NULL when there are none. */
+    struct fragment *ring;
+    unsigned ring_head;
+    /** Out-of-order segments that arrived after a gap, sorted by
+     * sequence number */
     struct fragment *fragments;
     unsigned char userdata[];
 };
 
 
+static void
+_pool_init(struct pool_t *pool, size_t item_size)
+{
+    /* Round up so that every item is aligned */
+    item_size = (item_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+
+    memset(pool, 0, sizeof(*pool));
+    pool->item_size = item_size;
+    pool->items_per_slab = SLAB_BYTES / item_size;
+    if (pool->items_per_slab < 4)
+        pool->items_per_slab = 4;
+    pool->stats.item_size = item_size;
+}
+
+/**
+ * Get an item from the pool, allocating another slab if the pool is
+ * empty. The contents of the item are undefined.
+ * @return
+ *      an item, or NULL if out of memory
+ */
+static void *
+_pool_alloc(struct pool_t *pool)
+{
+    void *item;
+
+    if (pool->freelist == NULL) {
+        struct slab_t *slab;
+        size_t i;
+
+        slab = malloc(sizeof(*slab) + pool->items_per_slab * pool->item_size);
+        if (slab == NULL)
+            return NULL;
+        slab->u.next = pool->slabs;
+        pool->slabs = slab;
+
+        /* Thread all the new items onto the free-list, backwards so
+         * that they are handed out in address order */
+        for (i = pool->items_per_slab; i > 0; i--) {
+            void **p = (void **)(slab->items + (i - 1) * pool->item_size);
+            *p = pool->freelist;
+            pool->freelist = p;
+        }
+        pool->stats.allocated += pool->items_per_slab;
+    }
+
+    item = pool->freelist;
+    pool->freelist = *(void **)item;
+
+    pool->stats.in_use++;
+    if (pool->stats.high_water < pool->stats.in_use)
+        pool->stats.high_water = pool->stats.in_use;
+    return item;
+}
+
+static void
+_pool_free(struct pool_t *pool, void *item)
+{
+    *(void **)item = pool->freelist;
+    pool->freelist = item;
+    pool->stats.in_use--;
+}
+
+static void
+_pool_destroy(struct pool_t *pool)
+{
+    while (pool->slabs) {
+        struct slab_t *slab = pool->slabs;
+        pool->slabs = slab->u.next;
+        free(slab);
+    }
+    pool->freelist = NULL;
+}
+
+/**
+ * Allocate a fragment big enough to hold 'length' bytes, from the
+ * smallest size class that fits.
+ */
+static struct fragment *
+_frag_alloc(struct tcpreasm_ctx_t *ctx, unsigned length)
+{
+    struct fragment *frag;
+    size_t needed = sizeof(*frag) + length;
+    unsigned size_class;
+
+    for (size_class = 0; size_class < TCPREASM_BUFFER_CLASSES; size_class++) {
+        if (needed <= buffer_classes[size_class])
+            break;
+    }
+
+    if (size_class == CLASS_OVERSIZE) {
+        frag = malloc(needed);
+        if (frag == NULL)
+            return NULL;
+        frag->capacity = length;
+        ctx->oversize_in_use++;
+    } else {
+        frag = _pool_alloc(&ctx->buffer_pools[size_class]);
+        if (frag == NULL)
+            return NULL;
+        frag->capacity = (unsigned)(ctx->buffer_pools[size_class].item_size - sizeof(*frag));
+    }
+    frag->size_class = size_class;
+    return frag;
+}
+
+static void
+_frag_free(struct tcpreasm_ctx_t *ctx, struct fragment *frag)
+{
+    if (frag->size_class == CLASS_OVERSIZE) {
+        free(frag);
+        ctx->oversize_in_use--;
+    } else
+        _pool_free(&ctx->buffer_pools[frag->size_class], frag);
+}
+
 unsigned SEQNO_LTE(unsigned seqnoA, unsigned seqnoB)
 {
     if (seqnoB - seqnoA < 0x80000000)
@@ -79,151 +252,12 @@ unsigned SEQNO_LT(unsigned seqnoA, unsigned seqnoB)
 }
 
 
-static int
-IS_BETWEEN(unsigned seqno, unsigned begin, unsigned end)
-{
-    return SEQNO_GTE(seqno, begin) && SEQNO_LTE(seqno, end);
-}
-
-static int
-_frag_is_overlap(struct fragment *frag, unsigned seqno, unsigned length)
-{
-    if (SEQNO_LT(seqno + length + 1, frag->seqno))
-        return 0;
-    else if (SEQNO_GT(seqno, frag->seqno + frag->length + 1))
-        return 0;
-    else
-        return 1;
-}
-static int
-_frag_is_after(struct fragment *frag, unsigned seqno, unsigned length)
-{
-    return SEQNO_GT(frag->seqno, seqno + length + 1);
-}
-
-
-
-/**
- * Merge this fragment and the next fragment if they overflap
- */
-static void
-_frag_merge(struct fragment **frag, unsigned seqno, const unsigned char *buf, unsigned length)
-{
-    struct fragment *next_frag = (*frag)->next;
-    
-    assert(
-           IS_BETWEEN(seqno, (*frag)->seqno, (*frag)->seqno + (*frag)->length)
-           ||
-           IS_BETWEEN(seqno + length, (*frag)->seqno, (*frag)->seqno + (*frag)->length)
-           );
-    
-    if (SEQNO_LT((*frag)->seqno, seqno)) {
-        unsigned overlap;
-        unsigned diff;
-        
-        /* Calculate how many bytes of this chunk overlaps
-         * with the next chunk, which may be zero, or which
-         * may extend past the end of the next packet */
-        overlap = (*frag)->seqno + (*frag)->length - seqno;
-        
-        /* If the existing fragment is completely larger than the overlapping
-         * one, then ignore the new input */
-        if (overlap >= length)
-            return;
-        
-        /* The amount of new bytes is the new fragment minus what already exists */
-        diff = length - overlap;
-        
-        /* Grow the existing fragment */
-        (*frag) = realloc(*frag, sizeof(**frag) + (*frag)->length + diff);
-        
-        if (*frag == NULL) {
-            /* out-of-memory. In this case, we'll remove all the fragments
-             * that we have, starting from the "next" pointer that we
-             * remembered from above */
-            while (next_frag) {
-                *frag = next_frag;
-                next_frag = next_frag->next;
-                free(*frag);
-            }
-            return;
-        }
-        
-        memcpy((*frag)->buf + (*frag)->length, buf + overlap, diff);
-        (*frag)->length += diff;
-    } else {
-        unsigned overlap;
-        unsigned diff;
-        
-        /* Calculate how many bytes of this chunk overlaps
-         * with the next chunk, which may be zero, or which
-         * may extend past the end of the next packet */
-        overlap = seqno + length - (*frag)->seqno;
-        
-        /* If the NEW fragment completely overlaps the OLD one, then
-         * replace the old one with the new one */
-        if (overlap >= (*frag)->length) {
-            (*frag) = realloc(*frag, sizeof(**frag) + length);
-            
-            if (*frag == NULL) {
-                /* Out-of-Memory: delete all fragments */
-                while (next_frag) {
-                    *frag = next_frag;
-                    next_frag = next_frag->next;
-                    free(*frag);
-                }
-                return;
-            }
-            
-            memcpy((*frag)->buf, buf, length);
-            (*frag)->length = length;
-            (*frag)->seqno = seqno;
-            return;
-        }
-        
-        /* The amount of new bytes is the new fragment minus what already exists */
-        diff = (*frag)->length - overlap;
-        
-        /* Grow the existing fragment */
-        (*frag) = realloc(*frag, sizeof(**frag) + length + diff);
-        
-        if (*frag == NULL) {
-            /* Out-of-Memory: delete all fragments */
-            while (next_frag) {
-                *frag = next_frag;
-                next_frag = next_frag->next;
-                free(*frag);
-            }
-            return;
-        }
-        
-        memmove((*frag)->buf + length, (*frag)->buf + overlap, diff);
-        memcpy((*frag)->buf, buf, length);
-        (*frag)->length = length + diff;
-        (*frag)->seqno = seqno;
-    }
-    
-    /* See if we need to merge again with the next fragment */
-    if ((*frag)->next && _frag_is_overlap(*frag, (*frag)->next->seqno, (*frag)->next->length)) {
-        struct fragment *next = (*frag)->next;
-        
-        /* Unlink the next fragment from the chain */
-        (*frag)->next = next->next;
-      
-        /* Recursively call this function */
-        _frag_merge(frag, next->seqno, next->buf, next->length);
-        
-        free(next);
-    }
-
-}
-
 struct fragment *
-_fragment_new(unsigned seqno, const unsigned char *buf, unsigned length, struct fragment *next)
+_fragment_new(struct tcpreasm_ctx_t *ctx, unsigned seqno, const unsigned char *buf, unsigned length, struct fragment *next)
 {
     struct fragment *newfrag;
     
-    newfrag = malloc(sizeof(*newfrag) + length);
+    newfrag = _frag_alloc(ctx, length);
     
     /* In case of memory allocation error, just return the
      * next fragment -- as if there was no creation */
@@ -237,41 +271,163 @@ _fragment_new(unsigned seqno, const unsigned char *buf, unsigned length, struct
     return newfrag;
 }
 
+/**
+ * Move the stream's bytes into a new ring that holds at least 'capacity'
+ * bytes, starting at the beginning, so that they no longer wrap around
+ * the end.
+ * @return
+ *      the new ring, or NULL if out of memory, in which case the old
+ *      ring is left alone
+ */
+static struct fragment *
+_ring_resize(struct tcpreasm_ctx_t *ctx, struct tcpreasm_stream_t *stream, unsigned capacity)
+{
+    struct fragment *ring = stream->ring;
+    struct fragment *newring;
+    unsigned count = ring ? ring->length : 0;
+
+    newring = _frag_alloc(ctx, capacity);
+    if (newring == NULL)
+        return NULL;
+    newring->next = NULL;
+    newring->seqno = stream->seqno;
+    newring->length = count;
+
+    /* Copy over the existing bytes, which may wrap around the end */
+    if (ring) {
+        unsigned first = ring->capacity - stream->ring_head;
+        if (first > count)
+            first = count;
+        memcpy(newring->buf, ring->buf + stream->ring_head, first);
+        memcpy(newring->buf + first, ring->buf, count - first);
+        _frag_free(ctx, ring);
+    }
+    stream->ring = newring;
+    stream->ring_head = 0;
+    return newring;
+}
+
+/**
+ * Append in-order bytes to the end of the stream's ring, growing it if
+ * there isn't enough room.
+ */
+static void
+_ring_append(struct tcpreasm_ctx_t *ctx, struct tcpreasm_stream_t *stream, const unsigned char *buf, unsigned length)
+{
+    struct fragment *ring = stream->ring;
+    unsigned tail;
+    unsigned first;
+
+    if (ring == NULL || ring->length + length > ring->capacity) {
+        /* Double the size, so that a stream that keeps growing does an
+         * amortized O(1) amount of copying per byte */
+        ring = _ring_resize(ctx, stream, ring ? 2 * (ring->length + length) : length);
+        if (ring == NULL)
+            return; /* out-of-memory: drop the bytes */
+    }
+
+    /* Copy in the new bytes, wrapping around the end if needed */
+    tail = stream->ring_head + ring->length;
+    if (tail >= ring->capacity)
+        tail -= ring->capacity;
+    first = ring->capacity - tail;
+    if (first > length)
+        first = length;
+    memcpy(ring->buf + tail, buf, first);
+    memcpy(ring->buf, buf + first, length - first);
+    ring->length += length;
+}
+
+/**
+ * Add a segment to the stream. Bytes that continue the stream go onto
+ * the end of the ring. Bytes after a gap go into the list of
+ * out-of-order fragments, and move into the ring once the gap is
+ * filled.
+ * @return
+ *      the number of in-order bytes available to read
+ */
 static size_t
-tcp_append(struct tcpreasm_stream_t *stream, unsigned seqno, const unsigned char *buf, unsigned length)
+tcp_append(struct tcpreasm_ctx_t *ctx, struct tcpreasm_stream_t *stream, unsigned seqno, const unsigned char *buf, unsigned length)
 {
-    if (stream == NULL || length == 0)
+    unsigned end;
+
+    if (stream == NULL)
         return 0;
+    if (length == 0)
+        return stream->ring ? stream->ring->length : 0;
     
     /* set the first sequence number */
     if (!stream->is_payload_seen) {
         stream->seqno = seqno;
         stream->is_payload_seen = 1;
     }
-    
-    if (stream->fragments == NULL) {
-        stream->fragments = _fragment_new(seqno, buf, length, NULL);
+
+    /* Skip bytes we already have, or that have already been read, such
+     * as from a retransmission */
+    end = stream->seqno + (stream->ring ? stream->ring->length : 0);
+    if (SEQNO_LT(seqno, end)) {
+        unsigned skip = end - seqno;
+        if (skip >= length)
+            return stream->ring ? stream->ring->length : 0;
+        seqno += skip;
+        buf += skip;
+        length -= skip;
+    }
+
+    if (seqno == end) {
+        /* The common case: this segment continues the stream */
+        _ring_append(ctx, stream, buf, length);
+        end += length;
+
+        /* If this filled a gap, then move the out-of-order fragments
+         * that now continue the stream into the ring */
+        while (stream->fragments && SEQNO_LTE(stream->fragments->seqno, end)) {
+            struct fragment *frag = stream->fragments;
+            unsigned skip = end - frag->seqno;
+
+            if (skip < frag->length) {
+                _ring_append(ctx, stream, frag->buf + skip, frag->length - skip);
+                end += frag->length - skip;
+            }
+            stream->fragments = frag->next;
+            _frag_free(ctx, frag);
+        }
     } else {
         struct fragment **frag;
-        
-        for (frag=&stream->fragments; *frag; frag = &(*frag)->next) {
-            if (_frag_is_overlap(*frag, seqno, length)) {
-                _frag_merge(frag, seqno, buf, length);
-                length = 0;
-            } else if (_frag_is_after(*frag, seqno, length))
-                break;
+
+        /* Walk the out-of-order fragments, only adding the parts of this
+         * segment that fall into holes between them, so that fragments
+         * never overlap */
+        for (frag=&stream->fragments; *frag && length; frag = &(*frag)->next) {
+            unsigned frag_end = (*frag)->seqno + (*frag)->length;
+
+            if (SEQNO_LT(seqno, (*frag)->seqno)) {
+                /* Add the part that comes before this fragment */
+                unsigned count = (*frag)->seqno - seqno;
+                if (count > length)
+                    count = length;
+                *frag = _fragment_new(ctx, seqno, buf, count, *frag);
+                seqno += count;
+                buf += count;
+                length -= count;
+                continue;
+            }
+
+            if (SEQNO_LT(seqno, frag_end)) {
+                /* Skip the part we already have */
+                unsigned skip = frag_end - seqno;
+                if (skip > length)
+                    skip = length;
+                seqno += skip;
+                buf += skip;
+                length -= skip;
+            }
         }
         if (length)
-            *frag = _fragment_new(seqno, buf, length, *frag);
+            *frag = _fragment_new(ctx, seqno, buf, length, *frag);
     }
 
-    if (stream->fragments && stream->fragments->seqno == stream->seqno) {
-        return stream->fragments->length;
-    } else if (stream->fragments) {
-        return 0;
-    } else {
-        return 0;
-    }
+    return stream->ring ? stream->ring->length : 0;
 }
 
 
@@ -289,6 +445,7 @@ struct tcpreasm_ctx_t *
 tcpreasm_create(size_t userdata_size, void (*cleanup)(void *userdata), time_t started, unsigned default_timeout)
 {
     struct tcpreasm_ctx_t *ctx;
+    size_t i;
     
     /* Create a hashmap key to make hashtables unpredictable.
      * FIXME: this should grab something more random */
@@ -319,6 +476,11 @@ tcpreasm_create(size_t userdata_size, void (*cleanup)(void *userdata), time_t st
     ctx->cleanup_userdata = cleanup;
     ctx->default_timeout = default_timeout;
 
+    /* Create pools for streams and their buffered bytes */
+    _pool_init(&ctx->stream_pool, sizeof(struct tcpreasm_stream_t) + userdata_size);
+    for (i=0; i<TCPREASM_BUFFER_CLASSES; i++)
+        _pool_init(&ctx->buffer_pools[i], buffer_classes[i]);
+
     /* Create a timeouts subsystem for aging out old connections */
     ctx->timeouts = timeouts_create(started, 0);
     return ctx;
@@ -330,9 +492,10 @@ _stream_new(struct tcpreasm_ctx_t *ctx, const struct tcpreasm_connkey_t *conn, t
     struct tcpreasm_stream_t *stream;
     
     /* Allocate memory for this object */
-    stream = calloc(1, sizeof(*stream) + ctx->sizeof_userdata);
+    stream = _pool_alloc(&ctx->stream_pool);
     if (stream == NULL)
         return NULL;
+    memset(stream, 0, sizeof(*stream) + ctx->sizeof_userdata);
     
     /* Copy over src/dst addr/port */
     memcpy(&stream->conn, conn, sizeof(*conn));
@@ -364,19 +527,21 @@ _stream_delete(struct tcpreasm_ctx_t *ctx, const struct tcpreasm_stream_t *in_st
     timeout_unlink(&stream->timeout);
     
     /* Free any unprocessed fragments */
+    if (stream->ring)
+        _frag_free(ctx, stream->ring);
     while (stream->fragments) {
         struct fragment *frag;
         frag = stream->fragments;
         stream->fragments = frag->next;
-        free(frag);
+        _frag_free(ctx, frag);
     }
     
     /* If we've got a callback, then call it */
     if (ctx->cleanup_userdata)
         ctx->cleanup_userdata(stream->userdata);
     
-    /* Finally, free the memory for this stream */
-    free(stream);
+    /* Finally, return the memory for this stream to the pool */
+    _pool_free(&ctx->stream_pool, stream);
     
     return NULL;
 }
@@ -489,7 +654,7 @@ tcpreasm_packet(struct tcpreasm_ctx_t *ctx, const unsigned char *buf, size_t len
         /* The connection was closed, ony close the connection if
          * there's no pending data, otherwise, wait for timeout
          * to cleanup the connection */
-        if (stream->fragments == NULL) {
+        if (stream->ring == NULL && stream->fragments == NULL) {
             _stream_delete(ctx, stream);
             stream = NULL;
         }
@@ -497,7 +662,7 @@ tcpreasm_packet(struct tcpreasm_ctx_t *ctx, const unsigned char *buf, size_t len
 
     /* Append this data */
     result.conn = &stream->conn;
-    result.available = tcp_append(stream, seqno, buf + offset, (unsigned)payload_length);
+    result.available = tcp_append(ctx, stream, seqno, buf + offset, (unsigned)payload_length);
     result.userdata = &stream->userdata;
     result.ctx = ctx;
     return result;
@@ -508,10 +673,32 @@ fail:
 }
 
 
+/**
+ * Move past bytes at the start of the ring. Once the ring is empty, give
+ * it back to the pool, so idle connections don't hold buffers.
+ */
+static void
+_ring_consume(struct tcpreasm_ctx_t *ctx, struct tcpreasm_stream_t *stream, unsigned length)
+{
+    struct fragment *ring = stream->ring;
+
+    ring->length -= length;
+    stream->ring_head += length;
+    if (stream->ring_head >= ring->capacity)
+        stream->ring_head -= ring->capacity;
+    if (ring->length == 0) {
+        _frag_free(ctx, ring);
+        stream->ring = NULL;
+        stream->ring_head = 0;
+    }
+    stream->seqno += length;
+}
+
 size_t tcpreasm_read(struct tcpreasm_tuple_t *handle, unsigned char *buf, size_t length)
 {
     struct tcpreasm_stream_t *stream;
-    struct fragment *frag;
+    struct fragment *ring;
+    size_t first;
     
     /* Get a handel to the stream */
     stream = hashmapGet(handle->ctx->conntable, handle->conn);
@@ -519,31 +706,73 @@ size_t tcpreasm_read(struct tcpreasm_tuple_t *handle, unsigned char *buf, size_t
         return 0;
     
     /* Make sure the there's any data avaialble */
-    frag = stream->fragments;
-    if (frag == NULL)
-        return 0;
-    if (frag->seqno != stream->seqno)
+    ring = stream->ring;
+    if (ring == NULL)
         return 0;
     
     /* If asking for more data than exists, shrink to how much is available */
-    if (length > frag->length)
-        length = frag->length;
+    if (length > ring->length)
+        length = ring->length;
     
-    /* Copy over the number of bytes */
-    memcpy(buf, frag->buf, length);
+    /* Copy over the number of bytes, which may wrap around the end */
+    first = ring->capacity - stream->ring_head;
+    if (first > length)
+        first = length;
+    memcpy(buf, ring->buf + stream->ring_head, first);
+    memcpy(buf + first, ring->buf, length - first);
     
-    /* Shrink the curent fragment */
-    if (length >= frag->length) {
-        assert(length == frag->length);
-        stream->fragments = frag->next;
-        free(frag);
-    } else {
-        frag->length -= length;
-        memmove(frag->buf, frag->buf + length, frag->length);
-        frag->seqno += length;
+    _ring_consume(handle->ctx, stream, (unsigned)length);
+    
+    return length;
+}
+
+size_t tcpreasm_peek(struct tcpreasm_tuple_t *handle, size_t length, const unsigned char **r_ptr)
+{
+    struct tcpreasm_stream_t *stream;
+    struct fragment *ring;
+    
+    *r_ptr = NULL;
+    
+    /* Get a handel to the stream */
+    stream = hashmapGet(handle->ctx->conntable, handle->conn);
+    if (stream == NULL)
+        return 0;
+    
+    /* Make sure the there's any data avaialble */
+    ring = stream->ring;
+    if (ring == NULL)
+        return 0;
+    
+    /* If asking for more data than exists, shrink to how much is available */
+    if (length > ring->length)
+        length = ring->length;
+    
+    /* In the rare case that the bytes wrap around the end of the ring,
+     * straighten it out first, so they can be returned as one chunk */
+    if (stream->ring_head + length > ring->capacity) {
+        ring = _ring_resize(handle->ctx, stream, ring->capacity);
+        if (ring == NULL)
+            return 0;
     }
-    stream->seqno += length;
     
+    *r_ptr = ring->buf + stream->ring_head;
+    return length;
+}
+
+size_t tcpreasm_consume(struct tcpreasm_tuple_t *handle, size_t length)
+{
+    struct tcpreasm_stream_t *stream;
+    
+    /* Get a handel to the stream */
+    stream = hashmapGet(handle->ctx->conntable, handle->conn);
+    if (stream == NULL || stream->ring == NULL)
+        return 0;
+    
+    /* If asking for more data than exists, shrink to how much is available */
+    if (length > stream->ring->length)
+        length = stream->ring->length;
+    
+    _ring_consume(handle->ctx, stream, (unsigned)length);
     return length;
 }
 
@@ -567,3 +796,428 @@ size_t tcpreasm_timeouts(struct tcpreasm_ctx_t *ctx, time_t secs, long nanosec)
     
     return count;
 }
+
+/**
+ * Callback for hashmapForEach() that appends each stream to an array
+ */
+static bool
+_stream_gather(void *key, void *value, void *context)
+{
+    struct tcpreasm_stream_t ***next = (struct tcpreasm_stream_t ***)context;
+    
+    (void)key;
+    *(*next)++ = (struct tcpreasm_stream_t *)value;
+    return true;
+}
+
+void tcpreasm_destroy(struct tcpreasm_ctx_t *ctx)
+{
+    struct tcpreasm_stream_t **streams;
+    size_t count;
+    size_t i;
+    
+    if (ctx == NULL)
+        return;
+    
+    /* Gather the remaining streams first, because they can't be removed
+     * from the hashmap while we are iterating over it */
+    count = hashmapSize(ctx->conntable);
+    streams = malloc((count + 1) * sizeof(*streams));
+    if (streams) {
+        struct tcpreasm_stream_t **next = streams;
+        hashmapForEach(ctx->conntable, _stream_gather, &next);
+        for (i=0; i<count; i++)
+            _stream_delete(ctx, streams[i]);
+        free(streams);
+    }
+    
+    hashmapFree(ctx->conntable);
+    timeouts_destroy(ctx->timeouts);
+    _pool_destroy(&ctx->stream_pool);
+    for (i=0; i<TCPREASM_BUFFER_CLASSES; i++)
+        _pool_destroy(&ctx->buffer_pools[i]);
+    free(ctx);
+}
+
+void
+tcpreasm_stats(const struct tcpreasm_ctx_t *ctx, struct tcpreasm_stats_t *stats)
+{
+    size_t i;
+
+    stats->streams = ctx->stream_pool.stats;
+    for (i=0; i<TCPREASM_BUFFER_CLASSES; i++)
+        stats->buffers[i] = ctx->buffer_pools[i].stats;
+    stats->oversize_in_use = ctx->oversize_in_use;
+}
+
+/**
+ * The byte at 'offset' in the self-test streams, a pattern that won't
+ * line up with any of the buffer sizes, so that misplaced bytes are
+ * noticed.
+ */
+static unsigned char
+_selftest_byte(size_t offset)
+{
+    return (unsigned char)(offset * 7 + offset / 251);
+}
+
+/**
+ * Build an IPv4/TCP packet from 10.0.0.1:'port' to 10.0.0.2:53, holding
+ * the bytes of the stream starting at 'offset', and give it to the
+ * reassembler.
+ */
+static struct tcpreasm_tuple_t
+_selftest_packet(struct tcpreasm_ctx_t *ctx, unsigned port, unsigned flags, size_t offset, size_t length)
+{
+    static const unsigned char hdr[40] = {
+        0x45, 0, 0, 0,  0, 0, 0, 0,  64, 6, 0, 0,
+        10, 0, 0, 1,  10, 0, 0, 2,
+        0, 0, 0, 53,  0, 0, 0, 0,  0, 0, 0, 0,  0x50, 0, 0xff, 0xff,  0, 0, 0, 0,
+    };
+    struct tcpreasm_tuple_t result = {0};
+    unsigned char *buf;
+    unsigned seqno = 1000 + (unsigned)offset;
+    size_t i;
+
+    buf = malloc(sizeof(hdr) + length);
+    if (buf == NULL)
+        return result;
+    memcpy(buf, hdr, sizeof(hdr));
+    buf[20] = (unsigned char)(port >> 8);
+    buf[21] = (unsigned char)(port >> 0);
+    buf[24] = (unsigned char)(seqno >> 24);
+    buf[25] = (unsigned char)(seqno >> 16);
+    buf[26] = (unsigned char)(seqno >> 8);
+    buf[27] = (unsigned char)(seqno >> 0);
+    buf[33] = (unsigned char)flags;
+    for (i=0; i<length; i++)
+        buf[sizeof(hdr) + i] = _selftest_byte(offset + i);
+
+    result = tcpreasm_packet(ctx, buf, sizeof(hdr) + length, 1, 0);
+    free(buf);
+    return result;
+}
+
+/**
+ * Open a connection with a SYN. The SYN takes up one sequence number,
+ * the one just before offset 0 of the stream.
+ */
+static struct tcpreasm_tuple_t
+_selftest_open(struct tcpreasm_ctx_t *ctx, unsigned port)
+{
+    return _selftest_packet(ctx, port, 0x02, (size_t)-1, 0);
+}
+
+/**
+ * Test that streams and buffers come from the pools and go back to them,
+ * and that the memory is reused rather than allocated again.
+ */
+static int
+_selftest_pools(void)
+{
+    struct tcpreasm_ctx_t *ctx;
+    struct tcpreasm_stats_t stats;
+    size_t allocated;
+    unsigned port;
+    size_t i;
+
+    ctx = tcpreasm_create(24, NULL, 0, 60);
+    if (ctx == NULL)
+        return 1;
+
+    /* Streams, including their userdata, are aligned in the pool */
+    tcpreasm_stats(ctx, &stats);
+    if (stats.streams.in_use != 0 || stats.streams.item_size % POOL_ALIGN
+        || stats.streams.item_size < sizeof(struct tcpreasm_stream_t) + 24) {
+        fprintf(stderr, "[-] tcpreasm: bad stream pool\n");
+        goto fail;
+    }
+
+    /* Open many connections, each buffering an out-of-order segment of
+     * a different size, from the smallest pool to bigger than any */
+    for (port=1000; port<1100; port++) {
+        static const size_t sizes[] = {50, 400, 1000, 70000};
+        _selftest_open(ctx, port);
+        _selftest_packet(ctx, port, 0x10, 10, sizes[port % 4]);
+    }
+    tcpreasm_stats(ctx, &stats);
+    if (stats.streams.in_use != 100 || stats.streams.high_water != 100
+        || stats.streams.allocated < 100
+        || stats.buffers[0].in_use != 25
+        || stats.buffers[1].in_use != 25
+        || stats.buffers[2].in_use != 25
+        || stats.oversize_in_use != 25) {
+        fprintf(stderr, "[-] tcpreasm: pools not used\n");
+        goto fail;
+    }
+    allocated = stats.streams.allocated;
+
+    /* Resetting the connections gives everything back */
+    for (port=1000; port<1100; port++)
+        _selftest_packet(ctx, port, 0x04, 0, 0);
+    tcpreasm_stats(ctx, &stats);
+    if (stats.streams.in_use != 0 || stats.streams.high_water != 100
+        || stats.oversize_in_use != 0) {
+        fprintf(stderr, "[-] tcpreasm: streams not freed\n");
+        goto fail;
+    }
+    for (i=0; i<TCPREASM_BUFFER_CLASSES; i++) {
+        if (stats.buffers[i].in_use != 0) {
+            fprintf(stderr, "[-] tcpreasm: buffers not freed\n");
+            goto fail;
+        }
+    }
+
+    /* The same number of connections again reuses the same memory */
+    for (port=2000; port<2100; port++)
+        _selftest_open(ctx, port);
+    tcpreasm_stats(ctx, &stats);
+    if (stats.streams.in_use != 100 || stats.streams.allocated != allocated) {
+        fprintf(stderr, "[-] tcpreasm: pool memory not reused\n");
+        goto fail;
+    }
+
+    /* Destroying the reassembler with connections still open shouldn't
+     * leak, which the sanitizers will catch */
+    tcpreasm_destroy(ctx);
+    return 0; /* success */
+
+fail:
+    tcpreasm_destroy(ctx);
+    return 1; /* failure */
+}
+
+/**
+ * Read 'length' bytes from the stream and check they are the bytes
+ * starting at '*offset' in the stream.
+ */
+static int
+_selftest_read(struct tcpreasm_tuple_t *t, size_t *offset, size_t length)
+{
+    unsigned char buf[4096];
+    size_t count;
+    size_t i;
+
+    assert(length <= sizeof(buf));
+    count = tcpreasm_read(t, buf, length);
+    if (count != length)
+        return 0;
+    for (i=0; i<count; i++) {
+        if (buf[i] != _selftest_byte(*offset + i))
+            return 0;
+    }
+    *offset += count;
+    return 1;
+}
+
+/**
+ * Test that in-order bytes come out of the ring correctly as it grows
+ * and wraps around, and that out-of-order and retransmitted segments
+ * end up in the right place.
+ */
+static int
+_selftest_ring(void)
+{
+    struct tcpreasm_ctx_t *ctx;
+    struct tcpreasm_tuple_t t;
+    struct tcpreasm_stats_t stats;
+    unsigned char c;
+    size_t written = 0;
+    size_t offset = 0;
+    unsigned wrapped = 0;
+    unsigned seed = 1;
+    size_t i;
+
+    ctx = tcpreasm_create(0, NULL, 0, 60);
+    if (ctx == NULL)
+        return 1;
+    t = _selftest_open(ctx, 3000);
+
+    /* Write segments and read chunks of different sizes, so that the
+     * start of the bytes moves all around the ring */
+    while (written < 1000000) {
+        struct tcpreasm_stream_t *stream;
+        size_t length;
+
+        seed = seed * 1103515245 + 12345;
+        length = 1 + (seed >> 16) % 1400;
+        t = _selftest_packet(ctx, 3000, 0x10, written, length);
+        written += length;
+        if (t.available != written - offset) {
+            fprintf(stderr, "[-] tcpreasm: %u bytes available, expected %u\n",
+                    (unsigned)t.available, (unsigned)(written - offset));
+            goto fail;
+        }
+
+        stream = hashmapGet(ctx->conntable, t.conn);
+        if (stream->ring && stream->ring_head + stream->ring->length > stream->ring->capacity)
+            wrapped++;
+
+        seed = seed * 1103515245 + 12345;
+        length = (seed >> 16) % 1500;
+        if (length > written - offset)
+            length = written - offset;
+        if (!_selftest_read(&t, &offset, length)) {
+            fprintf(stderr, "[-] tcpreasm: bad bytes at %u\n", (unsigned)offset);
+            goto fail;
+        }
+    }
+    if (wrapped == 0) {
+        fprintf(stderr, "[-] tcpreasm: ring never wrapped\n");
+        goto fail;
+    }
+
+    /* A segment after a gap isn't available yet, nor is one that
+     * retransmits bytes already read, until the gap is filled */
+    t = _selftest_packet(ctx, 3000, 0x10, written + 100, 200);
+    if (t.available != written - offset)
+        goto fail_order;
+    t = _selftest_packet(ctx, 3000, 0x10, offset - 20, 20);
+    if (t.available != written - offset)
+        goto fail_order;
+
+    /* Segments that overlap either end of the out-of-order one */
+    t = _selftest_packet(ctx, 3000, 0x10, written + 80, 40);
+    if (t.available != written - offset)
+        goto fail_order;
+    t = _selftest_packet(ctx, 3000, 0x10, written + 290, 30);
+    if (t.available != written - offset)
+        goto fail_order;
+
+    /* Now fill the gap, partly with a retransmission */
+    t = _selftest_packet(ctx, 3000, 0x10, written - 20, 70);
+    if (t.available != written + 50 - offset)
+        goto fail_order;
+    t = _selftest_packet(ctx, 3000, 0x10, written + 50, 100);
+    if (t.available != written + 320 - offset)
+        goto fail_order;
+    written += 320;
+    while (offset < written) {
+        size_t length = written - offset;
+        if (length > 1000)
+            length = 1000;
+        if (!_selftest_read(&t, &offset, length))
+            goto fail_order;
+    }
+
+    /* Once everything is read, no buffers are held */
+    if (tcpreasm_read(&t, &c, 1) != 0)
+        goto fail_order;
+    tcpreasm_stats(ctx, &stats);
+    for (i=0; i<TCPREASM_BUFFER_CLASSES; i++) {
+        if (stats.buffers[i].in_use != 0) {
+            fprintf(stderr, "[-] tcpreasm: ring not freed when empty\n");
+            goto fail;
+        }
+    }
+
+    tcpreasm_destroy(ctx);
+    return 0; /* success */
+
+fail_order:
+    fprintf(stderr, "[-] tcpreasm: out-of-order segments misplaced\n");
+fail:
+    tcpreasm_destroy(ctx);
+    return 1; /* failure */
+}
+
+/**
+ * Test that tcpreasm_peek() always returns the next bytes as one
+ * contiguous chunk, even when they wrap around the end of the ring, and
+ * that tcpreasm_consume() removes them.
+ */
+static int
+_selftest_peek(void)
+{
+    struct tcpreasm_ctx_t *ctx;
+    struct tcpreasm_tuple_t t;
+    const unsigned char *p;
+    size_t written = 0;
+    size_t offset = 0;
+    unsigned straightened = 0;
+    unsigned seed = 2;
+    size_t i;
+
+    ctx = tcpreasm_create(0, NULL, 0, 60);
+    if (ctx == NULL)
+        return 1;
+    t = _selftest_open(ctx, 4000);
+
+    /* Nothing to peek at or consume yet */
+    if (tcpreasm_peek(&t, 10, &p) != 0 || p != NULL || tcpreasm_consume(&t, 10) != 0) {
+        fprintf(stderr, "[-] tcpreasm: peek/consume on empty stream\n");
+        goto fail;
+    }
+
+    while (written < 1000000) {
+        struct tcpreasm_stream_t *stream;
+        size_t available;
+        size_t length;
+        size_t count;
+
+        seed = seed * 1103515245 + 12345;
+        length = 1 + (seed >> 16) % 1400;
+        t = _selftest_packet(ctx, 4000, 0x10, written, length);
+        written += length;
+        available = written - offset;
+
+        /* Peek at a PDU, sometimes asking for more than there is */
+        seed = seed * 1103515245 + 12345;
+        length = (seed >> 16) % 2000;
+        stream = hashmapGet(ctx->conntable, t.conn);
+        if (stream->ring_head + (length < available ? length : available) > stream->ring->capacity)
+            straightened++;
+        count = tcpreasm_peek(&t, length, &p);
+        if (count != (length < available ? length : available)) {
+            fprintf(stderr, "[-] tcpreasm: peeked %u bytes, expected %u\n",
+                    (unsigned)count, (unsigned)length);
+            goto fail;
+        }
+        for (i=0; i<count; i++) {
+            if (p[i] != _selftest_byte(offset + i)) {
+                fprintf(stderr, "[-] tcpreasm: bad bytes peeked at %u\n", (unsigned)(offset + i));
+                goto fail;
+            }
+        }
+
+        /* Consume some or all of it, as if it were a complete PDU */
+        seed = seed * 1103515245 + 12345;
+        length = count ? (seed >> 16) % count + 1 : 0;
+        if (tcpreasm_consume(&t, length) != length) {
+            fprintf(stderr, "[-] tcpreasm: consume failed\n");
+            goto fail;
+        }
+        offset += length;
+    }
+    if (straightened == 0) {
+        fprintf(stderr, "[-] tcpreasm: peek never crossed the end of the ring\n");
+        goto fail;
+    }
+
+    /* Consuming more than is available removes what there is, after
+     * which there's nothing left */
+    if (tcpreasm_consume(&t, written - offset + 100) != written - offset
+        || tcpreasm_peek(&t, 1, &p) != 0) {
+        fprintf(stderr, "[-] tcpreasm: consume past the end\n");
+        goto fail;
+    }
+
+    tcpreasm_destroy(ctx);
+    return 0; /* success */
+
+fail:
+    tcpreasm_destroy(ctx);
+    return 1; /* failure */
+}
+
+int
+tcpreasm_selftest(void)
+{
+    if (_selftest_pools())
+        return 1;
+    if (_selftest_ring())
+        return 1;
+    if (_selftest_peek())
+        return 1;
+    return 0;
+}
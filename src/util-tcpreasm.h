@@ -52,6 +52,44 @@ void tcpreasm_destroy(struct tcpreasm_ctx_t *ctx);
  */
 size_t tcpreasm_timeouts(struct tcpreasm_ctx_t *ctx, time_t secs, long nanosec);
 
+/**
+ * Streams and buffers come from pools owned by the reassembler, rather
+ * than from malloc() each time. Fragment buffers are drawn from pools
+ * of increasing size, each of which is one "size class".
+ */
+enum {TCPREASM_BUFFER_CLASSES = 6};
+
+/**
+ * How much memory one pool is using.
+ */
+struct tcpreasm_poolstats_t {
+    /** The number of bytes in each item */
+    size_t item_size;
+    /** The number of items currently handed out */
+    size_t in_use;
+    /** The largest 'in_use' has ever been */
+    size_t high_water;
+    /** The number of items allocated from the system, either in use
+     * or free to be reused */
+    size_t allocated;
+};
+
+struct tcpreasm_stats_t {
+    /** The pool of TCP connection structures, including userdata */
+    struct tcpreasm_poolstats_t streams;
+    /** Pools for buffered payload bytes, from smallest to largest */
+    struct tcpreasm_poolstats_t buffers[TCPREASM_BUFFER_CLASSES];
+    /** Buffers too large for any pool, which use malloc() instead */
+    size_t oversize_in_use;
+};
+
+/**
+ * Reports how many streams and buffers the reassembler is using, and
+ * the most it has ever used at once.
+ */
+void
+tcpreasm_stats(const struct tcpreasm_ctx_t *ctx, struct tcpreasm_stats_t *stats);
+
 /**
  * Holds the results tcp_insert_packet(), to tell us whether we can read the packet
  * contents.
@@ -92,5 +130,42 @@ tcpreasm_packet(struct tcpreasm_ctx_t *ctx, const unsigned char *buf, size_t len
 size_t
 tcpreasm_read(struct tcpreasm_tuple_t *stream, unsigned char *buf, size_t length);
 
+/**
+ * Returns a pointer to the next bytes in the TCP stream, without copying
+ * them or removing them from the stream. This is for parsing a message
+ * in place, then calling tcpreasm_consume() to remove it.
+ * @param stream
+ *      A handle to the TCP stream, returned from tcpreasm_insert_packet().
+ * @param length
+ *      The requested number of bytes.
+ * @param r_ptr
+ *      Receives a pointer to the bytes. This stays valid until the next
+ *      call to tcpreasm_read(), tcpreasm_consume(), tcpreasm_packet(),
+ *      or tcpreasm_timeouts().
+ * @return
+ *      The number of bytes at 'r_ptr', which is fewer than 'length' if
+ *      fewer are available, or 0 if none are.
+ */
+size_t
+tcpreasm_peek(struct tcpreasm_tuple_t *stream, size_t length, const unsigned char **r_ptr);
+
+/**
+ * Removes bytes from the start of the TCP stream, such as after
+ * they've been processed with tcpreasm_peek().
+ * @return
+ *      The number of bytes removed, which is fewer than 'length' if
+ *      fewer are available.
+ */
+size_t
+tcpreasm_consume(struct tcpreasm_tuple_t *stream, size_t length);
+
+/**
+ * Unit-test this module.
+ * @return
+ *      0 on success, a positive integer otherwise.
+ */
+int
+tcpreasm_selftest(void);
+
 #endif
 
@@ -9,6 +9,16 @@
 
 #define TICKS_PER_SECOND 16384
 
+/**
+ * Each wheel has 64 slots, so that a single 64-bit word can track which
+ * slots are occupied. Eleven wheels of 6 bits each cover the full
+ * 64-bit range of timestamps.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_COUNT ((64 + WHEEL_BITS - 1) / WHEEL_BITS)
+
 /**
  * Convert the external time into an internal timestamp, the count of the
  * number of 'ticks'. A tick is roughly 1/16k of a second, or roughly
@@ -24,40 +34,181 @@ timestamp_from_tv(uint64_t secs, long nanosec)
     return (secs << 14ULL) + (nanosec>>16ULL);
 }
 
+static inline unsigned
+_ctz64(uint64_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+static inline unsigned
+_log2_64(uint64_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, mask);
+    return index;
+#else
+    return 63 - __builtin_clzll(mask);
+#endif
+}
+
 
 /**
- * The timeout system is a circular ring. We move an index around the 
- * ring. At each slot in the ring is a linked-list of all entries at
- * that time index. Because the ring can wrap, not everything at a given
- * entry will be the same timestamp. Therefore, when doing the timeout
- * logic at a slot, we have to doublecheck the actual timestamp, and skip
- * those things that are further in the future.
+ * The timeout system is a stack of wheels. An entry lives in the wheel
+ * given by the highest bit where its timestamp differs from the current
+ * time, in the slot given by its timestamp's bits for that wheel. Thus,
+ * everything in wheel 0 expires within 64 ticks, everything in wheel 1
+ * within 64*64 ticks, and so on.
+ *
+ * Every entry in a wheel shares all the higher bits with the current
+ * time, and its slot is always ahead of the current time's slot in that
+ * wheel. When the current time reaches the start of an occupied slot,
+ * its entries are re-inserted, which drops them into lower wheels, or
+ * onto the 'expired' list once their time has come.
  */
 struct Timeouts {
     /**
-     * This index is a monotonically increasing number, modulus the mask.
-     * Every time we check timeouts, we simply move it foreward in time.
+     * The last tick we've processed. Everything with a timestamp at or
+     * before this is on the 'expired' list rather than in a wheel.
      */
-    uint64_t last_timestamp;
+    uint64_t current;
 
     /**
-     * The number of slots is a power-of-2, so the mask is just this
-     * number minus 1
+     * Entries whose time has passed, waiting to be handed back by
+     * timeouts_remove_older().
      */
-    unsigned mask;
+    struct TimeoutEntry *expired;
 
     /**
-     * The ring of entries.
+     * One bit per slot that might hold entries. Since timeout_unlink()
+     * doesn't know which wheel an entry is in, bits aren't cleared when
+     * an entry is unlinked, only when we visit the slot and find it
+     * empty.
      */
-    struct TimeoutEntry *slots[1024*1024];
-    
+    uint64_t occupied[WHEEL_COUNT];
+
     /**
-     * Incremented every time we add one, and decremented every time we remove one
+     * The wheels of entries.
      */
-    size_t outstanding;
+    struct TimeoutEntry *slots[WHEEL_COUNT][WHEEL_SLOTS];
 };
 
+/**
+ * Push the entry on the front of a linked-list.
+ */
+static void
+_push(struct TimeoutEntry **list, struct TimeoutEntry *entry)
+{
+    entry->next = *list;
+    *list = entry;
+    entry->prev = list;
+    if (entry->next)
+        entry->next->prev = &entry->next;
+}
+
+/**
+ * Put an (unlinked) entry into the right wheel relative to the current
+ * time, or onto the expired list if its time has already come.
+ */
+static void
+_schedule(struct Timeouts *timeouts, struct TimeoutEntry *entry)
+{
+    uint64_t timestamp = entry->timestamp;
+    unsigned wheel;
+    unsigned slot;
+
+    if (timestamp <= timeouts->current) {
+        _push(&timeouts->expired, entry);
+        return;
+    }
+
+    wheel = _log2_64(timestamp ^ timeouts->current) / WHEEL_BITS;
+    slot = (timestamp >> (wheel * WHEEL_BITS)) & WHEEL_MASK;
+    _push(&timeouts->slots[wheel][slot], entry);
+    timeouts->occupied[wheel] |= 1ULL << slot;
+}
+
+/**
+ * Find the next tick at which an occupied slot in some wheel comes due,
+ * which is the tick where the current time enters that slot.
+ * @return
+ *      0 if all the wheels are empty, 1 otherwise
+ */
+static int
+_next_due(const struct Timeouts *timeouts, uint64_t *r_due, unsigned *r_wheel, unsigned *r_slot)
+{
+    uint64_t best = UINT64_MAX;
+    unsigned wheel;
+    int found = 0;
+
+    for (wheel = 0; wheel < WHEEL_COUNT; wheel++) {
+        unsigned shift = wheel * WHEEL_BITS;
+        unsigned slot;
+        uint64_t due;
+
+        if (timeouts->occupied[wheel] == 0)
+            continue;
+        slot = _ctz64(timeouts->occupied[wheel]);
+
+        /* Keep the current time's bits above this wheel, and replace
+         * this wheel's bits with the slot number */
+        if (shift + WHEEL_BITS < 64)
+            due = timeouts->current & ~((1ULL << (shift + WHEEL_BITS)) - 1);
+        else
+            due = 0;
+        due |= (uint64_t)slot << shift;
+
+        if (!found || due < best) {
+            best = due;
+            *r_wheel = wheel;
+            *r_slot = slot;
+            found = 1;
+        }
+    }
+    *r_due = best;
+    return found;
+}
 
+/**
+ * Move time forward until either something has expired, or we reach the
+ * 'target' tick. Cost is proportional to the number of slots that have
+ * entries, not to the number of ticks between now and the target.
+ */
+static void
+_advance(struct Timeouts *timeouts, uint64_t target)
+{
+    while (timeouts->expired == NULL && timeouts->current < target) {
+        struct TimeoutEntry *list;
+        uint64_t due;
+        unsigned wheel = 0;
+        unsigned slot = 0;
+
+        if (!_next_due(timeouts, &due, &wheel, &slot) || due > target) {
+            timeouts->current = target;
+            break;
+        }
+
+        /* Jump directly to when that slot comes due, then take the
+         * entire slot and distribute its entries to lower wheels */
+        timeouts->current = due;
+        timeouts->occupied[wheel] &= ~(1ULL << slot);
+        list = timeouts->slots[wheel][slot];
+        timeouts->slots[wheel][slot] = NULL;
+        while (list) {
+            struct TimeoutEntry *entry = list;
+            list = entry->next;
+            entry->next = 0;
+            entry->prev = 0;
+            _schedule(timeouts, entry);
+        }
+    }
+}
 
 
 /***************************************************************************
@@ -74,23 +225,14 @@ timeouts_create(uint64_t now, long nanosec)
     timeouts = calloc(1, sizeof(*timeouts));
     if (timeouts == NULL)
         abort();
-    
-    /*
-     * We just mask off the low order bits to determine wrap. I'm using
-     * a variable here because one of these days I'm going to make
-     * the size of the ring dynamically adjustable depending upon
-     * the speed of the scan.
-     */
-    timeouts->mask = sizeof(timeouts->slots)/sizeof(timeouts->slots[0]) - 1;
 
     /*
      * Set the index to the current time. Note that this timestamp is
-     * the 'time_t' value multiplied by the number of ticks-per-second,
-     * where 'ticks' is something I've defined for scanning. Right now
-     * I hard-code in the size of the ticks, but eventually they'll be
-     * dynamically resized depending upon the speed of the scan.
+     * the 'time_t' value multiplied by the number of ticks-per-second.
+     * Something only expires once time has moved past its tick, so
+     * the current tick itself hasn't been processed yet.
      */
-    timeouts->last_timestamp = timestamp;
+    timeouts->current = timestamp ? timestamp - 1 : 0;
 
 
     return timeouts;
@@ -123,7 +265,6 @@ timeouts_add(struct Timeouts *timeouts, struct TimeoutEntry *entry,
              size_t offset, uint64_t secs, long nanosecs)
 {
     uint64_t timestamp = timestamp_from_tv(secs, nanosecs);
-    unsigned index;
 
     /* Unlink from wherever the entry came from */
     timeout_unlink(entry);
@@ -133,12 +274,7 @@ timeouts_add(struct Timeouts *timeouts, struct TimeoutEntry *entry,
     entry->offset = (unsigned)offset;
 
     /* Link it into it's new location */
-    index = timestamp & timeouts->mask;
-    entry->next = timeouts->slots[index];
-    timeouts->slots[index] = entry;
-    entry->prev = &timeouts->slots[index];
-    if (entry->next)
-        entry->next->prev = &entry->next;
+    _schedule(timeouts, entry);
 }
 
 
@@ -146,36 +282,19 @@ void *
 timeouts_remove_older(struct Timeouts *timeouts, uint64_t secs, long nanosec)
 {
     uint64_t now;
-    uint64_t timestamp;
-    struct TimeoutEntry *entry = NULL;
+    struct TimeoutEntry *entry;
     
-    /* Convert the external time into our internal tick-count */
+    /* Convert the external time into our internal tick-count. Only
+     * ticks before the current one are finished. */
     now = timestamp_from_tv(secs, nanosec);
- 
-    /* Starting from the last timestamp we checked, move forward
-     * in time checking timeouts until we reach the current time */
-    for (timestamp = timeouts->last_timestamp; timestamp < now; timestamp++) {
-        size_t index;
-        
-        /* Convert the timestamp into a table index. Basically, we are hashing
-         * the timestamp -- but the hash is simply based upon the least
-         * significant bits of the timestamp. */
-        index = timestamp & timeouts->mask;
-        
-        /* Get the 'head' of the linked list at the specified bucket/slot  */
-        entry = timeouts->slots[index];
-
-        /* enumerate through the linked list until we either reach the end,
-         * or reach an entry that needs to expire */
-        while (entry && entry->timestamp > now)
-            entry = entry->next;
-        if (entry)
-            break;
-    }
-    
-    /* Remember the last timestamp we checked */
-    timeouts->last_timestamp = timestamp;
+    if (now)
+        now--;
+
+    /* Move forward in time until something expires, or we've caught
+     * up with the current time */
+    _advance(timeouts, now);
 
+    entry = timeouts->expired;
     if (entry == NULL) {
         /* we've caught up to the current time, and there's nothing
          * left to timeout, so return NULL */
@@ -200,4 +319,3 @@ timeouts_destroy(struct Timeouts *ctx)
      * with a timestamp far in the future to remove everything. */
     free(ctx);
 }
-
@@ -9,12 +9,16 @@
  send a packet, we need to resend it in the future in case we don't
  get a response.
 
- This design creates a large "ring" of timeouts, and then cycles
- again and again through the ring. It's terribly inefficient if
- the number of timeouts are fewer than 100 per second, or greater
- than 10 million per second.
+ This design is a hierarchical timing wheel: a stack of small rings,
+ where each slot in a higher ring covers a whole rotation of the ring
+ beneath it. Entries far in the future sit in a coarse ring, and are
+ moved down into finer rings as their time approaches. Adding and
+ removing an entry is O(1), and catching up with the current time
+ costs in proportion to the entries that expire, not the time that
+ has passed, so a multi-hour gap between packets in a capture file
+ is as cheap as a one millisecond gap.
  
- The granularity/precision of the ticks is about 100,000 per
+ The granularity/precision of the ticks is about 16,000 per
  second. I keep adjusting the granularity internally whenever
  I want more/less precision.
 
@@ -67,7 +71,8 @@ struct TimeoutEntry {
 };
 
 /**
- * Removes the timeout from the linked-list of timeouts.
+ * Removes the timeout from the linked-list of timeouts. This doesn't
+ * need the 'struct Timeouts' it came from.
  */
 void
 timeout_unlink(struct TimeoutEntry *entry);